@@ -0,0 +1,34 @@
+#include "arena.hpp"
+#include <cstddef>
+
+using namespace std;
+
+const size_t ARENA_BLOCK = 64 * 1024;      // holds all but the longest lines
+
+alignas(max_align_t) static char arena_block[ARENA_BLOCK];
+static pmr::monotonic_buffer_resource arena(arena_block, sizeof(arena_block),
+                                            pmr::new_delete_resource());
+static int scope_depth = 0;
+
+pmr::memory_resource* line_arena()
+{
+    return &arena;
+}
+
+arena_scope::arena_scope()
+{
+    scope_depth++;
+}
+
+arena_scope::~arena_scope()
+{
+    // release() frees any overflow blocks and rewinds to the fixed one
+    if (--scope_depth == 0) {
+        arena.release();
+    }
+}
+
+void restart_line_arena()
+{
+    scope_depth = 0;
+}
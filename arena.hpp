@@ -0,0 +1,39 @@
+#ifndef __ARENA_HPP
+#define __ARENA_HPP
+
+#include <memory_resource>
+
+// Bump allocation for the short-lived state of one pipeline: the expanded
+// words of its commands, its pipe and pid lists, the argv handed to
+// execvpe. Allocations come out of a fixed block (spilling into the heap
+// only for very long lines), deallocation is a no-op, and everything is
+// dropped at once when the outermost pipeline finishes, so a loop body
+// runs without touching malloc for its scratch state.
+//
+// Only what dies with the pipeline may live in the arena: the Command
+// objects and the containers local to execute_pipeline. Anything kept
+// longer (job table entries, variables, arguments handed to builtins)
+// stays on the ordinary heap.
+
+// The arena of the pipeline being run
+std::pmr::memory_resource* line_arena();
+
+// Marks the lifetime of a pipeline. Pipelines nest (a $(...) captured in
+// process, a pipeline inside a group), so the arena is released only when
+// the outermost scope ends.
+class arena_scope
+{
+public:
+    arena_scope();
+    ~arena_scope();
+
+    arena_scope(const arena_scope&) = delete;
+    arena_scope& operator=(const arena_scope&) = delete;
+};
+
+// For a forked child that goes on running shell code: the scopes of the
+// parent's stack never end in the child, so start counting afresh and let
+// the child's own pipelines release the arena
+void restart_line_arena();
+
+#endif
@@ -9,8 +9,8 @@ echo "Building ShellKil project..."
 
 # Compiler and flags
 CC="g++"
-CFLAGS="-Wall -Wextra -std=c++14 -O2 -g"
-LDFLAGS="-lreadline"
+CFLAGS="-Wall -Wextra -std=c++17 -O2 -g"
+LDFLAGS="-lreadline -pthread"
 
 # Create directories
 mkdir -p obj bin
@@ -22,24 +22,36 @@ $CC $CFLAGS -c shell.cpp -o obj/shell.o
 $CC $CFLAGS -c delep.cpp -o obj/delep.o
 $CC $CFLAGS -c history.cpp -o obj/history.o
 $CC $CFLAGS -c squashbug.cpp -o obj/squashbug.o
+$CC $CFLAGS -c completion.cpp -o obj/completion.o
+$CC $CFLAGS -c parser.cpp -o obj/parser.o
+$CC $CFLAGS -c variables.cpp -o obj/variables.o
+$CC $CFLAGS -c script.cpp -o obj/script.o
+$CC $CFLAGS -c placement.cpp -o obj/placement.o
+$CC $CFLAGS -c jobs.cpp -o obj/jobs.o
+$CC $CFLAGS -c limits.cpp -o obj/limits.o
+$CC $CFLAGS -c capture.cpp -o obj/capture.o
+$CC $CFLAGS -c arena.cpp -o obj/arena.o
+$CC $CFLAGS -c server.cpp -o obj/server.o
+$CC $CFLAGS -c history_store.cpp -o obj/history_store.o
+$CC $CFLAGS -c procfs.cpp -o obj/procfs.o
 
 echo "Linking main executable..."
 
 # Link main executable
-$CC $CFLAGS -o bin/shellkil obj/shell.o obj/delep.o obj/history.o obj/squashbug.o $LDFLAGS
+$CC $CFLAGS -o bin/shellkil obj/shell.o obj/delep.o obj/history.o obj/squashbug.o obj/completion.o obj/parser.o obj/variables.o obj/script.o obj/placement.o obj/jobs.o obj/limits.o obj/capture.o obj/arena.o obj/server.o obj/history_store.o obj/procfs.o $LDFLAGS
 
 echo "Building utilities..."
 
 # Build utilities
 $CC $CFLAGS -o bin/createlock createlock.cpp
-$CC $CFLAGS -o bin/test_squashbug test_squashbug.cpp squashbug.cpp
+$CC $CFLAGS -o bin/test_squashbug test_squashbug.cpp squashbug.cpp procfs.cpp -pthread
 $CC $CFLAGS -o bin/nolock nolock.cpp
 
 echo "Build completed successfully!"
 echo "Executables are in the bin/ directory:"
 echo "  - bin/shellkil (main shell)"
-echo "  - bin/createlock (file locking test)"
-echo "  - bin/test_squashbug (malware simulation)"
+echo "  - bin/createlock (file locking test: [file] [flock|posix|ofd])"
+echo "  - bin/test_squashbug (process tree and lock load generator)"
 echo "  - bin/nolock (file access test)"
 echo
-echo "To run the shell: ./bin/shellkil" 
\ No newline at end of file
+echo "To run the shell: ./bin/shellkil [script [args...]]" 
\ No newline at end of file
@@ -0,0 +1,43 @@
+#include "capture.hpp"
+#include <cerrno>
+#include <cstring>
+#include <unistd.h>
+
+using namespace std;
+
+const size_t INITIAL_CAPACITY = 64 * 1024;  // one default pipe buffer
+const size_t MIN_READ = 16 * 1024;          // grow when less is free
+
+void capture_buffer::grow()
+{
+    size_t new_capacity = capacity ? capacity * 2 : INITIAL_CAPACITY;
+    unique_ptr<char[]> bigger(new char[new_capacity]);
+    if (length) {
+        memcpy(bigger.get(), storage.get(), length);
+    }
+    storage.swap(bigger);
+    capacity = new_capacity;
+}
+
+bool capture_buffer::read_all(int fd)
+{
+    while (true) {
+        if (capacity - length < MIN_READ) {
+            grow();
+        }
+        ssize_t n = read(fd, storage.get() + length, capacity - length);
+        if (n > 0) {
+            length += n;
+        } else if (n == 0) {
+            return true;
+        } else if (errno != EINTR) {
+            return false;
+        }
+    }
+}
+
+capture_buffer& shared_capture()
+{
+    static capture_buffer buffer;
+    return buffer;
+}
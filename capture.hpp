@@ -0,0 +1,37 @@
+#ifndef __CAPTURE_HPP
+#define __CAPTURE_HPP
+
+#include <cstddef>
+#include <memory>
+#include <string_view>
+
+// Growable buffer for collecting what a child writes to a pipe. Reads go
+// straight into the free tail of the buffer in large chunks, the storage
+// doubles when the tail gets small, and clear() keeps the allocation, so
+// repeated captures (a command substitution in a loop) reuse one block.
+class capture_buffer
+{
+public:
+    // Append everything readable from fd up to end of file. Returns false
+    // on a read error, with errno set.
+    bool read_all(int fd);
+
+    std::string_view view() const { return std::string_view(storage.get(), length); }
+    size_t size() const { return length; }
+
+    // Forget the contents but keep the storage
+    void clear() { length = 0; }
+
+private:
+    void grow();
+
+    std::unique_ptr<char[]> storage;
+    size_t capacity = 0;
+    size_t length = 0;
+};
+
+// The buffer every capture in this process shares. Callers copy out what
+// they need before the next capture starts.
+capture_buffer& shared_capture();
+
+#endif
@@ -0,0 +1,352 @@
+#include "completion.hpp"
+#include "variables.hpp"
+#include <readline/readline.h>
+#include <algorithm>
+#include <set>
+#include <chrono>
+#include <cstring>
+#include <cstdlib>
+#include <cctype>
+#include <dirent.h>
+#include <sys/stat.h>
+
+using namespace std;
+
+// Upper bound on candidates handed to readline for a single Tab press
+const size_t MAX_COMPLETIONS = 10000;
+// How long a Tab press may wait for a directory being (re)read
+const int COMPLETION_WAIT_MS = 30;
+
+radix_trie::radix_trie() : root(new node()), count(0)
+{
+}
+
+size_t radix_trie::size() const
+{
+    return count;
+}
+
+radix_trie::node* radix_trie::find_child(const node* parent, char c)
+{
+    auto it = lower_bound(parent->children.begin(), parent->children.end(), c,
+                          [](const unique_ptr<node>& child, char ch) { return child->label[0] < ch; });
+    if (it == parent->children.end() || (*it)->label[0] != c) {
+        return nullptr;
+    }
+    return it->get();
+}
+
+void radix_trie::insert(const string& key)
+{
+    node* current = root.get();
+    size_t pos = 0;
+
+    while (pos < key.size()) {
+        node* child = find_child(current, key[pos]);
+        if (!child) {
+            unique_ptr<node> leaf(new node());
+            leaf->label = key.substr(pos);
+            leaf->terminal = true;
+            char c = leaf->label[0];
+            auto it = lower_bound(current->children.begin(), current->children.end(), c,
+                                  [](const unique_ptr<node>& n, char ch) { return n->label[0] < ch; });
+            current->children.insert(it, move(leaf));
+            count++;
+            return;
+        }
+
+        // Length of the run shared with the edge label
+        size_t common = 0;
+        while (common < child->label.size() && pos + common < key.size() &&
+               child->label[common] == key[pos + common]) {
+            common++;
+        }
+
+        if (common < child->label.size()) {
+            // Split the edge: child keeps the tail, a new node takes the head
+            unique_ptr<node> tail(new node());
+            tail->label = child->label.substr(common);
+            tail->terminal = child->terminal;
+            tail->children = move(child->children);
+            child->label.resize(common);
+            child->terminal = false;
+            child->children.clear();
+            child->children.push_back(move(tail));
+        }
+
+        pos += common;
+        current = child;
+    }
+
+    if (!current->terminal && current != root.get()) {
+        current->terminal = true;
+        count++;
+    }
+}
+
+void radix_trie::collect_all(const node* n, string& path, vector<string>& out, size_t limit)
+{
+    if (out.size() >= limit) return;
+    if (n->terminal) {
+        out.push_back(path);
+    }
+    for (const auto& child : n->children) {
+        path += child->label;
+        collect_all(child.get(), path, out, limit);
+        path.resize(path.size() - child->label.size());
+        if (out.size() >= limit) return;
+    }
+}
+
+void radix_trie::collect(const string& prefix, vector<string>& out, size_t limit) const
+{
+    const node* current = root.get();
+    string path;
+    size_t pos = 0;
+
+    while (pos < prefix.size()) {
+        const node* child = find_child(current, prefix[pos]);
+        if (!child) return;
+
+        size_t remaining = prefix.size() - pos;
+        size_t span = min(remaining, child->label.size());
+        if (child->label.compare(0, span, prefix, pos, span) != 0) return;
+
+        path += child->label;
+        pos += child->label.size();
+        current = child;
+        if (span == remaining) break;   // prefix ends inside (or at the end of) this edge
+    }
+
+    collect_all(current, path, out, limit);
+}
+
+dir_cache::dir_cache() : stopping(false)
+{
+}
+
+dir_cache::~dir_cache()
+{
+    {
+        lock_guard<mutex> guard(lock);
+        stopping = true;
+    }
+    work_cv.notify_all();
+    if (worker.joinable()) {
+        worker.join();
+    }
+}
+
+shared_ptr<const radix_trie> dir_cache::read_listing(const string& dir, struct timespec& mtime)
+{
+    shared_ptr<radix_trie> entries = make_shared<radix_trie>();
+    struct stat st;
+    if (stat(dir.c_str(), &st) == -1) {
+        mtime = {0, 0};
+        return entries;
+    }
+    mtime = st.st_mtim;
+
+    DIR* dirp = opendir(dir.c_str());
+    if (!dirp) {
+        return entries;
+    }
+
+    struct dirent* entry;
+    while ((entry = readdir(dirp)) != NULL) {
+        if (!strcmp(entry->d_name, ".") || !strcmp(entry->d_name, "..")) {
+            continue;
+        }
+        bool is_dir = (entry->d_type == DT_DIR);
+        if (entry->d_type == DT_UNKNOWN || entry->d_type == DT_LNK) {
+            struct stat entry_st;
+            string path = dir + "/" + entry->d_name;
+            is_dir = stat(path.c_str(), &entry_st) == 0 && S_ISDIR(entry_st.st_mode);
+        }
+        entries->insert(is_dir ? string(entry->d_name) + "/" : string(entry->d_name));
+    }
+    closedir(dirp);
+    return entries;
+}
+
+void dir_cache::run()
+{
+    unique_lock<mutex> guard(lock);
+    while (true) {
+        work_cv.wait(guard, [this] { return stopping || !queue.empty(); });
+        if (stopping) return;
+
+        string dir = queue.front();
+        queue.pop_front();
+
+        // Directory reads happen without holding the lock
+        guard.unlock();
+        struct timespec mtime;
+        shared_ptr<const radix_trie> entries = read_listing(dir, mtime);
+        guard.lock();
+
+        listing& l = listings[dir];
+        l.mtime = mtime;
+        l.entries = entries;
+        l.pending = false;
+        done_cv.notify_all();
+    }
+}
+
+void dir_cache::complete(const string& dir, const string& prefix,
+                         vector<string>& out, size_t limit, int wait_ms)
+{
+    struct stat st;
+    bool exists = (stat(dir.c_str(), &st) == 0);
+
+    unique_lock<mutex> guard(lock);
+    if (!worker.joinable()) {
+        worker = thread(&dir_cache::run, this);
+    }
+
+    auto it = listings.find(dir);
+    bool fresh = (it != listings.end() && it->second.entries &&
+                  (!exists || (it->second.mtime.tv_sec == st.st_mtim.tv_sec &&
+                               it->second.mtime.tv_nsec == st.st_mtim.tv_nsec)));
+
+    if (!fresh && exists) {
+        listing& l = listings[dir];
+        if (!l.pending) {
+            l.pending = true;
+            queue.push_back(dir);
+            work_cv.notify_one();
+        }
+        done_cv.wait_for(guard, chrono::milliseconds(wait_ms),
+                         [this, &dir] { return !listings[dir].pending; });
+        it = listings.find(dir);
+    }
+
+    shared_ptr<const radix_trie> entries = (it != listings.end()) ? it->second.entries : nullptr;
+    guard.unlock();
+
+    if (entries) {
+        entries->collect(prefix, out, limit);
+    }
+}
+
+// Intentionally never destroyed: forked children leave through exit() and
+// must not try to join a worker thread that only exists in the parent
+static dir_cache& listing_cache = *new dir_cache();
+static vector<string> completion_matches;
+static size_t completion_index;
+
+static const char* builtin_commands[] = { "cd", "pwd", "exit", "wait", "export", "unset", "read", "sched", "timeout", "ulimit", "jobs", "fg", "bg", "history", "delep", "sb" };
+
+static void complete_commands(const string& text, vector<string>& out)
+{
+    set<string> unique;
+    for (const char* builtin : builtin_commands) {
+        if (strncmp(builtin, text.c_str(), text.size()) == 0) {
+            unique.insert(builtin);
+        }
+    }
+
+    const char* path_env = shell_variables.get("PATH");
+    string path = path_env ? path_env : "";
+    size_t start = 0;
+    while (start <= path.size()) {
+        size_t colon = path.find(':', start);
+        string dir = path.substr(start, colon == string::npos ? string::npos : colon - start);
+        start = (colon == string::npos) ? path.size() + 1 : colon + 1;
+        if (dir.empty()) continue;
+
+        vector<string> names;
+        listing_cache.complete(dir, text, names, MAX_COMPLETIONS, COMPLETION_WAIT_MS);
+        for (const string& name : names) {
+            if (name.back() != '/') {
+                unique.insert(name);
+            }
+        }
+        if (unique.size() >= MAX_COMPLETIONS) break;
+    }
+
+    out.assign(unique.begin(), unique.end());
+}
+
+static void complete_files(const string& text, vector<string>& out)
+{
+    size_t slash = text.rfind('/');
+    string dir_part = (slash == string::npos) ? "" : text.substr(0, slash + 1);
+    string base = (slash == string::npos) ? text : text.substr(slash + 1);
+
+    string dir = dir_part.empty() ? "." : dir_part;
+    if (dir[0] == '~') {
+        const char* home = shell_variables.get("HOME");
+        dir = string(home ? home : "") + dir.substr(1);
+    }
+
+    vector<string> names;
+    listing_cache.complete(dir, base, names, MAX_COMPLETIONS, COMPLETION_WAIT_MS);
+    for (const string& name : names) {
+        // Hidden entries only when asked for explicitly
+        if (name[0] == '.' && (base.empty() || base[0] != '.')) continue;
+        out.push_back(dir_part + name);
+    }
+}
+
+static void complete_pids(const string& text, vector<string>& out)
+{
+    // /proc has no meaningful mtime, so it is read directly each time
+    radix_trie pids;
+    DIR* dirp = opendir("/proc");
+    if (!dirp) return;
+    struct dirent* entry;
+    while ((entry = readdir(dirp)) != NULL) {
+        if (isdigit(static_cast<unsigned char>(entry->d_name[0]))) {
+            pids.insert(entry->d_name);
+        }
+    }
+    closedir(dirp);
+    pids.collect(text, out, MAX_COMPLETIONS);
+}
+
+static char* completion_generator(const char* text, int state)
+{
+    (void)text;
+    if (state == 0) {
+        completion_index = 0;
+    }
+    if (completion_index >= completion_matches.size()) {
+        return nullptr;
+    }
+    return strdup(completion_matches[completion_index++].c_str());
+}
+
+char** shell_completion(const char* text, int start, int end)
+{
+    (void)end;
+    rl_attempted_completion_over = 1;
+    completion_matches.clear();
+
+    // Find the command word of the current pipeline stage
+    int cmd_start = start;
+    while (cmd_start > 0 && !strchr("|;&", rl_line_buffer[cmd_start - 1])) {
+        cmd_start--;
+    }
+    while (cmd_start < start && isspace(static_cast<unsigned char>(rl_line_buffer[cmd_start]))) {
+        cmd_start++;
+    }
+    string before(rl_line_buffer + cmd_start, rl_line_buffer + start);
+    string command = before.substr(0, before.find_first_of(" \t"));
+
+    string word(text);
+    if (cmd_start == start && word.find('/') == string::npos) {
+        complete_commands(word, completion_matches);
+    } else if (command == "sb" && before.find_first_not_of(" \t", command.size()) == string::npos) {
+        complete_pids(word, completion_matches);
+    } else {
+        complete_files(word, completion_matches);
+    }
+
+    // Directories keep the cursor right after the '/'
+    if (completion_matches.size() == 1 && completion_matches[0].back() == '/') {
+        rl_completion_suppress_append = 1;
+    }
+
+    return rl_completion_matches(text, completion_generator);
+}
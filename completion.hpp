@@ -0,0 +1,78 @@
+#ifndef __COMPLETION_HPP
+#define __COMPLETION_HPP
+
+#include <string>
+#include <vector>
+#include <map>
+#include <memory>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <condition_variable>
+#include <ctime>
+
+// Sorted, prefix-searchable set of strings. Edges carry whole label runs
+// so lookups touch one node per distinct branch point rather than one per
+// character, and children are kept sorted by first byte for binary search.
+class radix_trie
+{
+public:
+    radix_trie();
+
+    void insert(const std::string& key);
+    // Append up to limit keys starting with prefix, in sorted order
+    void collect(const std::string& prefix, std::vector<std::string>& out, size_t limit) const;
+    size_t size() const;
+
+private:
+    struct node {
+        std::string label;
+        bool terminal = false;
+        std::vector<std::unique_ptr<node>> children;
+    };
+
+    std::unique_ptr<node> root;
+    size_t count;
+
+    static node* find_child(const node* parent, char c);
+    static void collect_all(const node* n, std::string& path, std::vector<std::string>& out, size_t limit);
+};
+
+// Directory listings, read on a background thread and revalidated against
+// the directory mtime. Directories carry a trailing '/' in their listing.
+class dir_cache
+{
+public:
+    dir_cache();
+    ~dir_cache();
+
+    // Append names in dir starting with prefix. A missing or stale listing
+    // is queued for reading; the caller waits at most wait_ms for it and
+    // otherwise gets the stale listing (or nothing) so the prompt never
+    // blocks on a huge or slow directory.
+    void complete(const std::string& dir, const std::string& prefix,
+                  std::vector<std::string>& out, size_t limit, int wait_ms);
+
+private:
+    struct listing {
+        struct timespec mtime;
+        std::shared_ptr<const radix_trie> entries;
+        bool pending = false;
+    };
+
+    std::mutex lock;
+    std::condition_variable work_cv, done_cv;
+    std::deque<std::string> queue;
+    std::map<std::string, listing> listings;
+    std::thread worker;
+    bool stopping;
+
+    void run();
+    static std::shared_ptr<const radix_trie> read_listing(const std::string& dir, struct timespec& mtime);
+};
+
+// Readline hook: commands from PATH and builtins in command position, PIDs
+// after "sb", files everywhere else (including delep's paths)
+char** shell_completion(const char* text, int start, int end);
+
+#endif
@@ -7,6 +7,7 @@
 #include <cstring>
 #include <cerrno>
 #include <signal.h>
+#include <string>
 
 using namespace std;
 
@@ -17,17 +18,56 @@ void signal_handler(int signum) {
     should_exit = true;
 }
 
-int main()
+// Acquire an exclusive lock of the requested kind without blocking
+int acquire_lock(int fd, const string& kind)
+{
+    if (kind == "flock") {
+        return flock(fd, LOCK_EX | LOCK_NB);
+    }
+
+    struct flock fl;
+    memset(&fl, 0, sizeof(fl));
+    fl.l_type = F_WRLCK;
+    fl.l_whence = SEEK_SET;
+    fl.l_start = 0;
+    fl.l_len = 0; // Whole file
+
+    return fcntl(fd, kind == "ofd" ? F_OFD_SETLK : F_SETLK, &fl);
+}
+
+void release_lock(int fd, const string& kind)
+{
+    if (kind == "flock") {
+        flock(fd, LOCK_UN);
+        return;
+    }
+
+    struct flock fl;
+    memset(&fl, 0, sizeof(fl));
+    fl.l_type = F_UNLCK;
+    fl.l_whence = SEEK_SET;
+    fcntl(fd, kind == "ofd" ? F_OFD_SETLK : F_SETLK, &fl);
+}
+
+int main(int argc, char* argv[])
 {	
+    // Usage: createlock [file] [flock|posix|ofd]
+    string filename = argc > 1 ? argv[1] : "lock.txt";
+    string kind = argc > 2 ? argv[2] : "flock";
+    if (kind != "flock" && kind != "posix" && kind != "ofd") {
+        cerr << "Usage: " << argv[0] << " [file] [flock|posix|ofd]" << endl;
+        return 1;
+    }
+
     // Set up signal handlers for graceful shutdown
     signal(SIGINT, signal_handler);
     signal(SIGTERM, signal_handler);
     
     cout << "Process PID: " << getpid() << endl;
     
-    FILE *fp = fopen("lock.txt", "w");
+    FILE *fp = fopen(filename.c_str(), "w");
     if (!fp) {
-        cerr << "Error: Cannot create/open lock.txt: " << strerror(errno) << endl;
+        cerr << "Error: Cannot create/open " << filename << ": " << strerror(errno) << endl;
         return 1;
     }
     
@@ -38,8 +78,8 @@ int main()
         return 1;
     }
     
-    cout << "Attempting to acquire exclusive lock..." << endl;
-    int ret = flock(fd, LOCK_EX | LOCK_NB); // Non-blocking lock
+    cout << "Attempting to acquire exclusive " << kind << " lock..." << endl;
+    int ret = acquire_lock(fd, kind); // Non-blocking lock
     
     if (ret == 0) {
         cout << "Lock acquired successfully!" << endl;
@@ -55,10 +95,10 @@ int main()
         }
         
         cout << "Releasing lock..." << endl;
-        flock(fd, LOCK_UN);
+        release_lock(fd, kind);
         cout << "Lock released." << endl;
     } else {
-        if (errno == EWOULDBLOCK) {
+        if (errno == EWOULDBLOCK || errno == EACCES) {
             cerr << "Error: File is already locked by another process" << endl;
         } else {
             cerr << "Error: Lock acquisition failed: " << strerror(errno) << endl;
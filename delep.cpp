@@ -4,9 +4,18 @@
 #include <stdexcept>
 #include <cerrno>
 #include <cstring>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+#include <sys/syscall.h>
+#include <poll.h>
+#include <signal.h>
+#include <chrono>
 
 using namespace std;
 
+// How long a SIGKILLed survivor gets to be seen exiting
+const chrono::seconds KILL_GRACE(1);
+
 // Helper function to safely read a symbolic link
 string safe_readlink(const string& path) {
     char buffer[PATH_MAX];
@@ -18,23 +27,91 @@ string safe_readlink(const string& path) {
     return string(buffer);
 }
 
-// Helper function to check if a file has a lock
-bool check_file_lock(const string& pid_str, const string& fd_str) {
+string file_lock::describe() const
+{
+    return kind + "/" + mode + "/" + (mandatory ? "MANDATORY" : "ADVISORY") + "/" + start + "-" + end;
+}
+
+// Parse one lock line in /proc/locks format, optionally prefixed by the
+// "lock:" tag used in fdinfo:
+//   1: POSIX  ADVISORY  WRITE 1234 08:01:5678 0 EOF
+// Lines describing blocked waiters ("1: -> FLOCK ...") are rejected.
+bool parse_lock_line(const string& line, lock_key& key, file_lock& lock)
+{
+    istringstream ss(line);
+    string ordinal, kind, type, mode, pid_str, dev;
+    
+    ss >> ordinal;
+    if (ordinal == "lock:") {
+        ss >> ordinal;
+    }
+    if (!(ss >> kind) || kind == "->") {
+        return false;
+    }
+    if (!(ss >> type >> mode >> pid_str >> dev >> lock.start >> lock.end)) {
+        return false;
+    }
+    
+    // major:minor:inode, with major and minor in hex
+    if (sscanf(dev.c_str(), "%x:%x:%lu", &key.major, &key.minor, &key.inode) != 3) {
+        return false;
+    }
+    
+    lock.kind = kind;
+    lock.mode = mode;
+    lock.mandatory = (type == "MANDATORY");
+    try {
+        lock.pid = stoi(pid_str);
+    } catch (const exception& e) {
+        lock.pid = -1;
+    }
+    return true;
+}
+
+// Read /proc/locks once and index every held lock by file identity
+lock_table load_proc_locks()
+{
+    lock_table table;
+    ifstream file("/proc/locks");
+    if (!file.is_open()) {
+        return table;
+    }
+    
+    string line;
+    while (getline(file, line)) {
+        lock_key key;
+        file_lock lock;
+        if (parse_lock_line(line, key, lock)) {
+            table[key].push_back(lock);
+        }
+    }
+    
+    return table;
+}
+
+// Fallback for locks /proc/locks cannot attribute to a process (OFD locks,
+// flock locks inherited across fork): fdinfo lists the locks held through
+// this exact open file description
+vector<file_lock> read_fdinfo_locks(const string& pid_str, const string& fd_str)
+{
+    vector<file_lock> locks;
     string fdinfo_path = "/proc/" + pid_str + "/fdinfo/" + fd_str;
     ifstream file(fdinfo_path);
     
     if (!file.is_open()) {
-        return false;
+        return locks;
     }
     
     string line;
     while (getline(file, line)) {
-        if (line.find("lock:") == 0) {
-            return true;
+        lock_key key;
+        file_lock lock;
+        if (line.find("lock:") == 0 && parse_lock_line(line, key, lock)) {
+            locks.push_back(lock);
         }
     }
     
-    return false;
+    return locks;
 }
 
 // Helper function to validate PID string
@@ -48,39 +125,100 @@ bool is_valid_pid(const string& pid_str) {
     return true;
 }
 
-void delep(char *argpath, int fd)
-{   
-    if (!argpath) {
-        string error_msg = "Error: NULL path argument";
-        if (fd != -1) {
-            write(fd, error_msg.c_str(), error_msg.length());
-        }
+// Send one record to the parent. Fields are tab separated and the path
+// comes last so it is the only field allowed to contain a tab:
+//   Lock\t<pid>\t<lock>;<lock>\t<path>
+//   NoLock\t<pid>\t\t<path>
+//   Error\t\t<message>\t<path>
+//   Context\t<pid>\tpidns=<id>;mntns=<id>;nspid=<pid>;cgroup=<path>\t
+static void write_record(int fd, const string& type, const string& pid,
+                         const string& details, const string& path)
+{
+    if (fd == -1) {
+        return;
+    }
+    string record = type + "\t" + pid + "\t" + details + "\t" + path + "\n";
+    if (write(fd, record.c_str(), record.length()) == -1) {
+        cerr << "Error writing to file descriptor: " << strerror(errno) << endl;
+    }
+}
+
+static string sanitize_field(string str)
+{
+    replace(str.begin(), str.end(), '\t', '?');
+    replace(str.begin(), str.end(), '\n', '?');
+    return str;
+}
+
+// Where a holder lives, sent once per process ahead of its first record
+static void write_context(int fd, const string& pid_str, set<string>& sent)
+{
+    process_context context;
+    if (!sent.insert(pid_str).second || !read_process_context(stoi(pid_str), context)) {
         return;
     }
+    write_record(fd, "Context", pid_str,
+                 "pidns=" + to_string(context.pid_ns) + ";mntns=" + to_string(context.mnt_ns) +
+                 ";nspid=" + to_string(context.ns_pid) + ";cgroup=" + sanitize_field(context.cgroup), "");
+}
+
+struct delep_target {
+    string path;                // as given by the user
+    string resolved;            // as it appears in /proc/<pid>/fd
+    vector<file_lock> locks;    // every lock /proc/locks lists for the inode
+    vector<pair<string, vector<string>>> holders;   // pid -> matching fds
+};
+
+void delep(const vector<string>& paths, const process_filter& filter, int fd)
+{   
+    vector<delep_target> targets;
+    unordered_map<string, size_t> by_resolved;
+    
+    // One read of /proc/locks per scan instead of one fdinfo read per match
+    lock_table locks = load_proc_locks();
     
-    // Validate the file path
-    string target_path(argpath);
-    if (target_path.empty()) {
-        string error_msg = "Error: Empty path argument";
-        if (fd != -1) {
-            write(fd, error_msg.c_str(), error_msg.length());
+    for (const string& path : paths) {
+        // Validate the file path
+        if (path.empty()) {
+            write_record(fd, "Error", "", "Empty path argument", path);
+            continue;
+        }
+        
+        delep_target target;
+        target.path = path;
+        char resolved[PATH_MAX];
+        target.resolved = realpath(path.c_str(), resolved) ? string(resolved) : path;
+        
+        struct stat target_stat;
+        if (stat(target.resolved.c_str(), &target_stat) == 0) {
+            lock_key key = { major(target_stat.st_dev), minor(target_stat.st_dev),
+                             static_cast<unsigned long>(target_stat.st_ino) };
+            auto it = locks.find(key);
+            if (it != locks.end()) {
+                target.locks = it->second;
+            }
+        }
+        
+        if (by_resolved.find(target.resolved) == by_resolved.end()) {
+            by_resolved[target.resolved] = targets.size();
+            targets.push_back(target);
         }
+    }
+    
+    if (targets.empty()) {
         return;
     }
     
     DIR *dirp = opendir("/proc");
     if (!dirp) {
-        string error_msg = "Error: Cannot access /proc directory: " + string(strerror(errno));
-        if (fd != -1) {
-            write(fd, error_msg.c_str(), error_msg.length());
+        for (const auto& target : targets) {
+            write_record(fd, "Error", "", "Cannot access /proc directory: " + string(strerror(errno)),
+                         target.path);
         }
         return;
     }
 
-    ostringstream result_stream;
-    vector<string> lock_pids;
-    vector<string> nolock_pids;
-    
+    // A single walk of /proc serves every target
     struct dirent *entry;
     while ((entry = readdir(dirp)) != NULL) {
         // Skip non-directory entries and special directories
@@ -94,6 +232,11 @@ void delep(char *argpath, int fd)
         if (!is_valid_pid(entry->d_name)) {
             continue;
         }
+
+        // Other containers are skipped before their descriptors are listed
+        if (!filter.matches(atoi(entry->d_name))) {
+            continue;
+        }
         
         string pid_str(entry->d_name);
         string fd_dir_path = "/proc/" + pid_str + "/fd";
@@ -104,6 +247,7 @@ void delep(char *argpath, int fd)
             continue;
         }
 
+        map<size_t, vector<string>> matched_fds;
         struct dirent *fd_entry;
         while ((fd_entry = readdir(fd_dirp)) != NULL) {
             if (strcmp(fd_entry->d_name, ".") == 0 || 
@@ -113,44 +257,502 @@ void delep(char *argpath, int fd)
 
             string fd_link_path = "/proc/" + pid_str + "/fd/" + fd_entry->d_name;
             string resolved_path = safe_readlink(fd_link_path);
-            
             if (resolved_path.empty()) {
                 continue;
             }
             
-            // Check if this file descriptor points to our target file
-            if (resolved_path == target_path) {
-                try {
-                    if (check_file_lock(pid_str, fd_entry->d_name)) {
-                        lock_pids.push_back(pid_str);
-                    } else {
-                        nolock_pids.push_back(pid_str);
+            // Check if this file descriptor points to one of our targets
+            auto it = by_resolved.find(resolved_path);
+            if (it != by_resolved.end()) {
+                matched_fds[it->second].push_back(fd_entry->d_name);
+            }
+        }
+        closedir(fd_dirp);
+        
+        for (auto& match : matched_fds) {
+            targets[match.first].holders.push_back(make_pair(pid_str, match.second));
+        }
+    }
+    closedir(dirp);
+    
+    set<string> context_sent;
+    for (const auto& target : targets) {
+        for (const auto& holder : target.holders) {
+            write_context(fd, holder.first, context_sent);
+        }
+
+        // Locks whose owner is not one of the holders can only be
+        // attributed through fdinfo
+        set<pid_t> holder_pids;
+        for (const auto& holder : target.holders) {
+            holder_pids.insert(stoi(holder.first));
+        }
+        bool unattributed = false;
+        for (const auto& lock : target.locks) {
+            if (lock.pid <= 0 || holder_pids.find(lock.pid) == holder_pids.end()) {
+                unattributed = true;
+            }
+        }
+        
+        vector<pair<pid_t, vector<file_lock>>> results;
+        for (const auto& holder : target.holders) {
+            pid_t pid = stoi(holder.first);
+            vector<file_lock> held;
+            for (const auto& lock : target.locks) {
+                if (lock.pid == pid) {
+                    held.push_back(lock);
+                }
+            }
+            if (unattributed) {
+                set<string> seen;
+                for (const auto& lock : held) {
+                    seen.insert(lock.describe());
+                }
+                for (const string& fd_str : holder.second) {
+                    for (const auto& lock : read_fdinfo_locks(holder.first, fd_str)) {
+                        if (seen.insert(lock.describe()).second) {
+                            held.push_back(lock);
+                        }
                     }
-                } catch (const exception& e) {
-                    // If we can't determine lock status, assume no lock
-                    nolock_pids.push_back(pid_str);
                 }
-                break; // Found the file, no need to check other FDs for this PID
+            }
+            results.push_back(make_pair(pid, held));
+        }
+        
+        // Lock holders first, as before
+        for (const auto& result : results) {
+            if (result.second.empty()) continue;
+            string details;
+            for (size_t i = 0; i < result.second.size(); i++) {
+                details += (i ? ";" : "") + result.second[i].describe();
+            }
+            write_record(fd, "Lock", to_string(result.first), details, target.path);
+        }
+        for (const auto& result : results) {
+            if (!result.second.empty()) continue;
+            write_record(fd, "NoLock", to_string(result.first), "", target.path);
+        }
+    }
+}
+
+struct delep_scope_target {
+    string path;                // as given by the user
+    string resolved;
+    dev_t dev;
+};
+
+// Per-process totals for one scope
+struct scope_usage {
+    size_t fds = 0, maps = 0;
+    bool cwd = false, root = false;
+    unsigned long long bytes = 0, deleted_bytes = 0;
+    set<pair<dev_t, ino_t>> inodes;                     // counted once
+    vector<pair<unsigned long long, string>> deleted;  // size, path
+};
+
+// True when path lies at or below prefix
+static bool path_under(const string& path, const string& prefix)
+{
+    if (path.compare(0, prefix.size(), prefix) != 0) {
+        return false;
+    }
+    return path.size() == prefix.size() || prefix == "/" || path[prefix.size()] == '/';
+}
+
+// readlink targets of unlinked files carry a " (deleted)" suffix
+static bool strip_deleted(string& path)
+{
+    static const string suffix = " (deleted)";
+    if (path.size() > suffix.size() &&
+        path.compare(path.size() - suffix.size(), suffix.size(), suffix) == 0) {
+        path.erase(path.size() - suffix.size());
+        return true;
+    }
+    return false;
+}
+
+void delep_scope(const vector<string>& paths, bool mount_mode, const process_filter& filter, int fd)
+{
+    vector<delep_scope_target> scopes;
+    for (const string& path : paths) {
+        char resolved[PATH_MAX];
+        struct stat scope_stat;
+        if (!realpath(path.c_str(), resolved) || stat(resolved, &scope_stat) == -1) {
+            write_record(fd, "Error", "", "Cannot resolve path: " + string(strerror(errno)), path);
+            continue;
+        }
+        scopes.push_back({ path, resolved, scope_stat.st_dev });
+    }
+    
+    if (scopes.empty()) {
+        return;
+    }
+    
+    DIR *dirp = opendir("/proc");
+    if (!dirp) {
+        for (const auto& scope : scopes) {
+            write_record(fd, "Error", "", "Cannot access /proc directory: " + string(strerror(errno)),
+                         scope.path);
+        }
+        return;
+    }
+    
+    set<string> context_sent;
+
+    // Only a device match is worth a readlink and a prefix compare
+    auto scope_matches = [&](const delep_scope_target& scope, dev_t dev, const string& path) {
+        return dev == scope.dev && (mount_mode || path_under(path, scope.resolved));
+    };
+    
+    struct dirent *entry;
+    while ((entry = readdir(dirp)) != NULL) {
+        if (entry->d_type != DT_DIR || !is_valid_pid(entry->d_name) ||
+            !filter.matches(atoi(entry->d_name))) {
+            continue;
+        }
+        
+        string pid_str(entry->d_name);
+        string proc_dir = "/proc/" + pid_str;
+        vector<scope_usage> usage(scopes.size());
+        
+        // Working directory and root
+        const char* dir_links[] = { "cwd", "root" };
+        for (int d = 0; d < 2; d++) {
+            string link = proc_dir + "/" + dir_links[d];
+            struct stat st;
+            if (stat(link.c_str(), &st) == -1) continue;
+            string target;
+            for (size_t i = 0; i < scopes.size(); i++) {
+                if (st.st_dev != scopes[i].dev) continue;
+                if (target.empty()) {
+                    target = safe_readlink(link);
+                    strip_deleted(target);
+                }
+                if (scope_matches(scopes[i], st.st_dev, target)) {
+                    (d == 0 ? usage[i].cwd : usage[i].root) = true;
+                }
+            }
+        }
+        
+        // Open descriptors: one stat per fd, readlink only on a device match
+        string fd_dir_path = proc_dir + "/fd";
+        DIR *fd_dirp = opendir(fd_dir_path.c_str());
+        if (fd_dirp) {
+            struct dirent *fd_entry;
+            while ((fd_entry = readdir(fd_dirp)) != NULL) {
+                if (fd_entry->d_name[0] == '.') continue;
+                
+                string fd_link_path = fd_dir_path + "/" + fd_entry->d_name;
+                struct stat st;
+                if (stat(fd_link_path.c_str(), &st) == -1) continue;
+                
+                string target;
+                bool deleted = false;
+                for (size_t i = 0; i < scopes.size(); i++) {
+                    if (st.st_dev != scopes[i].dev) continue;
+                    if (target.empty()) {
+                        target = safe_readlink(fd_link_path);
+                        deleted = strip_deleted(target) || st.st_nlink == 0;
+                    }
+                    if (!scope_matches(scopes[i], st.st_dev, target)) continue;
+                    
+                    scope_usage& u = usage[i];
+                    u.fds++;
+                    if (S_ISREG(st.st_mode) && u.inodes.insert(make_pair(st.st_dev, st.st_ino)).second) {
+                        u.bytes += st.st_size;
+                        if (deleted) {
+                            u.deleted_bytes += st.st_size;
+                            u.deleted.push_back(make_pair(st.st_size, target));
+                        }
+                    }
+                }
+            }
+            closedir(fd_dirp);
+        }
+        
+        // Memory mappings carry the device inline, so no stat is needed to
+        // reject a mapping from another filesystem
+        ifstream maps(proc_dir + "/maps");
+        string line;
+        while (getline(maps, line)) {
+            char dev_buf[32];
+            unsigned long inode = 0;
+            int path_pos = 0;
+            if (sscanf(line.c_str(), "%*s %*s %*s %31s %lu %n", dev_buf, &inode, &path_pos) < 2 ||
+                inode == 0 || path_pos == 0) {
+                continue;
+            }
+            unsigned int dev_major, dev_minor;
+            if (sscanf(dev_buf, "%x:%x", &dev_major, &dev_minor) != 2) continue;
+            dev_t dev = makedev(dev_major, dev_minor);
+            
+            string target = line.substr(path_pos);
+            bool deleted = strip_deleted(target);
+            for (size_t i = 0; i < scopes.size(); i++) {
+                if (!scope_matches(scopes[i], dev, target)) continue;
+                
+                scope_usage& u = usage[i];
+                if (!u.inodes.insert(make_pair(dev, static_cast<ino_t>(inode))).second) continue;
+                u.maps++;
+                
+                // Sizes of deleted mappings are not reachable through the path
+                struct stat st;
+                if (!deleted && stat(target.c_str(), &st) == 0 && st.st_ino == inode) {
+                    u.bytes += st.st_size;
+                } else if (deleted) {
+                    u.deleted.push_back(make_pair(0ULL, target));
+                }
+            }
+        }
+        
+        for (size_t i = 0; i < scopes.size(); i++) {
+            const scope_usage& u = usage[i];
+            if (u.fds == 0 && u.maps == 0 && !u.cwd && !u.root) continue;
+            
+            ifstream comm_file(proc_dir + "/comm");
+            string comm;
+            getline(comm_file, comm);
+            
+            write_context(fd, pid_str, context_sent);
+            ostringstream details;
+            details << "comm=" << sanitize_field(comm) << ";fds=" << u.fds << ";maps=" << u.maps
+                    << ";cwd=" << u.cwd << ";root=" << u.root << ";bytes=" << u.bytes
+                    << ";deleted_bytes=" << u.deleted_bytes;
+            write_record(fd, "Held", pid_str, details.str(), scopes[i].path);
+            for (const auto& del : u.deleted) {
+                write_record(fd, "Deleted", pid_str, to_string(del.first) + ":" + sanitize_field(del.second),
+                             scopes[i].path);
             }
         }
-        closedir(fd_dirp);
     }
     closedir(dirp);
+}
+
+bool parse_delep_options(const vector<string>& args, delep_options& opts, string& error)
+{
+    for (size_t i = 1; i < args.size(); i++) {
+        const string& arg = args[i];
+        if (arg == "--json") {
+            opts.json = true;
+        } else if (arg == "--under") {
+            opts.scope = "under";
+        } else if (arg == "--mount") {
+            opts.scope = "mount";
+        } else if (arg == "--dry-run") {
+            opts.dry_run = true;
+        } else if (arg == "--any-user") {
+            opts.any_user = true;
+        } else if (arg.compare(0, 7, "--kill=") == 0) {
+            opts.kill_mode = arg.substr(7);
+            if (opts.kill_mode != "term" && opts.kill_mode != "kill" && opts.kill_mode != "none") {
+                error = "invalid kill mode: " + opts.kill_mode;
+                return false;
+            }
+        } else if (arg.compare(0, 10, "--timeout=") == 0 || arg == "--timeout") {
+            string value = arg == "--timeout" ? (i + 1 < args.size() ? args[++i] : "") : arg.substr(10);
+            try {
+                size_t used = 0;
+                opts.timeout = stod(value, &used);
+                if (used != value.size() || opts.timeout < 0) {
+                    throw invalid_argument(value);
+                }
+            } catch (const exception& e) {
+                error = "invalid timeout: " + value;
+                return false;
+            }
+        } else if (parse_filter_option(arg, opts.filter)) {
+            continue;
+        } else if (arg == "--") {
+            opts.paths.insert(opts.paths.end(), args.begin() + i + 1, args.end());
+            break;
+        } else if (arg.compare(0, 2, "--") == 0) {
+            error = "unknown option: " + arg;
+            return false;
+        } else {
+            opts.paths.push_back(arg);
+        }
+    }
+    
+    if (opts.paths.empty()) {
+        error = "no paths given";
+        return false;
+    }
+    if (!opts.filter.resolve(error)) {
+        return false;
+    }
     
-    // Build result string
-    for (const string& pid : lock_pids) {
-        result_stream << "Lock:" << pid << ",";
+    // Anything asking for machine output or an explicit policy never prompts
+    opts.interactive = opts.kill_mode.empty() && !opts.json && !opts.dry_run;
+    if (opts.kill_mode.empty()) {
+        opts.kill_mode = opts.interactive ? "kill" : "none";
     }
-    for (const string& pid : nolock_pids) {
-        result_stream << "NoLock:" << pid << ",";
+    return true;
+}
+
+static int open_pidfd(pid_t pid)
+{
+#ifdef SYS_pidfd_open
+    return static_cast<int>(syscall(SYS_pidfd_open, pid, 0));
+#else
+    errno = ENOSYS;
+    return -1;
+#endif
+}
+
+// Signal through the pidfd when there is one: pid may have been reused
+// since the scan, the process behind an open pidfd cannot be
+static int send_signal(int pidfd, pid_t pid, int signum)
+{
+#ifdef SYS_pidfd_send_signal
+    if (pidfd != -1) {
+        return static_cast<int>(syscall(SYS_pidfd_send_signal, pidfd, signum, NULL, 0));
+    }
+#endif
+    return kill(pid, signum);
+}
+
+// PPid and real uid from /proc/<pid>/status; false when it is gone
+static bool read_parent_and_uid(pid_t pid, pid_t& ppid, uid_t& uid)
+{
+    string status;
+    if (!read_proc_file("/proc/" + to_string(pid) + "/status", status)) {
+        return false;
     }
+    size_t ppid_pos = status.find("\nPPid:");
+    size_t uid_pos = status.find("\nUid:");
+    if (ppid_pos == string::npos || uid_pos == string::npos) {
+        return false;
+    }
+    ppid = static_cast<pid_t>(atol(status.c_str() + ppid_pos + 6));
+    uid = static_cast<uid_t>(atol(status.c_str() + uid_pos + 5));
+    return true;
+}
+
+map<pid_t, string> spared_processes(const set<int>& pids, bool any_user)
+{
+    set<pid_t> ancestors;
+    pid_t ppid;
+    uid_t uid;
+    for (pid_t current = getpid(); current > 0 && ancestors.size() < 4096; current = ppid) {
+        ancestors.insert(current);
+        if (!read_parent_and_uid(current, ppid, uid)) {
+            break;
+        }
+    }
+
+    map<pid_t, string> spared;
+    for (pid_t pid : pids) {
+        if (pid == 1) {
+            spared[pid] = "init";
+        } else if (ancestors.count(pid)) {
+            spared[pid] = pid == getpid() ? "the shell itself" : "an ancestor of the shell";
+        } else if (pid == getsid(0)) {
+            spared[pid] = "the shell's session leader";
+        } else if (!any_user && read_parent_and_uid(pid, ppid, uid) && uid != getuid()) {
+            spared[pid] = "owned by uid " + to_string(uid) + " (--any-user to include)";
+        }
+    }
+    return spared;
+}
+
+// Wait on the pidfds (or kill(pid, 0) probes) until every signalled
+// process has exited or the deadline passes
+static void wait_for_exits(vector<kill_result>& results, vector<struct pollfd>& pfds,
+                           chrono::steady_clock::time_point deadline)
+{
+    while (true) {
+        size_t pending = 0;
+        bool need_probe = false;
+        for (size_t i = 0; i < results.size(); i++) {
+            if (results[i].exited || results[i].error) continue;
+            if (pfds[i].fd == -1) {
+                if (kill(results[i].pid, 0) == -1 && errno == ESRCH) {
+                    results[i].exited = true;
+                    continue;
+                }
+                need_probe = true;
+            }
+            pending++;
+        }
+        
+        auto now = chrono::steady_clock::now();
+        if (pending == 0 || now >= deadline) {
+            break;
+        }
+        
+        int wait_ms = static_cast<int>(chrono::duration_cast<chrono::milliseconds>(deadline - now).count()) + 1;
+        if (need_probe) {
+            wait_ms = min(wait_ms, 10);
+        }
+        int ret = poll(pfds.data(), pfds.size(), wait_ms);
+        if (ret == -1 && errno != EINTR) {
+            break;
+        }
+        for (size_t i = 0; i < pfds.size(); i++) {
+            if (pfds[i].fd != -1 && (pfds[i].revents & (POLLIN | POLLHUP))) {
+                results[i].exited = true;
+                close(pfds[i].fd);
+                pfds[i].fd = -1;
+            }
+        }
+    }
+}
+
+vector<kill_result> terminate_processes(const vector<pid_t>& pids, bool graceful, double timeout)
+{
+    vector<kill_result> results;
+    vector<struct pollfd> pfds;
     
-    string result = result_stream.str();
+    // Signal everything first so the processes shut down in parallel
+    for (pid_t pid : pids) {
+        kill_result result;
+        result.pid = pid;
+        result.signal = graceful ? SIGTERM : SIGKILL;
+        result.exited = false;
+        result.error = 0;
+        
+        int pidfd = open_pidfd(pid);
+        if (send_signal(pidfd, pid, result.signal) == -1) {
+            result.error = errno;
+            result.exited = (errno == ESRCH);
+        }
+        results.push_back(result);
+        
+        struct pollfd pfd;
+        pfd.fd = (result.error == 0) ? pidfd : -1;
+        pfd.events = POLLIN;
+        pfd.revents = 0;
+        if (pfd.fd == -1 && pidfd != -1) {
+            close(pidfd);
+        }
+        pfds.push_back(pfd);
+    }
+    
+    // pidfds become readable when the process exits; processes without a
+    // pidfd are polled with kill(pid, 0)
+    wait_for_exits(results, pfds, chrono::steady_clock::now() +
+                   chrono::duration_cast<chrono::steady_clock::duration>(chrono::duration<double>(timeout)));
     
-    // Write result to file descriptor
-    if (fd != -1) {
-        if (write(fd, result.c_str(), result.length()) == -1) {
-            cerr << "Error writing to file descriptor: " << strerror(errno) << endl;
+    // Whatever survived the deadline is escalated, and a SIGKILL cannot
+    // be refused, so it only has to be seen landing
+    bool escalated = false;
+    for (size_t i = 0; i < results.size(); i++) {
+        if (!results[i].exited && !results[i].error && results[i].signal != SIGKILL) {
+            results[i].signal = SIGKILL;
+            escalated = true;
+            if (send_signal(pfds[i].fd, results[i].pid, SIGKILL) == -1 && errno != ESRCH) {
+                results[i].error = errno;
+            }
+        }
+    }
+    if (escalated) {
+        wait_for_exits(results, pfds, chrono::steady_clock::now() + KILL_GRACE);
+    }
+    for (const struct pollfd& pfd : pfds) {
+        if (pfd.fd != -1) {
+            close(pfd.fd);
         }
     }
-}
\ No newline at end of file
+    
+    return results;
+}
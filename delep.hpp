@@ -11,9 +11,83 @@
 #include <fstream>
 #include <limits.h>
 #include <cctype>
+#include <unordered_map>
+#include "procfs.hpp"
 
 using namespace std;
 
-void delep(char* path, int fd);
+// A single held lock as reported by /proc/locks or /proc/<pid>/fdinfo
+struct file_lock {
+    string kind;        // FLOCK, POSIX, OFDLCK, LEASE, ...
+    string mode;        // READ, WRITE
+    bool mandatory;
+    pid_t pid;          // -1 when the kernel does not attribute the lock
+    string start, end;  // byte range, end may be "EOF"
 
-#endif
\ No newline at end of file
+    string describe() const;
+};
+
+// Locks are keyed by the (major, minor, inode) triple /proc/locks prints
+struct lock_key {
+    unsigned int major, minor;
+    unsigned long inode;
+
+    bool operator==(const lock_key& other) const {
+        return major == other.major && minor == other.minor && inode == other.inode;
+    }
+};
+
+struct lock_key_hash {
+    size_t operator()(const lock_key& key) const {
+        return hash<unsigned long>()(key.inode) ^ (static_cast<size_t>(key.major) << 40)
+               ^ (static_cast<size_t>(key.minor) << 20);
+    }
+};
+
+typedef unordered_map<lock_key, vector<file_lock>, lock_key_hash> lock_table;
+
+bool parse_lock_line(const string& line, lock_key& key, file_lock& lock);
+lock_table load_proc_locks();
+
+// Command line of the delep builtin:
+//   delep [--json] [--kill=term|kill|none] [--timeout=SECS] [--dry-run]
+//         [--any-user] [--under|--mount] [--container=ID] [--cgroup=PATH] paths...
+struct delep_options {
+    bool json = false;
+    string scope;               // empty: exact paths, "under" or "mount"
+    bool dry_run = false;
+    bool interactive = false;   // no policy given: ask before killing
+    string kill_mode;           // term, kill or none
+    double timeout = 5.0;       // seconds between SIGTERM and SIGKILL
+    bool any_user = false;      // signal other users' processes too
+    process_filter filter;      // only processes of one container or cgroup
+    vector<string> paths;
+};
+
+struct kill_result {
+    pid_t pid;
+    int signal;         // last signal sent
+    bool exited;        // seen exiting before the deadline
+    int error;          // errno from kill(), 0 on success
+};
+
+bool parse_delep_options(const vector<string>& args, delep_options& opts, string& error);
+
+// The pids delep must not signal, with the reason: init, the shell with
+// its ancestors and session leader, and unless any_user, processes of
+// other users
+map<pid_t, string> spared_processes(const set<int>& pids, bool any_user);
+
+// Signal every pid at once (SIGTERM when graceful, SIGKILL otherwise), wait
+// on pidfds until all have exited or the timeout expires, then SIGKILL the
+// survivors and give them a moment to go
+vector<kill_result> terminate_processes(const vector<pid_t>& pids, bool graceful, double timeout);
+
+void delep(const vector<string>& paths, const process_filter& filter, int fd);
+
+// Report every process holding anything below the given directories (or,
+// in mount mode, anywhere on their filesystems) through open descriptors,
+// cwd, root or memory mappings, with per-process byte totals
+void delep_scope(const vector<string>& paths, bool mount_mode, const process_filter& filter, int fd);
+
+#endif
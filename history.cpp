@@ -1,112 +1,206 @@
 #include "history.hpp"
+#include "limits.hpp"
 #include <iostream>
-#include <fstream>
+#include <iomanip>
 #include <stdexcept>
 #include <cstring>
+#include <cerrno>
+#include <climits>
+#include <algorithm>
+#include <unistd.h>
 
-history::history() : max_size(MAX_SIZE), curr_ind(0), fp(nullptr)
+history::history() : max_size(MAX_SIZE), fp(nullptr), base_seq(0), live_count(0), control(HIST_IGNOREDUPS), search_active(false), loaded(false), curr_ind(0)
 {
-    load_history_from_file();
 }
 
-history::~history()
-{   
-    save_history_to_file();
+void history::ensure_loaded()
+{
+    if (!loaded) {
+        loaded = true;
+        load_history_from_file();
+    }
 }
 
 void history::load_history_from_file()
 {
-    std::ifstream file(HISTORY_FILE);
-    if (!file.is_open()) {
-        // File doesn't exist yet, which is fine
-        curr_ind = 0;
+    // The store keeps every run; replaying the newest of them through the
+    // policy gives the list this shell would have built. With erasedups
+    // that is the newest max_size distinct lines, however far back.
+    std::vector<std::string> lines = (control & HIST_ERASEDUPS) ? store.recent_unique(max_size)
+                                                                : store.recent(max_size);
+    for (const auto& line : lines) {
+        insert(line);
+    }
+    curr_ind = dequeue.size();
+}
+
+void history::set_control(std::string_view histcontrol)
+{
+    if (histcontrol.empty()) {
+        control = HIST_IGNOREDUPS;
         return;
     }
-    
-    std::string line;
-    while (std::getline(file, line)) {
-        if (line.empty()) continue;
-        
-        // Remove trailing newline if present
-        if (!line.empty() && line.back() == '\n') {
-            line.pop_back();
+    control = 0;
+    while (!histcontrol.empty()) {
+        size_t colon = histcontrol.find(':');
+        std::string_view word = histcontrol.substr(0, colon);
+        if (word == "ignorespace") {
+            control |= HIST_IGNORESPACE;
+        } else if (word == "ignoredups") {
+            control |= HIST_IGNOREDUPS;
+        } else if (word == "ignoreboth") {
+            control |= HIST_IGNORESPACE | HIST_IGNOREDUPS;
+        } else if (word == "erasedups") {
+            control |= HIST_ERASEDUPS;
         }
-        
-        // Maintain maximum size
-        if (static_cast<int>(dequeue.size()) >= max_size) {
-            dequeue.pop_front();
+        histcontrol = colon == std::string_view::npos ? std::string_view() : histcontrol.substr(colon + 1);
+    }
+}
+
+bool history::ignores(std::string_view line) const
+{
+    return (control & HIST_IGNORESPACE) && !line.empty() && (line[0] == ' ' || line[0] == '\t');
+}
+
+void history::index_push_back()
+{
+    long seq = base_seq + static_cast<long>(dequeue.size()) - 1;
+    std::string_view view(dequeue.back().line);
+    sorted_index.insert(std::make_pair(view, seq));
+    // The key is a view too: it has to point at the newest copy
+    line_index.erase(view);
+    line_index.emplace(view, seq);
+    live_count++;
+}
+
+void history::index_pop_front()
+{
+    entry& front = dequeue.front();
+    if (!front.erased) {
+        std::string_view view(front.line);
+        sorted_index.erase(std::make_pair(view, base_seq));
+        auto it = line_index.find(view);
+        if (it != line_index.end() && it->second == base_seq) {
+            line_index.erase(it);
         }
-        
-        dequeue.push_back(line);
+        live_count--;
     }
-    
-    curr_ind = dequeue.size();
-    file.close();
+    dequeue.pop_front();
+    base_seq++;
 }
 
-void history::save_history_to_file()
+void history::erase_entry(long seq)
 {
-    std::ofstream file(HISTORY_FILE);
-    if (!file.is_open()) {
-        std::cerr << "Warning: Could not save history to file " << HISTORY_FILE << std::endl;
+    entry& e = dequeue[seq - base_seq];
+    std::string_view view(e.line);
+    sorted_index.erase(std::make_pair(view, seq));
+    auto it = line_index.find(view);
+    if (it != line_index.end() && it->second == seq) {
+        line_index.erase(it);
+    }
+    std::string().swap(e.line);
+    e.erased = true;
+    live_count--;
+}
+
+// Drop erased entries once they outnumber the live ones. Entries are
+// renumbered, so both indexes are rebuilt.
+void history::compact()
+{
+    int erased = static_cast<int>(dequeue.size()) - live_count;
+    if (erased < 64 || erased < live_count) {
         return;
     }
-    
-    for (const auto& command : dequeue) {
-        file << command << std::endl;
+    std::deque<entry> old;
+    old.swap(dequeue);
+    sorted_index.clear();
+    line_index.clear();
+    live_count = 0;
+    for (auto& e : old) {
+        if (!e.erased) {
+            dequeue.push_back({ std::move(e.line), false });
+            index_push_back();
+        }
+    }
+}
+
+// Add a line under the HISTCONTROL policy, evicting the oldest entry when
+// full
+void history::insert(const std::string& line)
+{
+    if (line.empty()) {
+        return;
+    }
+    auto it = line_index.find(line);
+    if (it != line_index.end()) {
+        if (control & HIST_ERASEDUPS) {
+            erase_entry(it->second);
+        } else if ((control & HIST_IGNOREDUPS) && dequeue.back().line == line) {
+            return;
+        }
+    }
+    while (live_count >= max_size) {
+        index_pop_front();
+    }
+    dequeue.push_back({ line, false });
+    index_push_back();
+    compact();
+}
+
+void history::record(const std::string& line, const std::string& cwd,
+                     time_t start, double duration, int status)
+{
+    if (!line.empty()) {
+        store.append(line, cwd, start, duration, status);
     }
-    
-    file.close();
 }
 
 int history::get_size()
 {
+    ensure_loaded();
     return static_cast<int>(dequeue.size());
 }
 
 bool history::isempty()
 {
-    return dequeue.empty();
+    ensure_loaded();
+    return live_count == 0;
 }
 
 void history::add_history(const std::string& line)
 {
-    // Don't add empty lines or duplicate consecutive commands
-    if (line.empty()) {
-        return;
-    }
-    
-    if (!dequeue.empty() && dequeue.back() == line) {
-        // Don't add duplicate consecutive commands
-        curr_ind = dequeue.size();
-        return;
-    }
-    
-    // Maintain maximum size
-    if (static_cast<int>(dequeue.size()) >= max_size) {
-        dequeue.pop_front();
-    }
-    
-    dequeue.push_back(line);
+    ensure_loaded();
+    search_active = false;
+    insert(line);
     curr_ind = dequeue.size();
 }
 
 void history::decrement_history()
 {
-    if (curr_ind > 0) {
-        curr_ind--;
+    ensure_loaded();
+    for (int i = curr_ind - 1; i >= 0; i--) {
+        if (!dequeue[i].erased) {
+            curr_ind = i;
+            return;
+        }
     }
 }
 
 void history::increment_history()
 {
-    if (curr_ind < static_cast<int>(dequeue.size())) {
+    ensure_loaded();
+    int size = static_cast<int>(dequeue.size());
+    if (curr_ind < size) {
+        curr_ind++;
+    }
+    while (curr_ind < size && dequeue[curr_ind].erased) {
         curr_ind++;
     }
 }
 
-std::string history::get_curr()
+std::string_view history::get_curr()
 {
+    ensure_loaded();
     if (curr_ind >= static_cast<int>(dequeue.size())) {
         return "";
     }
@@ -118,27 +212,163 @@ std::string history::get_curr()
         }
     }
     
-    return dequeue[curr_ind];
+    return dequeue[curr_ind].line;
 }
 
 void history::clear_history()
 {
+    loaded = true;
+    sorted_index.clear();
+    line_index.clear();
     dequeue.clear();
+    base_seq = 0;
+    live_count = 0;
+    search_active = false;
     curr_ind = 0;
 }
 
-std::string history::get_history_item(int index)
+std::string_view history::get_history_item(int index)
 {
+    ensure_loaded();
     if (index < 0 || index >= static_cast<int>(dequeue.size())) {
         return "";
     }
     
-    return dequeue[index];
+    return dequeue[index].line;
+}
+
+void history::set_search_prefix(std::string_view prefix)
+{
+    ensure_loaded();
+    search_prefix.assign(prefix.data(), prefix.size());
+    search_matches.clear();
+    search_active = !search_prefix.empty();
+    if (!search_active) {
+        return;
+    }
+    
+    // Entries sharing the prefix are contiguous in the sorted index
+    std::string_view view(search_prefix);
+    for (auto it = sorted_index.lower_bound(std::make_pair(view, static_cast<long>(-1)));
+         it != sorted_index.end() && it->first.compare(0, view.size(), view) == 0; ++it) {
+        search_matches.push_back(it->second);
+    }
+    std::sort(search_matches.begin(), search_matches.end());
+}
+
+bool history::search_backward()
+{
+    ensure_loaded();
+    if (!search_active) {
+        int prev = curr_ind;
+        decrement_history();
+        return curr_ind != prev;
+    }
+    
+    // Newest match older than the current position, skipping entries that
+    // would show the same text again
+    std::string_view shown = get_curr();
+    long seq = base_seq + curr_ind;
+    auto it = std::lower_bound(search_matches.begin(), search_matches.end(), seq);
+    while (it != search_matches.begin()) {
+        --it;
+        if (*it < base_seq) break;
+        int index = static_cast<int>(*it - base_seq);
+        if (curr_ind < static_cast<int>(dequeue.size()) && dequeue[index].line == shown) continue;
+        curr_ind = index;
+        return true;
+    }
+    return false;
+}
+
+bool history::search_forward()
+{
+    ensure_loaded();
+    if (!search_active) {
+        int prev = curr_ind;
+        increment_history();
+        return curr_ind != prev;
+    }
+    
+    std::string_view shown = get_curr();
+    long seq = base_seq + curr_ind;
+    auto it = std::upper_bound(search_matches.begin(), search_matches.end(), seq);
+    for (; it != search_matches.end(); ++it) {
+        int index = static_cast<int>(*it - base_seq);
+        if (dequeue[index].line == shown) continue;
+        curr_ind = index;
+        return true;
+    }
+    
+    // Past the newest match: back to the line being edited
+    curr_ind = dequeue.size();
+    return true;
 }
 
 void history::print_history()
 {
-    for (int i = 0; i < static_cast<int>(dequeue.size()); i++) {
-        std::cout << (i + 1) << ": " << dequeue[i] << std::endl;
+    ensure_loaded();
+    int number = 0;
+    for (const auto& e : dequeue) {
+        if (!e.erased) {
+            std::cout << ++number << ": " << e.line << std::endl;
+        }
+    }
+}
+
+int history_builtin(history& h, const std::vector<std::string>& arguments)
+{
+    if (arguments.size() == 1) {
+        h.print_history();
+        return 0;
+    }
+
+    history_query query;
+    for (size_t i = 1; i < arguments.size(); i++) {
+        const std::string& arg = arguments[i];
+        if (arg == "--dir") {
+            query.by_cwd = true;
+            if (i + 1 < arguments.size() && arguments[i + 1][0] != '-') {
+                query.cwd = arguments[++i];
+            } else {
+                char cwd[PATH_MAX];
+                if (!getcwd(cwd, sizeof(cwd))) {
+                    std::cerr << "history: getcwd: " << strerror(errno) << std::endl;
+                    return 1;
+                }
+                query.cwd = cwd;
+            }
+        } else if (arg == "--failed") {
+            query.failed = true;
+        } else if (arg == "--since" && i + 1 < arguments.size()) {
+            double seconds;
+            if (!parse_duration(arguments[++i], seconds)) {
+                std::cerr << "history: invalid duration: " << arguments[i] << std::endl;
+                return 2;
+            }
+            query.since = time(nullptr) - static_cast<time_t>(seconds);
+        } else {
+            std::cerr << "history: usage: history [--dir [DIR]] [--failed] [--since DURATION]" << std::endl;
+            return 2;
+        }
+    }
+    if (!h.get_store().enabled()) {
+        std::cerr << "history: no history store (set XDG_STATE_HOME or HOME)" << std::endl;
+        return 1;
+    }
+
+    for (const auto& entry : h.get_store().select(query)) {
+        char when[32];
+        struct tm local;
+        localtime_r(&entry.start, &local);
+        strftime(when, sizeof(when), "%Y-%m-%d %H:%M:%S", &local);
+        std::cout << when << "  " << std::setw(3) << entry.status << "  "
+                  << std::fixed << std::setprecision(2) << std::setw(8) << entry.duration << "s  ";
+        std::cout.unsetf(std::ios::floatfield);
+        if (!query.by_cwd) {
+            std::cout << entry.cwd << "  ";
+        }
+        std::cout << entry.command << std::endl;
     }
+    return 0;
 }
@@ -4,43 +4,117 @@
 #include <readline/readline.h>
 #include <readline/history.h>
 #include <deque>
+#include <set>
+#include <unordered_map>
 #include <string>
+#include <string_view>
+#include <vector>
+#include <utility>
 #include <cstdio>
+#include <ctime>
+
+#include "history_store.hpp"
 
-#define HISTORY_FILE ".history"
 #define MAX_SIZE 1000
 
+// HISTCONTROL, a colon-separated list as in bash
+enum history_control {
+    HIST_IGNORESPACE = 1,       // lines starting with a blank are not kept
+    HIST_IGNOREDUPS = 2,        // nor a repeat of the previous line
+    HIST_ERASEDUPS = 4,         // an earlier copy of a line is removed
+};
+
 class history
 {
 private:
-    std::deque<std::string> dequeue;
+    // An erased entry keeps its place (and sequence number) until the
+    // next compaction, with its text freed
+    struct entry {
+        std::string line;
+        bool erased;
+    };
+    std::deque<entry> dequeue;
     int max_size;
     FILE *fp;
     
+    // Entries are numbered by a sequence that survives pop_front, so that
+    // index = seq - base_seq. The indexes hold views into dequeue, which
+    // stay valid because entries are only ever pushed at the back, popped
+    // at the front, or erased in place; compact() rebuilds them.
+    long base_seq;
+    std::set<std::pair<std::string_view, long>> sorted_index;
+    // Newest entry of each text, for O(1) duplicate checks on insert
+    std::unordered_map<std::string_view, long> line_index;
+    int live_count;             // entries not erased
+    
+    // HISTCONTROL flags
+    unsigned control;
+    
+    // Prefix navigation state: sequence numbers of matching entries
+    std::string search_prefix;
+    std::vector<long> search_matches;
+    bool search_active;
+    
+    void index_push_back();
+    void index_pop_front();
+    void erase_entry(long seq);
+    void compact();
+    void insert(const std::string& line);
+    
+    // The store is read on first use, not at startup: scripts and one-shot
+    // commands never touch it
+    history_store store;
+    bool loaded;
+    void ensure_loaded();
+    
     // Private helper methods
     void load_history_from_file();
-    void save_history_to_file();
 
 public:
     history();
-    ~history();
     
+    // Only meaningful once the history is loaded: call get_size() first
     int curr_ind;
     
+    // Set the HISTCONTROL policy; unset or empty is ignoredups
+    void set_control(std::string_view histcontrol);
+    // Should a line as typed be kept out of the history altogether?
+    bool ignores(std::string_view line) const;
+    
     // Basic operations
     int get_size();
     bool isempty();
     void add_history(const std::string& line);
+    // Persist a line once it ran, with where, when and how it went
+    void record(const std::string& line, const std::string& cwd,
+                time_t start, double duration, int status);
+    const history_store& get_store() const { return store; }
     void clear_history();
     
     // Navigation operations
     void decrement_history();
     void increment_history();
-    std::string get_curr();
-    std::string get_history_item(int index);
+    // Views point into the history itself and always cover a whole entry,
+    // so data() is NUL-terminated. They stay valid until the entry is
+    // evicted or erased, or the history cleared.
+    std::string_view get_curr();
+    std::string_view get_history_item(int index);
+    
+    // Prefix-filtered navigation (history-beginning-search): the matching
+    // entries are looked up once in the sorted index, each step is then a
+    // binary search. An empty prefix matches every entry.
+    void set_search_prefix(std::string_view prefix);
+    bool search_backward();
+    bool search_forward();
     
     // Display operations
     void print_history();
 };
 
+// history                      the lines of this session's navigation list
+// history [--dir [DIR]] [--failed] [--since DURATION]
+//                              entries of the store: run in DIR (default
+//                              the current directory), failed, recent
+int history_builtin(history& h, const std::vector<std::string>& arguments);
+
 #endif
\ No newline at end of file
@@ -0,0 +1,226 @@
+#include "history_store.hpp"
+#include <algorithm>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <string_view>
+#include <unordered_set>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+using namespace std;
+
+// A file mapped read-only for the length of a query
+struct mapped_file {
+    const char* data = nullptr;
+    size_t size = 0;
+
+    explicit mapped_file(const string& path)
+    {
+        int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd == -1) {
+            return;
+        }
+        struct stat st;
+        if (fstat(fd, &st) == 0 && st.st_size > 0) {
+            void* addr = mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+            if (addr != MAP_FAILED) {
+                data = static_cast<const char*>(addr);
+                size = st.st_size;
+            }
+        }
+        close(fd);
+    }
+
+    ~mapped_file()
+    {
+        if (data) {
+            munmap(const_cast<char*>(data), size);
+        }
+    }
+
+    mapped_file(const mapped_file&) = delete;
+    mapped_file& operator=(const mapped_file&) = delete;
+
+    const history_record* records() const { return reinterpret_cast<const history_record*>(data); }
+    size_t record_count() const { return size / sizeof(history_record); }
+
+    // The text of a record, or false when it points past the end
+    bool text(const history_record& r, string& cwd, string& command) const
+    {
+        if (r.text_offset > size || size - r.text_offset < uint64_t(r.cwd_length) + r.command_length) {
+            return false;
+        }
+        cwd.assign(data + r.text_offset, r.cwd_length);
+        command.assign(data + r.text_offset + r.cwd_length, r.command_length);
+        return true;
+    }
+};
+
+// mkdir -p with mode for the components it creates
+static bool make_directories(const string& path, mode_t mode)
+{
+    for (size_t slash = path.find('/', 1); ; slash = path.find('/', slash + 1)) {
+        string prefix = path.substr(0, slash);
+        if (mkdir(prefix.c_str(), mode) == -1 && errno != EEXIST) {
+            return false;
+        }
+        if (slash == string::npos) {
+            return true;
+        }
+    }
+}
+
+history_store::history_store()
+{
+    const char* state = getenv("XDG_STATE_HOME");
+    string base;
+    if (state && state[0] == '/') {
+        base = state;
+    } else if (const char* home = getenv("HOME")) {
+        base = string(home) + "/.local/state";
+    } else {
+        return;
+    }
+    if (make_directories(base + "/shellkil", 0700)) {
+        dir = base + "/shellkil";
+    }
+}
+
+uint64_t history_store::hash_cwd(const string& cwd)
+{
+    uint64_t hash = 14695981039346656037ULL;
+    for (unsigned char c : cwd) {
+        hash = (hash ^ c) * 1099511628211ULL;
+    }
+    return hash;
+}
+
+bool history_store::append(const string& command, const string& cwd,
+                           time_t start, double duration, int status)
+{
+    if (!enabled()) {
+        return false;
+    }
+    int index_fd = open(index_path().c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+    if (index_fd == -1) {
+        return false;
+    }
+    int text_fd = open(commands_path().c_str(), O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0600);
+    if (text_fd == -1) {
+        close(index_fd);
+        return false;
+    }
+
+    bool ok = false;
+    struct stat index_st, text_st;
+    if (flock(index_fd, LOCK_EX) == 0 && fstat(index_fd, &index_st) == 0 && fstat(text_fd, &text_st) == 0) {
+        // A shell killed halfway through an append leaves a partial
+        // record; write over it so the records stay aligned
+        off_t end = index_st.st_size - index_st.st_size % sizeof(history_record);
+        history_record r;
+        memset(&r, 0, sizeof(r));
+        r.start = start;
+        r.duration_ms = static_cast<uint32_t>(duration * 1000);
+        r.status = status;
+        r.cwd_hash = hash_cwd(cwd);
+        r.text_offset = text_st.st_size;
+        r.cwd_length = cwd.size();
+        r.command_length = command.size();
+        string text = cwd + command;
+        ok = write(text_fd, text.data(), text.size()) == static_cast<ssize_t>(text.size()) &&
+             pwrite(index_fd, &r, sizeof(r), end) == sizeof(r);
+    }
+    close(text_fd);
+    close(index_fd);       // releases the lock
+    return ok;
+}
+
+vector<string> history_store::recent(size_t count) const
+{
+    vector<string> commands;
+    if (!enabled()) {
+        return commands;
+    }
+    mapped_file index(index_path());
+    mapped_file text(commands_path());
+    size_t n = index.record_count();
+    string cwd, command;
+    for (size_t i = n > count ? n - count : 0; i < n; i++) {
+        if (text.text(index.records()[i], cwd, command)) {
+            commands.push_back(command);
+        }
+    }
+    return commands;
+}
+
+vector<string> history_store::recent_unique(size_t count) const
+{
+    vector<string> commands;
+    if (!enabled()) {
+        return commands;
+    }
+    mapped_file index(index_path());
+    mapped_file text(commands_path());
+    const history_record* records = index.records();
+    unordered_set<string_view> seen;
+    string cwd, command;
+    for (size_t i = index.record_count(); i > 0 && commands.size() < count; i--) {
+        if (!text.text(records[i - 1], cwd, command) || command.empty()) {
+            continue;
+        }
+        string_view view(text.data + records[i - 1].text_offset + cwd.size(), command.size());
+        if (seen.insert(view).second) {
+            commands.push_back(command);
+        }
+    }
+    reverse(commands.begin(), commands.end());
+    return commands;
+}
+
+vector<history_entry> history_store::select(const history_query& query) const
+{
+    vector<history_entry> entries;
+    if (!enabled()) {
+        return entries;
+    }
+    mapped_file index(index_path());
+    mapped_file text(commands_path());
+    const history_record* records = index.records();
+    size_t n = index.record_count();
+
+    // Branch-free pass over the fixed-size records: every condition is
+    // folded into one flag per entry, so the loop vectorizes
+    uint64_t want_hash = query.by_cwd ? hash_cwd(query.cwd) : 0;
+    uint8_t any_cwd = !query.by_cwd;
+    uint8_t any_status = !query.failed;
+    int64_t since = query.since;
+    vector<uint8_t> hits(n);
+    for (size_t i = 0; i < n; i++) {
+        hits[i] = ((records[i].cwd_hash == want_hash) | any_cwd) &
+                  ((records[i].status != 0) | any_status) &
+                  (records[i].start >= since);
+    }
+
+    for (size_t i = 0; i < n; i++) {
+        if (!hits[i]) {
+            continue;
+        }
+        history_entry entry;
+        if (!text.text(records[i], entry.cwd, entry.command)) {
+            continue;
+        }
+        // The hash only narrowed it down
+        if (query.by_cwd && entry.cwd != query.cwd) {
+            continue;
+        }
+        entry.start = records[i].start;
+        entry.duration = records[i].duration_ms / 1000.0;
+        entry.status = records[i].status;
+        entries.push_back(move(entry));
+    }
+    return entries;
+}
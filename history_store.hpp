@@ -0,0 +1,78 @@
+#ifndef __HISTORY_STORE_HPP
+#define __HISTORY_STORE_HPP
+
+#include <cstdint>
+#include <ctime>
+#include <string>
+#include <vector>
+
+// Persistent command history under $XDG_STATE_HOME/shellkil (by default
+// ~/.local/state/shellkil), shared by every shell of the user:
+//
+//   commands  the text of each entry: its cwd followed by the command
+//   index     one fixed-size history_record per entry, in run order
+//
+// Both files are only ever appended to, under an flock on the index, so
+// concurrent shells interleave whole entries. Queries map the index and
+// scan the records in one tight pass; the text is only read for entries
+// that match.
+
+// On disk as is, so its layout must not change
+struct history_record {
+    int64_t start;              // seconds since the epoch
+    uint32_t duration_ms;
+    int32_t status;
+    uint64_t cwd_hash;          // FNV-1a of the cwd
+    uint64_t text_offset;       // into commands
+    uint32_t cwd_length;
+    uint32_t command_length;
+};
+static_assert(sizeof(history_record) == 40, "history_record is an on-disk format");
+
+struct history_entry {
+    time_t start;
+    double duration;            // seconds
+    int status;
+    std::string cwd;
+    std::string command;
+};
+
+// Which entries select() returns; every condition set must hold
+struct history_query {
+    bool by_cwd = false;
+    std::string cwd;
+    bool failed = false;        // non-zero status only
+    time_t since = 0;           // started at or after this time
+};
+
+class history_store
+{
+public:
+    // The store of the current user; disabled when neither
+    // $XDG_STATE_HOME nor $HOME is set or the directory cannot be made
+    history_store();
+
+    bool enabled() const { return !dir.empty(); }
+
+    bool append(const std::string& command, const std::string& cwd,
+                time_t start, double duration, int status);
+
+    // The commands of the last count entries, oldest first
+    std::vector<std::string> recent(size_t count) const;
+
+    // The commands of the last count distinct lines, each at the place of
+    // its newest run, oldest first
+    std::vector<std::string> recent_unique(size_t count) const;
+
+    // Entries matching query, oldest first
+    std::vector<history_entry> select(const history_query& query) const;
+
+    static uint64_t hash_cwd(const std::string& cwd);
+
+private:
+    std::string dir;
+    std::string index_path() const { return dir + "/index"; }
+    std::string commands_path() const { return dir + "/commands"; }
+};
+
+#endif
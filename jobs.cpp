@@ -0,0 +1,613 @@
+#include "jobs.hpp"
+#include <iostream>
+#include <iomanip>
+#include <algorithm>
+#include <cerrno>
+#include <cmath>
+#include <cstring>
+#include <ctime>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/wait.h>
+#include <sys/syscall.h>
+#include <sys/timerfd.h>
+
+using namespace std;
+
+map<size_t, job> jobs;
+bool job_control = false;
+volatile sig_atomic_t interrupted = 0;
+volatile sig_atomic_t child_exited = 0;
+
+static size_t next_job_id = 1;
+static int shell_terminal = -1;     // -1 when stdin is not a terminal
+static pid_t shell_pgid = 0;
+static struct termios shell_modes;
+static bool any_deadline = false;   // some job in the table has one
+
+void init_job_control()
+{
+    job_control = true;
+    if (isatty(STDIN_FILENO)) {
+        // Started in the background: wait until brought to the foreground
+        pid_t pgid;
+        while (tcgetpgrp(STDIN_FILENO) != (pgid = getpgrp())) {
+            kill(-pgid, SIGTTIN);
+        }
+        shell_terminal = STDIN_FILENO;
+    }
+
+    // Stop signals from the terminal are meant for the foreground job
+    signal(SIGTSTP, SIG_IGN);
+    signal(SIGTTIN, SIG_IGN);
+    signal(SIGTTOU, SIG_IGN);
+    signal(SIGQUIT, SIG_IGN);
+
+    if (shell_terminal != -1) {
+        setpgid(0, 0);      // fails harmlessly for a session leader
+        shell_pgid = getpgrp();
+        tcsetpgrp(shell_terminal, shell_pgid);
+        tcgetattr(shell_terminal, &shell_modes);
+    }
+}
+
+void leave_job_control()
+{
+    jobs.clear();
+    job_control = false;
+    shell_terminal = -1;
+}
+
+void reset_child_signals()
+{
+    // Ignored signals stay ignored across exec; handled ones do not
+    signal(SIGINT, SIG_DFL);
+    signal(SIGTSTP, SIG_DFL);
+    signal(SIGTTIN, SIG_DFL);
+    signal(SIGTTOU, SIG_DFL);
+    signal(SIGQUIT, SIG_DFL);
+}
+
+void join_job_group(pid_t pid, pid_t& pgid, bool foreground, bool grouped)
+{
+    if (!job_control && !grouped) {
+        return;
+    }
+    if (pgid == 0) {
+        pgid = pid;
+    }
+    setpgid(pid, pgid);
+    if (foreground && shell_terminal != -1) {
+        tcsetpgrp(shell_terminal, pgid);
+    }
+}
+
+static void signal_job(const job& j, int signum)
+{
+    if (j.pgid > 0) {
+        kill(-j.pgid, signum);
+        return;
+    }
+    for (pid_t pid : j.pids) {
+        kill(pid, signum);
+    }
+}
+
+// Record that pid exited or was killed
+static void update_job(job& j, pid_t pid, int status)
+{
+    auto it = find(j.pids.begin(), j.pids.end(), pid);
+    if (it == j.pids.end()) {
+        return;
+    }
+    j.pids.erase(it);
+    if (pid == j.last) {
+        j.status = j.timed_out ? 124 : decode_wait_status(status);
+    }
+}
+
+static double monotonic_now()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+void set_job_timeout(job& j, double seconds, int signal, double kill_after)
+{
+    j.deadline = monotonic_now() + seconds;
+    j.timeout_signal = signal;
+    j.kill_after = kill_after;
+}
+
+// The deadline passed: signal the job, and arm the SIGKILL that follows
+static void expire_job(job& j, double now)
+{
+    if (!j.timed_out) {
+        j.timed_out = true;
+        signal_job(j, j.timeout_signal);
+        // A stopped job has to run to act on the signal
+        signal_job(j, SIGCONT);
+        j.deadline = j.kill_after > 0 ? now + j.kill_after : 0;
+    } else {
+        signal_job(j, SIGKILL);
+        j.deadline = 0;
+    }
+}
+
+static int open_pidfd(pid_t pid)
+{
+#ifdef SYS_pidfd_open
+    return static_cast<int>(syscall(SYS_pidfd_open, pid, 0));
+#else
+    return -1;
+#endif
+}
+
+// Signal the background jobs whose deadline passed and return the next
+// deadline, or 0 when none is left
+static double expire_background_jobs()
+{
+    if (!any_deadline) {
+        return 0;
+    }
+    double now = monotonic_now();
+    double next = 0;
+    for (auto& entry : jobs) {
+        job& j = entry.second;
+        if (j.deadline == 0 || j.done()) {
+            continue;
+        }
+        if (j.deadline <= now) {
+            expire_job(j, now);
+        }
+        if (j.deadline > 0 && (next == 0 || j.deadline < next)) {
+            next = j.deadline;
+        }
+    }
+    any_deadline = next > 0;
+    return next;
+}
+
+int enforce_deadlines()
+{
+    double next = expire_background_jobs();
+    if (next == 0) {
+        return -1;
+    }
+    return static_cast<int>(ceil((next - monotonic_now()) * 1000));
+}
+
+// wait_for_job() for a job with a deadline, or while background jobs have
+// one. The shell sleeps in ppoll() on
+// a timerfd for the deadline and a pidfd per process, so no helper process
+// is needed to time the job. A stop only shows as a SIGCHLD, so that is
+// let through while the shell sleeps.
+static int wait_with_deadline(job& j, bool foreground)
+{
+    int timer = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC);
+    if (timer == -1) {
+        perror("timerfd_create");
+        return 1;
+    }
+    map<pid_t, int> pidfds;
+    bool all_pidfds = true;
+    for (pid_t pid : j.pids) {
+        pidfds[pid] = open_pidfd(pid);
+        all_pidfds = all_pidfds && pidfds[pid] != -1;
+    }
+
+    sigset_t old_mask, chld_mask, wait_mask;
+    sigemptyset(&chld_mask);
+    sigaddset(&chld_mask, SIGCHLD);
+    sigprocmask(SIG_BLOCK, &chld_mask, &old_mask);
+    wait_mask = old_mask;
+    sigdelset(&wait_mask, SIGCHLD);
+
+    // Stops are only reported under job control, where they can be undone
+    int options = WNOHANG | (j.pgid > 0 ? WUNTRACED : 0);
+    double armed = -1;
+    int result = -1;
+    while (!j.pids.empty() && result == -1) {
+        double wake = expire_background_jobs();
+        if (j.deadline > 0 && (wake == 0 || j.deadline < wake)) {
+            wake = j.deadline;
+        }
+        if (wake != armed) {
+            // A zero it_value disarms the timer when no deadline is left
+            struct itimerspec spec = {};
+            double whole;
+            spec.it_value.tv_nsec = static_cast<long>(modf(wake, &whole) * 1e9);
+            spec.it_value.tv_sec = static_cast<time_t>(whole);
+            timerfd_settime(timer, TFD_TIMER_ABSTIME, &spec, NULL);
+            armed = wake;
+        }
+
+        vector<struct pollfd> fds;
+        fds.push_back({ timer, POLLIN, 0 });
+        for (pid_t pid : j.pids) {
+            if (pidfds[pid] != -1) {
+                fds.push_back({ pidfds[pid], POLLIN, 0 });
+            }
+        }
+        // Without pidfds (kernels before 5.3) exits are polled for
+        struct timespec tick = { 0, 50 * 1000000 };
+        if (ppoll(fds.data(), fds.size(), all_pidfds ? NULL : &tick, &wait_mask) == -1) {
+            if (errno != EINTR) {
+                // A pidfd gone bad, or no memory: poll waitpid on the tick
+                // from now on, pausing so a lasting error cannot spin
+                for (auto& entry : pidfds) {
+                    if (entry.second != -1) close(entry.second);
+                    entry.second = -1;
+                }
+                all_pidfds = false;
+                nanosleep(&tick, NULL);
+            } else if (interrupted) {
+                if (!foreground) {
+                    result = 130;
+                    break;
+                }
+                signal_job(j, SIGINT);
+                continue;
+            }
+            // A SIGCHLD: look for a stop below
+        }
+        if (fds[0].revents & POLLIN) {
+            // Only rearms the timer; the deadline is read off the clock,
+            // which also covers a ppoll that failed before the timer fired
+            uint64_t expirations;
+            ssize_t drained = read(timer, &expirations, sizeof(expirations));
+            (void)drained;
+        }
+        double now = monotonic_now();
+        if (j.deadline > 0 && j.deadline <= now) {
+            expire_job(j, now);
+        }
+
+        vector<pid_t> remaining = j.pids;
+        for (pid_t pid : remaining) {
+            int status;
+            pid_t ret = waitpid(pid, &status, options);
+            if (ret == 0) {
+                continue;
+            }
+            if (ret == pid && WIFSTOPPED(status)) {
+                j.stopped = true;
+                result = 128 + WSTOPSIG(status);
+                break;
+            }
+            if (ret == pid) {
+                // A SIGINT the timeout sent is not the user's Ctrl+C
+                if (foreground && !j.timed_out && WIFSIGNALED(status) && WTERMSIG(status) == SIGINT) {
+                    interrupted = 1;
+                }
+                update_job(j, pid, status);
+            } else {
+                // Reaped elsewhere; its status is lost
+                j.pids.erase(find(j.pids.begin(), j.pids.end(), pid));
+            }
+            if (pidfds[pid] != -1) {
+                close(pidfds[pid]);
+                pidfds[pid] = -1;
+            }
+        }
+    }
+
+    for (const auto& entry : pidfds) {
+        if (entry.second != -1) close(entry.second);
+    }
+    close(timer);
+    sigprocmask(SIG_SETMASK, &old_mask, NULL);
+    return result == -1 ? j.status : result;
+}
+
+int wait_for_job(job& j, bool foreground)
+{
+    if (!foreground && j.stopped) {
+        return 128 + SIGTSTP;
+    }
+    if (j.deadline > 0 || any_deadline) {
+        return wait_with_deadline(j, foreground);
+    }
+    // Stops are only reported under job control, where they can be undone
+    int options = j.pgid > 0 ? WUNTRACED : 0;
+    while (!j.pids.empty()) {
+        int status;
+        pid_t target = j.pgid > 0 ? -j.pgid : j.pids.front();
+        pid_t pid = waitpid(target, &status, options);
+        if (pid == -1) {
+            if (errno != EINTR) {
+                // Reaped elsewhere; its status is lost
+                j.pids.clear();
+                break;
+            }
+            if (interrupted) {
+                if (!foreground) {
+                    return 130;
+                }
+                signal_job(j, SIGINT);
+            }
+            continue;
+        }
+        if (WIFSTOPPED(status)) {
+            j.stopped = true;
+            return 128 + WSTOPSIG(status);
+        }
+        // A job killed from the keyboard stops the rest of the command list
+        if (foreground && WIFSIGNALED(status) && WTERMSIG(status) == SIGINT) {
+            if (!interrupted && job_control) {
+                cout << endl;
+            }
+            interrupted = 1;
+        }
+        update_job(j, pid, status);
+    }
+    return j.status;
+}
+
+void reclaim_terminal(job& j)
+{
+    if (shell_terminal == -1) {
+        return;
+    }
+    if (j.stopped) {
+        j.has_modes = tcgetattr(shell_terminal, &j.modes) == 0;
+    }
+    tcsetpgrp(shell_terminal, shell_pgid);
+    tcsetattr(shell_terminal, TCSADRAIN, &shell_modes);
+}
+
+static string job_state(const job& j)
+{
+    if (!j.done()) {
+        return j.stopped ? "Stopped" : "Running";
+    }
+    if (j.timed_out) {
+        return "Timed out";
+    }
+    if (j.status == 0) {
+        return "Done";
+    }
+    if (j.status > 128) {
+        return strsignal(j.status - 128);
+    }
+    return "Exit " + to_string(j.status);
+}
+
+static void print_job(size_t id, const job& j)
+{
+    cout << "[" << id << "]  " << left << setw(24) << job_state(j) << j.text << endl;
+}
+
+size_t add_job(const job& j)
+{
+    size_t id = next_job_id++;
+    jobs[id] = j;
+    any_deadline = any_deadline || j.deadline > 0;
+    if (job_control) {
+        if (j.stopped) {
+            cout << endl;
+            print_job(id, j);
+        } else {
+            cout << "[" << id << "] " << j.last << endl;
+        }
+    }
+    return id;
+}
+
+void reap_children()
+{
+    child_exited = 0;
+    int status;
+    pid_t pid;
+    while ((pid = waitpid(-1, &status, WNOHANG | WUNTRACED | WCONTINUED)) > 0) {
+        for (auto& entry : jobs) {
+            job& j = entry.second;
+            if (find(j.pids.begin(), j.pids.end(), pid) == j.pids.end()) {
+                continue;
+            }
+            bool was_stopped = j.stopped;
+            if (WIFSTOPPED(status)) {
+                j.stopped = true;
+            } else if (WIFCONTINUED(status)) {
+                j.stopped = false;
+            } else {
+                update_job(j, pid, status);
+            }
+            // The other stages of a job report the same stop separately
+            if (j.stopped != was_stopped || j.done()) {
+                j.notified = false;
+            }
+            break;
+        }
+    }
+}
+
+void notify_jobs()
+{
+    if (child_exited) {
+        reap_children();
+    }
+    for (auto it = jobs.begin(); it != jobs.end();) {
+        if (!it->second.notified) {
+            print_job(it->first, it->second);
+            it->second.notified = true;
+        }
+        if (it->second.done()) {
+            it = jobs.erase(it);
+        } else {
+            ++it;
+        }
+    }
+}
+
+// Exit status in the shell's convention: 128 + signal for killed children
+int decode_wait_status(int status)
+{
+    if (WIFEXITED(status)) {
+        return WEXITSTATUS(status);
+    }
+    if (WIFSIGNALED(status)) {
+        return 128 + WTERMSIG(status);
+    }
+    return 1;
+}
+
+// Find the job named by "%N" (or the most recent one without an operand)
+static bool find_job(const vector<string>& arguments, const string& name, size_t& id)
+{
+    if (arguments.size() > 2) {
+        cerr << name << ": usage: " << name << " [%JOB]" << endl;
+        return false;
+    }
+    if (arguments.size() == 1) {
+        if (jobs.empty()) {
+            cerr << name << ": no current job" << endl;
+            return false;
+        }
+        id = jobs.rbegin()->first;
+        return true;
+    }
+    const string& spec = arguments[1];
+    try {
+        id = stoul(spec[0] == '%' ? spec.substr(1) : spec);
+    } catch (const exception& e) {
+        id = 0;
+    }
+    if (jobs.count(id) == 0) {
+        cerr << name << ": " << spec << ": no such job" << endl;
+        return false;
+    }
+    return true;
+}
+
+// jobs [-p]: list the job table, or the process group of each job
+int jobs_builtin(const vector<string>& arguments)
+{
+    bool pids_only = arguments.size() > 1 && arguments[1] == "-p";
+    if (child_exited) {
+        reap_children();
+    }
+    for (auto it = jobs.begin(); it != jobs.end();) {
+        if (pids_only) {
+            cout << (it->second.pgid > 0 ? it->second.pgid : it->second.last) << endl;
+        } else {
+            print_job(it->first, it->second);
+        }
+        it->second.notified = true;
+        it = it->second.done() ? jobs.erase(it) : next(it);
+    }
+    return 0;
+}
+
+int fg_builtin(const vector<string>& arguments)
+{
+    size_t id;
+    if (!find_job(arguments, "fg", id)) {
+        return 1;
+    }
+    job& j = jobs[id];
+    cout << j.text << endl;
+    if (shell_terminal != -1 && j.pgid > 0) {
+        tcsetpgrp(shell_terminal, j.pgid);
+        if (j.has_modes) {
+            tcsetattr(shell_terminal, TCSADRAIN, &j.modes);
+        }
+    }
+    j.stopped = false;
+    signal_job(j, SIGCONT);
+
+    int status = wait_for_job(j, true);
+    reclaim_terminal(j);
+    if (j.stopped) {
+        cout << endl;
+        print_job(id, j);
+    } else {
+        jobs.erase(id);
+    }
+    return status;
+}
+
+int bg_builtin(const vector<string>& arguments)
+{
+    size_t id;
+    if (!find_job(arguments, "bg", id)) {
+        return 1;
+    }
+    job& j = jobs[id];
+    j.stopped = false;
+    signal_job(j, SIGCONT);
+    cout << "[" << id << "] " << j.text << " &" << endl;
+    return 0;
+}
+
+// Wait for background jobs: all of them, or the given %job ids and pids
+int wait_builtin(const vector<string>& arguments)
+{
+    vector<size_t> waited_jobs;
+    vector<pid_t> waited_pids;
+
+    if (arguments.size() == 1) {
+        for (const auto& entry : jobs) {
+            waited_jobs.push_back(entry.first);
+        }
+    }
+    for (size_t i = 1; i < arguments.size(); i++) {
+        const string& arg = arguments[i];
+        try {
+            if (!arg.empty() && arg[0] == '%') {
+                size_t id = stoul(arg.substr(1));
+                if (jobs.count(id) == 0) {
+                    cerr << "wait: " << arg << ": no such job" << endl;
+                    return 127;
+                }
+                waited_jobs.push_back(id);
+            } else {
+                waited_pids.push_back(stoi(arg));
+            }
+        } catch (const exception& e) {
+            cerr << "wait: " << arg << ": not a pid or valid job spec" << endl;
+            return 2;
+        }
+    }
+
+    int status = 0;
+    for (size_t id : waited_jobs) {
+        auto it = jobs.find(id);
+        if (it == jobs.end()) {
+            continue;
+        }
+        status = wait_for_job(it->second, false);
+        if (interrupted) {
+            return status;
+        }
+        if (it->second.done()) {
+            jobs.erase(it);
+        }
+    }
+    for (pid_t pid : waited_pids) {
+        int child_status;
+        pid_t ret;
+        while ((ret = waitpid(pid, &child_status, 0)) == -1 && errno == EINTR) {
+            if (interrupted) {
+                return 130;
+            }
+        }
+        // Children already reaped count as done
+        if (ret != pid) {
+            status = 0;
+            continue;
+        }
+        status = decode_wait_status(child_status);
+        for (auto it = jobs.begin(); it != jobs.end(); ++it) {
+            if (find(it->second.pids.begin(), it->second.pids.end(), pid) != it->second.pids.end()) {
+                update_job(it->second, pid, child_status);
+                if (it->second.done()) {
+                    jobs.erase(it);
+                }
+                break;
+            }
+        }
+    }
+    return arguments.size() == 1 ? 0 : status;
+}
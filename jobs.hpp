@@ -0,0 +1,95 @@
+#ifndef __JOBS_HPP
+#define __JOBS_HPP
+
+#include <csignal>
+#include <map>
+#include <string>
+#include <vector>
+#include <sys/types.h>
+#include <termios.h>
+
+// Job control. When it is on (an interactive shell) every pipeline runs in
+// a process group of its own, and a foreground group also owns the
+// terminal, so Ctrl+C and Ctrl+Z reach all of its stages at once and never
+// the shell. Signal handlers only set the flags below; waiting, reaping
+// and reporting happen in the main loop.
+
+// A pipeline (or a forked "&" block) together with what is known of it
+struct job {
+    pid_t pgid = 0;                 // 0 without job control
+    std::vector<pid_t> pids;        // processes not reaped yet
+    pid_t last = 0;                 // the job's status is this one's
+    std::string text;
+    bool stopped = false;
+    bool notified = true;           // state changes are reported once
+    int status = 0;
+    bool has_modes = false;
+    struct termios modes;           // terminal modes saved when it stopped
+    double deadline = 0;            // CLOCK_MONOTONIC seconds, 0 for none
+    int timeout_signal = SIGTERM;
+    double kill_after = 0;          // SIGKILL this long after the deadline
+    bool timed_out = false;         // the job's status is then 124
+
+    bool done() const { return pids.empty(); }
+};
+
+extern std::map<size_t, job> jobs;  // job id -> job
+extern bool job_control;
+extern volatile sig_atomic_t interrupted;      // SIGINT arrived or stopped a job
+extern volatile sig_atomic_t child_exited;     // SIGCHLD arrived
+
+// Turn job control on: put the shell in its own process group and, when
+// stdin is a terminal, take the terminal
+void init_job_control();
+
+// For a forked subshell: forget the job table and run children in the
+// subshell's own process group
+void leave_job_control();
+
+// Restore the default dispositions of the signals the shell handles
+void reset_child_signals();
+
+// Put a freshly forked process in its job's process group, led by the
+// first process of the job (pgid 0 starts a new one), and hand the
+// terminal to a foreground group. Called on both sides of fork() so the
+// group exists whichever side runs first. Without job control only a
+// grouped job (one with a timeout) gets a group, and never the terminal.
+void join_job_group(pid_t pid, pid_t& pgid, bool foreground, bool grouped = false);
+
+// Give the job a deadline: when it passes, the whole job (its process
+// group under job control) is sent signal, and SIGKILL kill_after seconds
+// later unless kill_after is 0
+void set_job_timeout(job& j, double seconds, int signal, double kill_after);
+
+// Wait until every process of the job is gone or the job stops. Returns
+// the job's status, 128 + signal when it stopped, or 130 when SIGINT
+// interrupted a wait for a background job. A SIGINT sent to the shell
+// while it waits in the foreground is passed on to the job. A job with a
+// deadline is waited for on a timerfd and pidfds of its processes.
+int wait_for_job(job& j, bool foreground);
+
+// Signal background jobs whose deadline passed. Returns the milliseconds
+// until the next deadline, or -1 when no job has one.
+int enforce_deadlines();
+
+// Take the terminal back after a foreground job ended or stopped
+void reclaim_terminal(job& j);
+
+// Add a background or stopped job to the table and report it
+size_t add_job(const job& j);
+
+// Collect the status of every child that changed state
+void reap_children();
+
+// Report jobs that finished or stopped since the last prompt
+void notify_jobs();
+
+// Exit status in the shell's convention: 128 + signal for killed children
+int decode_wait_status(int status);
+
+int jobs_builtin(const std::vector<std::string>& arguments);
+int fg_builtin(const std::vector<std::string>& arguments);
+int bg_builtin(const std::vector<std::string>& arguments);
+int wait_builtin(const std::vector<std::string>& arguments);
+
+#endif
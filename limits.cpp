@@ -0,0 +1,259 @@
+#include "limits.hpp"
+#include <iostream>
+#include <iomanip>
+#include <map>
+#include <cerrno>
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+
+using namespace std;
+
+// A resource ulimit knows about; values are shown and given in units of
+// scale bytes (or plain counts when scale is 1)
+struct limit_info {
+    char option;
+    int resource;
+    rlim_t scale;
+    const char* description;
+};
+
+static const limit_info LIMITS[] = {
+    { 'c', RLIMIT_CORE,    1024, "core file size (kbytes)" },
+    { 'd', RLIMIT_DATA,    1024, "data seg size (kbytes)" },
+    { 'f', RLIMIT_FSIZE,   1024, "file size (kbytes)" },
+    { 'l', RLIMIT_MEMLOCK, 1024, "max locked memory (kbytes)" },
+    { 'm', RLIMIT_RSS,     1024, "max memory size (kbytes)" },
+    { 'n', RLIMIT_NOFILE,  1,    "open files" },
+    { 's', RLIMIT_STACK,   1024, "stack size (kbytes)" },
+    { 't', RLIMIT_CPU,     1,    "cpu time (seconds)" },
+    { 'u', RLIMIT_NPROC,   1,    "max user processes" },
+    { 'v', RLIMIT_AS,      1024, "virtual memory (kbytes)" },
+};
+
+// Limits children get; resources not in here are inherited unchanged
+static map<int, struct rlimit> limit_overrides;
+
+bool parse_duration(const string& text, double& seconds)
+{
+    char* end;
+    errno = 0;
+    double value = strtod(text.c_str(), &end);
+    if (text.empty() || end == text.c_str() || errno != 0 || value < 0 || !isfinite(value)) {
+        return false;
+    }
+    string suffix(end);
+    if (suffix == "" || suffix == "s") {
+        seconds = value;
+    } else if (suffix == "m") {
+        seconds = value * 60;
+    } else if (suffix == "h") {
+        seconds = value * 3600;
+    } else if (suffix == "d") {
+        seconds = value * 86400;
+    } else {
+        return false;
+    }
+    return true;
+}
+
+bool parse_signal(const string& text, int& signum)
+{
+    static const map<string, int> names = {
+        { "HUP", SIGHUP }, { "INT", SIGINT }, { "QUIT", SIGQUIT }, { "KILL", SIGKILL },
+        { "USR1", SIGUSR1 }, { "USR2", SIGUSR2 }, { "PIPE", SIGPIPE }, { "ALRM", SIGALRM },
+        { "TERM", SIGTERM }, { "CONT", SIGCONT }, { "STOP", SIGSTOP },
+    };
+    if (!text.empty() && isdigit(static_cast<unsigned char>(text[0]))) {
+        char* end;
+        long value = strtol(text.c_str(), &end, 10);
+        if (*end != '\0' || value <= 0 || value >= NSIG) {
+            return false;
+        }
+        signum = static_cast<int>(value);
+        return true;
+    }
+    string name = text.compare(0, 3, "SIG") == 0 ? text.substr(3) : text;
+    auto it = names.find(name);
+    if (it == names.end()) {
+        return false;
+    }
+    signum = it->second;
+    return true;
+}
+
+bool parse_timeout(const vector<string>& arguments, timeout_spec& timeout,
+                   size_t& consumed, string& error)
+{
+    size_t i = 1;
+    for (; i < arguments.size() && arguments[i].size() > 1 && arguments[i][0] == '-'; i++) {
+        const string& arg = arguments[i];
+        if (arg == "--") {
+            i++;
+            break;
+        }
+        if (arg != "-s" && arg != "-k") {
+            error = "unknown option " + arg;
+            return false;
+        }
+        if (i + 1 >= arguments.size()) {
+            error = "option " + arg + " needs a value";
+            return false;
+        }
+        const string& value = arguments[++i];
+        if (arg == "-s" && !parse_signal(value, timeout.signal)) {
+            error = "invalid signal: " + value;
+            return false;
+        }
+        if (arg == "-k" && (!parse_duration(value, timeout.kill_after) || timeout.kill_after == 0)) {
+            error = "invalid duration: " + value;
+            return false;
+        }
+    }
+
+    if (i >= arguments.size()) {
+        error = "missing duration";
+        return false;
+    }
+    if (!parse_duration(arguments[i], timeout.seconds) || timeout.seconds == 0) {
+        error = "invalid duration: " + arguments[i];
+        return false;
+    }
+    if (++i >= arguments.size()) {
+        error = "missing command";
+        return false;
+    }
+    consumed = i;
+    return true;
+}
+
+// The limit children will get: the recorded one or the shell's own
+static struct rlimit current_limit(int resource)
+{
+    auto it = limit_overrides.find(resource);
+    if (it != limit_overrides.end()) {
+        return it->second;
+    }
+    struct rlimit limit;
+    getrlimit(resource, &limit);
+    return limit;
+}
+
+static void print_limit(rlim_t value, rlim_t scale)
+{
+    if (value == RLIM_INFINITY) {
+        cout << "unlimited" << endl;
+    } else {
+        cout << value / scale << endl;
+    }
+}
+
+int ulimit_builtin(const vector<string>& arguments)
+{
+    bool soft = false, hard = false, all = false;
+    const limit_info* info = nullptr;
+    string value;
+
+    for (size_t i = 1; i < arguments.size(); i++) {
+        const string& arg = arguments[i];
+        if (arg.size() < 2 || arg[0] != '-') {
+            if (!value.empty()) {
+                cerr << "ulimit: too many arguments" << endl;
+                return 2;
+            }
+            value = arg;
+            continue;
+        }
+        for (size_t j = 1; j < arg.size(); j++) {
+            char option = arg[j];
+            if (option == 'S') {
+                soft = true;
+            } else if (option == 'H') {
+                hard = true;
+            } else if (option == 'a') {
+                all = true;
+            } else {
+                info = nullptr;
+                for (const auto& limit : LIMITS) {
+                    if (limit.option == option) info = &limit;
+                }
+                if (!info) {
+                    cerr << "ulimit: -" << option << ": invalid option" << endl;
+                    cerr << "ulimit: usage: ulimit [-SH] [-a | -c|-d|-f|-l|-m|-n|-s|-t|-u|-v [LIMIT]]" << endl;
+                    return 2;
+                }
+            }
+        }
+    }
+    if (!info) {
+        info = &LIMITS[2];      // -f, as in sh
+    }
+
+    if (all) {
+        for (const auto& limit : LIMITS) {
+            struct rlimit current = current_limit(limit.resource);
+            cout << left << setw(32) << limit.description << "(-" << limit.option << ") ";
+            print_limit(hard && !soft ? current.rlim_max : current.rlim_cur, limit.scale);
+        }
+        return 0;
+    }
+
+    struct rlimit current = current_limit(info->resource);
+    if (value.empty()) {
+        print_limit(hard && !soft ? current.rlim_max : current.rlim_cur, info->scale);
+        return 0;
+    }
+
+    rlim_t new_value;
+    if (value == "unlimited") {
+        new_value = RLIM_INFINITY;
+    } else {
+        char* end;
+        errno = 0;
+        unsigned long long parsed = strtoull(value.c_str(), &end, 10);
+        if (*end != '\0' || errno != 0 || value[0] == '-') {
+            cerr << "ulimit: " << value << ": invalid number" << endl;
+            return 1;
+        }
+        new_value = static_cast<rlim_t>(parsed) * info->scale;
+    }
+
+    // Without -S or -H both limits are set
+    struct rlimit limit = current;
+    if (soft || !hard) limit.rlim_cur = new_value;
+    if (hard || !soft) limit.rlim_max = new_value;
+
+    // Catch now what setrlimit() would refuse in every child: try it in a
+    // throwaway one, since the rules depend on privileges and sysctls
+    int error = 0;
+    pid_t pid = fork();
+    if (pid == 0) {
+        _exit(setrlimit(info->resource, &limit) == -1 ? errno : 0);
+    }
+    int status;
+    if (pid == -1 || waitpid(pid, &status, 0) != pid) {
+        error = errno;
+    } else if (WIFEXITED(status)) {
+        error = WEXITSTATUS(status);
+    }
+    if (error != 0) {
+        cerr << "ulimit: " << info->description << ": cannot modify limit: " << strerror(error) << endl;
+        return 1;
+    }
+    limit_overrides[info->resource] = limit;
+    return 0;
+}
+
+bool apply_limits(string& error)
+{
+    for (const auto& entry : limit_overrides) {
+        if (setrlimit(entry.first, &entry.second) == -1) {
+            error = string("setrlimit: ") + strerror(errno);
+            return false;
+        }
+    }
+    return true;
+}
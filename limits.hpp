@@ -0,0 +1,43 @@
+#ifndef __LIMITS_HPP
+#define __LIMITS_HPP
+
+#include <csignal>
+#include <string>
+#include <vector>
+
+// Resource limits and timeouts for the commands the shell starts.
+//
+// "ulimit" records limits in the shell instead of lowering its own, and
+// every child applies them between fork and exec, so a limit meant for an
+// untrusted command can never starve the shell itself.
+//
+// "timeout DURATION cmd..." is a command prefix like "sched". The shell
+// enforces it while waiting for the pipeline (see jobs.hpp), without a
+// helper process.
+
+// From a "timeout [-s SIGNAL] [-k DURATION] DURATION" prefix
+struct timeout_spec {
+    double seconds = 0;             // 0 for no timeout
+    int signal = SIGTERM;
+    double kill_after = 0;          // SIGKILL this long after signal; 0 never
+};
+
+// Parse "1.5", "30s", "2m", "1h" or "1d" into seconds
+bool parse_duration(const std::string& text, double& seconds);
+
+// Parse "TERM", "SIGTERM" or "15"
+bool parse_signal(const std::string& text, int& signum);
+
+// Parse the options after "timeout" in arguments[0]. On success consumed
+// is the number of words (including "timeout") that belong to the prefix.
+bool parse_timeout(const std::vector<std::string>& arguments, timeout_spec& timeout,
+                   size_t& consumed, std::string& error);
+
+// ulimit [-SH] [-a | -c|-d|-f|-l|-m|-n|-s|-t|-u|-v [LIMIT]]
+int ulimit_builtin(const std::vector<std::string>& arguments);
+
+// Apply the limits set with ulimit to the calling process; meant for a
+// freshly forked child
+bool apply_limits(std::string& error);
+
+#endif
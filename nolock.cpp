@@ -7,6 +7,7 @@
 #include <cstring>
 #include <cerrno>
 #include <signal.h>
+#include <string>
 
 using namespace std;
 
@@ -17,17 +18,20 @@ void signal_handler(int signum) {
     should_exit = true;
 }
 
-int main() {
+int main(int argc, char* argv[]) {
+    // Usage: nolock [file]
+    string filename = argc > 1 ? argv[1] : "lock.txt";
+
     // Set up signal handlers for graceful shutdown
     signal(SIGINT, signal_handler);
     signal(SIGTERM, signal_handler);
     
     cout << "Process PID: " << getpid() << endl;
-    cout << "Opening lock.txt without file locking..." << endl;
+    cout << "Opening " << filename << " without file locking..." << endl;
     
-    FILE *fp = fopen("lock.txt", "w");
+    FILE *fp = fopen(filename.c_str(), "w");
     if (!fp) {
-        cerr << "Error: Cannot create/open lock.txt: " << strerror(errno) << endl;
+        cerr << "Error: Cannot create/open " << filename << ": " << strerror(errno) << endl;
         return 1;
     }
     
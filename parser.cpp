@@ -0,0 +1,765 @@
+#include "parser.hpp"
+#include <cstring>
+#include <cctype>
+#include <algorithm>
+
+using namespace std;
+
+string trim_blanks(const string& text)
+{
+    size_t start = text.find_first_not_of(" \t\n");
+    if (start == string::npos) {
+        return "";
+    }
+    size_t end = text.find_last_not_of(" \t\n");
+    return text.substr(start, end - start + 1);
+}
+
+// Can a word start right after prev, so that a '#' there begins a comment?
+static bool word_boundary(char prev)
+{
+    return isspace(static_cast<unsigned char>(prev)) || strchr(";&|()", prev);
+}
+
+// Mark the characters that sit outside quotes, backquotes, backslash
+// escapes and parentheses. Only those can start an operator. Comments
+// end at the newline before any quote is looked for, so an apostrophe in
+// one opens nothing; comments receives the position of each top-level
+// '#' that starts one, and the comment text itself is never marked.
+static vector<bool> top_level_mask(const string& text, vector<bool>* comments = nullptr)
+{
+    vector<bool> mask(text.size(), false);
+    if (comments) {
+        comments->assign(text.size(), false);
+    }
+    int depth = 0;
+    char quote = 0;
+    bool word_start = true;
+
+    for (size_t i = 0; i < text.size(); i++) {
+        char c = text[i];
+        if (quote) {
+            if (c == '\\' && quote != '\'' && i + 1 < text.size()) {
+                i++;
+            } else if (c == quote) {
+                quote = 0;
+            }
+            continue;
+        }
+        if (c == '#' && word_start) {
+            if (depth == 0) {
+                mask[i] = true;
+                if (comments) (*comments)[i] = true;
+            }
+            while (i + 1 < text.size() && text[i + 1] != '\n') {
+                i++;
+            }
+            continue;
+        }
+        word_start = word_boundary(c);
+        if (c == '\\') {
+            i++;
+            continue;
+        }
+        if (c == '\'' || c == '"' || c == '`') {
+            quote = c;
+            continue;
+        }
+        if (c == '(') {
+            if (depth == 0) mask[i] = true;
+            depth++;
+            continue;
+        }
+        if (c == ')') {
+            if (depth == 0) {
+                throw runtime_error("syntax error near unexpected token `)'");
+            }
+            depth--;
+            if (depth == 0) mask[i] = true;
+            continue;
+        }
+        mask[i] = (depth == 0);
+    }
+
+    if (quote) {
+        throw runtime_error(string("unexpected end of line while looking for matching `") + quote + "'");
+    }
+    if (depth > 0) {
+        throw runtime_error("unexpected end of line while looking for matching `)'");
+    }
+    return mask;
+}
+
+vector<list_entry> split_list(const string& line)
+{
+    vector<bool> comments;
+    vector<bool> mask = top_level_mask(line, &comments);
+    vector<list_entry> entries;
+    string current;
+
+    auto finish = [&](const string& op) {
+        string text = trim_blanks(current);
+        if (text.empty()) {
+            throw runtime_error("syntax error near unexpected token `" + op + "'");
+        }
+        entries.push_back({ text, op });
+        current.clear();
+    };
+
+    for (size_t i = 0; i < line.size(); i++) {
+        char c = line[i];
+        if (!mask[i]) {
+            current += c;
+            continue;
+        }
+
+        // A '#' starting a word comments out the rest of the line
+        if (comments[i]) {
+            while (i + 1 < line.size() && line[i + 1] != '\n') {
+                i++;
+            }
+            continue;
+        }
+
+        // Newlines end commands like ';' but blank lines are skipped
+        if (c == '\n') {
+            if (!trim_blanks(current).empty()) {
+                finish(";");
+            }
+            continue;
+        }
+
+        bool doubled = (i + 1 < line.size() && line[i + 1] == c && mask[i + 1]);
+        if (c == ';') {
+            finish(";");
+        } else if (c == '&' && doubled) {
+            finish("&&");
+            i++;
+        } else if (c == '|' && doubled) {
+            finish("||");
+            i++;
+        } else if (c == '&' && (i == 0 || (line[i - 1] != '>' && line[i - 1] != '<'))) {
+            // "2>&1" and "<&3" duplicate descriptors rather than background
+            finish("&");
+        } else {
+            current += c;
+        }
+    }
+
+    string rest = trim_blanks(current);
+    if (!rest.empty()) {
+        entries.push_back({ rest, "" });
+    } else if (!entries.empty() && (entries.back().op == "&&" || entries.back().op == "||")) {
+        throw runtime_error("syntax error: unexpected end of line after `" + entries.back().op + "'");
+    }
+    return entries;
+}
+
+vector<string> split_pipeline(const string& text)
+{
+    vector<bool> mask = top_level_mask(text);
+    vector<string> stages;
+    string current;
+
+    for (size_t i = 0; i < text.size(); i++) {
+        if (mask[i] && text[i] == '|') {
+            string stage = trim_blanks(current);
+            if (stage.empty()) {
+                throw runtime_error("syntax error near unexpected token `|'");
+            }
+            stages.push_back(stage);
+            current.clear();
+        } else {
+            current += text[i];
+        }
+    }
+
+    string stage = trim_blanks(current);
+    if (stage.empty()) {
+        throw runtime_error("syntax error near unexpected token `|'");
+    }
+    stages.push_back(stage);
+    return stages;
+}
+
+bool is_group(const string& text, string& inner)
+{
+    if (text.size() < 2 || text.front() != '(' || text.back() != ')') {
+        return false;
+    }
+
+    // The opening parenthesis must close at the very end
+    vector<bool> mask = top_level_mask(text);
+    for (size_t i = 1; i + 1 < text.size(); i++) {
+        if (mask[i]) {
+            return false;
+        }
+    }
+    inner = trim_blanks(text.substr(1, text.size() - 2));
+    return true;
+}
+
+// Index of the ')' closing the '(' at open, skipping quoted text
+static size_t matching_paren(const string& text, size_t open)
+{
+    int depth = 0;
+    char quote = 0;
+    for (size_t i = open; i < text.size(); i++) {
+        char c = text[i];
+        if (quote) {
+            if (c == '\\' && quote == '"') {
+                i++;
+            } else if (c == quote) {
+                quote = 0;
+            }
+        } else if (c == '\\') {
+            i++;
+        } else if (c == '\'' || c == '"') {
+            quote = c;
+        } else if (c == '(') {
+            depth++;
+        } else if (c == ')' && --depth == 0) {
+            return i;
+        }
+    }
+    return string::npos;
+}
+
+vector<command_token> lex_command(const string& text)
+{
+    vector<command_token> tokens;
+    string current;
+    bool in_word = false;
+    bool plain = true;      // current has no quotes or escapes
+    char quote = 0;
+
+    auto finish_word = [&]() {
+        if (in_word) {
+            tokens.push_back({ command_token::WORD, current });
+            current.clear();
+            in_word = false;
+            plain = true;
+        }
+    };
+
+    // "$(...)" stays in the word whole, quotes and blanks inside included
+    auto append_substitution = [&](size_t& i) {
+        size_t close = matching_paren(text, i + 1);
+        if (close == string::npos) {
+            throw runtime_error("unexpected end of line while looking for matching `)'");
+        }
+        current.append(text, i, close - i + 1);
+        i = close;
+    };
+
+    for (size_t i = 0; i < text.size(); i++) {
+        char c = text[i];
+        if (quote) {
+            if (quote == '"' && text.compare(i, 2, "$(") == 0) {
+                append_substitution(i);
+                continue;
+            }
+            current += c;
+            if (c == '\\' && quote != '\'' && i + 1 < text.size()) {
+                current += text[++i];
+            } else if (c == quote) {
+                quote = 0;
+            }
+            continue;
+        }
+        if (c == '\\') {
+            current += c;
+            if (i + 1 < text.size()) {
+                current += text[++i];
+            }
+            in_word = true;
+            plain = false;
+            continue;
+        }
+        if (text.compare(i, 2, "$(") == 0) {
+            append_substitution(i);
+            in_word = true;
+            plain = false;
+            continue;
+        }
+        if (c == '\'' || c == '"' || c == '`') {
+            quote = c;
+            current += c;
+            in_word = true;
+            plain = false;
+            continue;
+        }
+        if (c == ' ' || c == '\t' || c == '\n') {
+            finish_word();
+            continue;
+        }
+        if ((c == '<' || c == '>') && !in_word && i + 1 < text.size() && text[i + 1] == '(') {
+            size_t close = matching_paren(text, i + 1);
+            if (close == string::npos) {
+                throw runtime_error("unexpected end of line while looking for matching `)'");
+            }
+            tokens.push_back({ command_token::PROCSUB, c + text.substr(i + 2, close - i - 2) });
+            i = close;
+            continue;
+        }
+        if (c == '<' || c == '>') {
+            // "2>" redirects descriptor 2; "a2>" is the word a2 and ">"
+            string op;
+            if (in_word && plain && all_of(current.begin(), current.end(), ::isdigit)) {
+                op = current;
+                current.clear();
+                in_word = false;
+            } else {
+                finish_word();
+            }
+
+            op += c;
+            string next = text.substr(i + 1, 2);
+            if (c == '>' && (next[0] == '>' || next[0] == '&' || next[0] == '|')) {
+                if (next[0] != '|') op += next[0];
+                i++;
+            } else if (c == '<' && next == "<<") {
+                op += "<<";
+                i += 2;
+            } else if (c == '<' && next == "<-") {
+                op += "<-";
+                i += 2;
+            } else if (c == '<' && (next[0] == '<' || next[0] == '&' || next[0] == '>')) {
+                op += next[0];
+                i++;
+            }
+            tokens.push_back({ command_token::REDIRECT, op });
+            continue;
+        }
+        current += c;
+        in_word = true;
+    }
+
+    if (quote) {
+        throw runtime_error(string("unexpected end of line while looking for matching `") + quote + "'");
+    }
+    finish_word();
+    return tokens;
+}
+
+bool is_heredoc_operator(const command_token& token)
+{
+    if (token.kind != command_token::REDIRECT) {
+        return false;
+    }
+    size_t start = token.text.find_first_of("<>");
+    return token.text.compare(start, string::npos, "<<") == 0 ||
+           token.text.compare(start, string::npos, "<<-") == 0;
+}
+
+string remove_quotes(const string& raw)
+{
+    string out;
+    char quote = 0;
+    for (size_t i = 0; i < raw.size(); i++) {
+        char c = raw[i];
+        if (quote) {
+            if (c == quote) {
+                quote = 0;
+            } else if (c == '\\' && quote == '"' && i + 1 < raw.size() && strchr("$`\"\\", raw[i + 1])) {
+                out += raw[++i];
+            } else {
+                out += c;
+            }
+        } else if (c == '\'' || c == '"') {
+            quote = c;
+        } else if (c == '\\') {
+            if (i + 1 < raw.size()) out += raw[++i];
+        } else {
+            out += c;
+        }
+    }
+    return out;
+}
+
+string extract_heredocs(const string& text, vector<string>& bodies)
+{
+    struct pending_heredoc {
+        string delimiter;
+        bool strip_tabs;
+    };
+    vector<pending_heredoc> pending;
+    string out;
+    char quote = 0;
+    int depth = 0;
+
+    for (size_t i = 0; i < text.size(); i++) {
+        char c = text[i];
+        if (quote) {
+            out += c;
+            if (c == '\\' && quote == '"' && i + 1 < text.size()) {
+                out += text[++i];
+            } else if (c == quote) {
+                quote = 0;
+            }
+            continue;
+        }
+        if (c == '\\') {
+            out += c;
+            if (i + 1 < text.size()) out += text[++i];
+            continue;
+        }
+        if (c == '\'' || c == '"') {
+            quote = c;
+            out += c;
+            continue;
+        }
+        if (c == '#' && (out.empty() || word_boundary(out.back()))) {
+            size_t nl = text.find('\n', i);
+            size_t end = (nl == string::npos) ? text.size() : nl;
+            out.append(text, i, end - i);
+            i = end - 1;
+            continue;
+        }
+        if (c == '(') depth++;
+        if (c == ')') depth--;
+
+        if (text.compare(i, 3, "<<<") == 0) {
+            out += "<<<";
+            i += 2;
+            continue;
+        }
+
+        // Bodies inside a group are left for the group's own compilation
+        if (c == '<' && depth == 0 && text.compare(i, 2, "<<") == 0) {
+            size_t j = i + 2;
+            bool strip_tabs = (j < text.size() && text[j] == '-');
+            if (strip_tabs) j++;
+            while (j < text.size() && (text[j] == ' ' || text[j] == '\t')) j++;
+
+            size_t k = j;
+            while (k < text.size() && !strchr(" \t\n;&|<>()", text[k])) {
+                if (text[k] == '\'' || text[k] == '"') {
+                    size_t close = text.find(text[k], k + 1);
+                    k = (close == string::npos) ? text.size() : close + 1;
+                } else {
+                    k += (text[k] == '\\') ? 2 : 1;
+                }
+            }
+            k = min(k, text.size());
+            if (k == j) {
+                throw runtime_error("syntax error: here-document needs a delimiter");
+            }
+            pending.push_back({ remove_quotes(text.substr(j, k - j)), strip_tabs });
+            out.append(text, i, k - i);
+            i = k - 1;
+            continue;
+        }
+
+        if (c == '\n' && !pending.empty()) {
+            out += c;
+            size_t pos = i + 1;
+            for (const auto& heredoc : pending) {
+                string body;
+                bool terminated = false;
+                while (pos < text.size()) {
+                    size_t nl = text.find('\n', pos);
+                    string line = text.substr(pos, nl == string::npos ? string::npos : nl - pos);
+                    pos = (nl == string::npos) ? text.size() : nl + 1;
+                    if (heredoc.strip_tabs) {
+                        line.erase(0, line.find_first_not_of('\t'));
+                    }
+                    if (line == heredoc.delimiter) {
+                        terminated = true;
+                        break;
+                    }
+                    body += line;
+                    body += '\n';
+                }
+                if (!terminated) {
+                    throw incomplete_input("here-document delimited by `" + heredoc.delimiter + "' is not terminated");
+                }
+                bodies.push_back(body);
+            }
+            pending.clear();
+            i = pos - 1;
+            continue;
+        }
+        out += c;
+    }
+
+    if (!pending.empty()) {
+        throw incomplete_input("here-document delimited by `" + pending[0].delimiter + "' is not terminated");
+    }
+    return out;
+}
+
+bool is_assignment(const string& raw)
+{
+    size_t eq = raw.find('=');
+    return eq != string::npos && variable_table::valid_name(string_view(raw).substr(0, eq));
+}
+
+static bool is_glob_char(char c)
+{
+    return c == '*' || c == '?' || c == '[';
+}
+
+// Builds the fields of one word as expansion proceeds
+struct field_builder {
+    pmr::vector<expanded_word>& out;
+    expanded_word current;
+    bool started = false;       // quotes alone still make an (empty) field
+    bool has_glob = false;
+
+    explicit field_builder(pmr::vector<expanded_word>& fields) : out(fields) {}
+
+    void add(char c, bool quoted) {
+        current.text += c;
+        if (quoted && (is_glob_char(c) || c == '\\')) {
+            current.pattern += '\\';
+        } else if (!quoted && is_glob_char(c)) {
+            has_glob = true;
+        }
+        current.pattern += c;
+        started = true;
+    }
+
+    void add(const string& str, bool quoted) {
+        for (char c : str) add(c, quoted);
+    }
+
+    void finish() {
+        if (!started) return;
+        if (!has_glob) current.pattern.clear();
+        out.push_back(current);
+        current = expanded_word();
+        started = has_glob = false;
+    }
+};
+
+// Value of a special or positional parameter named by name, which is
+// "?", "$", "#", "@", "*" or a number
+static bool special_parameter(const string& name, const expansion_context& ctx, string& value)
+{
+    static const vector<string> no_parameters;
+    const vector<string>& params = ctx.positional ? *ctx.positional : no_parameters;
+
+    if (name == "?") {
+        value = to_string(ctx.last_status);
+    } else if (name == "$") {
+        value = to_string(ctx.shell_pid);
+    } else if (name == "#") {
+        value = to_string(params.empty() ? 0 : params.size() - 1);
+    } else if (name == "@" || name == "*") {
+        value.clear();
+        for (size_t j = 1; j < params.size(); j++) {
+            if (j > 1) value += ' ';
+            value += params[j];
+        }
+    } else if (!name.empty() && all_of(name.begin(), name.end(), ::isdigit)) {
+        size_t index = stoul(name);
+        value = index < params.size() ? params[index] : "";
+    } else {
+        return false;
+    }
+    return true;
+}
+
+// Parse a parameter reference at raw[i] == '$' and return its value; i is
+// left on the last character consumed. Returns false for a lone '$'.
+static bool expand_parameter(const string& raw, size_t& i, const expansion_context& ctx, string& value)
+{
+    if (i + 1 >= raw.size()) {
+        return false;
+    }
+
+    char next = raw[i + 1];
+    if (strchr("?$#@*", next) || isdigit(static_cast<unsigned char>(next))) {
+        special_parameter(string(1, next), ctx, value);
+        i++;
+        return true;
+    }
+
+    string name;
+    if (next == '{') {
+        size_t close = raw.find('}', i + 2);
+        if (close == string::npos) {
+            throw runtime_error("bad substitution: missing `}'");
+        }
+        name = raw.substr(i + 2, close - i - 2);
+        i = close;
+        if (special_parameter(name, ctx, value)) {
+            return true;
+        }
+        if (!variable_table::valid_name(name)) {
+            throw runtime_error("bad substitution: ${" + name + "}");
+        }
+    } else {
+        size_t j = i + 1;
+        while (j < raw.size() && (isalnum(static_cast<unsigned char>(raw[j])) || raw[j] == '_')) {
+            j++;
+        }
+        name = raw.substr(i + 1, j - i - 1);
+        if (!variable_table::valid_name(name)) {
+            return false;
+        }
+        i = j - 1;
+    }
+
+    const char* found = ctx.variables ? ctx.variables->get(name) : nullptr;
+    value = found ? found : "";
+    return true;
+}
+
+// Run the command substitution at raw[i], "$(...)" or "`...`", and return
+// its output without trailing newlines; i is left on the last character
+// consumed
+static string command_substitution(const string& raw, size_t& i, const expansion_context& ctx)
+{
+    string command;
+    if (raw[i] == '`') {
+        // Inside backquotes a backslash only escapes $, ` and itself
+        size_t j = i + 1;
+        for (; j < raw.size() && raw[j] != '`'; j++) {
+            if (raw[j] == '\\' && j + 1 < raw.size() && strchr("$`\\", raw[j + 1])) {
+                j++;
+            }
+            command += raw[j];
+        }
+        if (j >= raw.size()) {
+            throw runtime_error("unexpected end of line while looking for matching ``'");
+        }
+        i = j;
+    } else {
+        size_t close = matching_paren(raw, i + 1);
+        if (close == string::npos) {
+            throw runtime_error("unexpected end of line while looking for matching `)'");
+        }
+        command = raw.substr(i + 2, close - i - 2);
+        i = close;
+    }
+
+    if (!ctx.substitute) {
+        return "";
+    }
+    string output = ctx.substitute(command);
+    size_t end = output.find_last_not_of('\n');
+    output.erase(end == string::npos ? 0 : end + 1);
+    return output;
+}
+
+static bool starts_substitution(const string& raw, size_t i)
+{
+    return raw[i] == '`' || raw.compare(i, 2, "$(") == 0;
+}
+
+void expand_word(const string& raw, const expansion_context& ctx, pmr::vector<expanded_word>& out, bool split)
+{
+    field_builder field(out);
+    size_t i = 0;
+
+    // A leading ~ or ~/ names the home directory
+    if (!raw.empty() && raw[0] == '~' && (raw.size() == 1 || raw[1] == '/')) {
+        const char* home = ctx.variables ? ctx.variables->get("HOME") : nullptr;
+        field.add(home ? home : "~", true);
+        i = 1;
+    }
+
+    for (; i < raw.size(); i++) {
+        char c = raw[i];
+
+        if (c == '\\') {
+            if (i + 1 < raw.size()) {
+                field.add(raw[++i], true);
+            }
+            continue;
+        }
+
+        if (c == '\'') {
+            size_t close = raw.find('\'', i + 1);
+            if (close == string::npos) close = raw.size();
+            field.add(raw.substr(i + 1, close - i - 1), true);
+            field.started = true;
+            i = close;
+            continue;
+        }
+
+        if (c == '"') {
+            field.started = true;
+            for (i++; i < raw.size() && raw[i] != '"'; i++) {
+                char d = raw[i];
+                if (d == '\\' && i + 1 < raw.size() && strchr("$`\"\\", raw[i + 1])) {
+                    field.add(raw[++i], true);
+                } else if (starts_substitution(raw, i)) {
+                    field.add(command_substitution(raw, i, ctx), true);
+                } else if (d == '$' && ctx.positional && raw.compare(i, 2, "$@") == 0) {
+                    // "$@" keeps each positional parameter a separate field
+                    for (size_t j = 1; j < ctx.positional->size(); j++) {
+                        if (j > 1) field.finish();
+                        field.add((*ctx.positional)[j], true);
+                        field.started = true;
+                    }
+                    i++;
+                } else if (d == '$') {
+                    string value;
+                    if (expand_parameter(raw, i, ctx, value)) {
+                        field.add(value, true);
+                    } else {
+                        field.add('$', true);
+                    }
+                } else {
+                    field.add(d, true);
+                }
+            }
+            continue;
+        }
+
+        if (c == '$' || c == '`') {
+            string value;
+            if (starts_substitution(raw, i)) {
+                value = command_substitution(raw, i, ctx);
+            } else if (!expand_parameter(raw, i, ctx, value)) {
+                field.add('$', false);
+                continue;
+            }
+            if (!split) {
+                field.add(value, false);
+                continue;
+            }
+            // Unquoted results are split into fields on blanks
+            for (char v : value) {
+                if (v == ' ' || v == '\t' || v == '\n') {
+                    field.finish();
+                } else {
+                    field.add(v, false);
+                }
+            }
+            continue;
+        }
+
+        field.add(c, false);
+    }
+
+    field.finish();
+}
+
+string expand_heredoc(const string& body, const expansion_context& ctx)
+{
+    string out;
+    for (size_t i = 0; i < body.size(); i++) {
+        char c = body[i];
+        if (c == '\\' && i + 1 < body.size() && strchr("$`\\", body[i + 1])) {
+            out += body[++i];
+        } else if (c == '\\' && i + 1 < body.size() && body[i + 1] == '\n') {
+            i++;
+        } else if (starts_substitution(body, i)) {
+            out += command_substitution(body, i, ctx);
+        } else if (c == '$') {
+            string value;
+            if (expand_parameter(body, i, ctx, value)) {
+                out += value;
+            } else {
+                out += c;
+            }
+        } else {
+            out += c;
+        }
+    }
+    return out;
+}
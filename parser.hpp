@@ -0,0 +1,106 @@
+#ifndef __PARSER_HPP
+#define __PARSER_HPP
+
+#include <memory_resource>
+#include <string>
+#include <vector>
+#include <stdexcept>
+#include <sys/types.h>
+
+#include "variables.hpp"
+
+// Thrown when the text ends inside a construct that continues on later
+// lines (an if/while/until/for or a here-document), so the caller can read
+// continuation lines
+class incomplete_input : public std::runtime_error
+{
+public:
+    explicit incomplete_input(const std::string& what) : std::runtime_error(what) {}
+};
+
+// One element of a command list together with the operator that ends it.
+// Elements are pipelines whose stages may be parenthesised groups.
+struct list_entry {
+    std::string text;
+    std::string op;     // ";", "&", "&&", "||" or "" for the last element
+};
+
+// Split a command line into list elements on ';', '&', '&&', '||' and
+// newlines, dropping '#' comments. Operators inside quotes, after a
+// backslash or inside parentheses are left alone. Throws runtime_error on
+// a syntax error.
+std::vector<list_entry> split_list(const std::string& line);
+
+// Split one list element into pipeline stages on '|'
+std::vector<std::string> split_pipeline(const std::string& text);
+
+// True when text is "( ... )" as a whole; inner receives the contents
+bool is_group(const std::string& text, std::string& inner);
+
+// Trim leading and trailing blanks
+std::string trim_blanks(const std::string& text);
+
+// Cut here-document bodies out of text. Each line holding "<<WORD" or
+// "<<-WORD" operators is followed by their bodies, which are removed from
+// the returned text and appended to bodies in operator order (leading
+// tabs already stripped for "<<-"). Throws incomplete_input when a body
+// is not terminated.
+std::string extract_heredocs(const std::string& text, std::vector<std::string>& bodies);
+
+// Token of a simple command: a raw word (quotes still in place) or a
+// redirection operator
+struct command_token {
+    enum kind_t { WORD, REDIRECT, PROCSUB } kind;
+    std::string text;   // for REDIRECT: optional fd digits, then one of
+                        // < > >> <> >& <& <<< << <<-
+                        // for PROCSUB: '<' or '>' followed by the command
+};
+
+// Split a simple command on unquoted blanks; unquoted redirection
+// operators are tokens even without surrounding blanks, and digits
+// directly before one name the descriptor it applies to. A word that is
+// "<(...)" or ">(...)" is a process substitution. "$(...)" and "`...`"
+// are kept whole inside their word.
+std::vector<command_token> lex_command(const std::string& text);
+
+// True for a "<<" or "<<-" operator (with or without an fd number)
+bool is_heredoc_operator(const command_token& token);
+
+// Parameters visible to expansion besides the shell variables
+struct expansion_context {
+    const variable_table* variables;
+    int last_status;
+    pid_t shell_pid;
+    const std::vector<std::string>* positional;     // $0, $1, ... or nullptr
+    // Runs the command of a $(...) or `...` and returns its output; without
+    // it substitutions expand to nothing
+    std::string (*substitute)(const std::string& command);
+};
+
+// A field produced by expansion. pattern is only set when the field holds
+// unquoted glob characters; quoted characters in it are backslash-escaped.
+struct expanded_word {
+    std::string text;
+    std::string pattern;
+};
+
+// Expand $NAME, ${NAME}, $?, $$, the positional parameters ($0-$9,
+// ${N}, $#, $@, $*), command substitutions ($(...) and `...`) and a
+// leading ~, remove quotes and backslashes, and (when split is set) break
+// unquoted expansion results into separate fields on blanks. out may live
+// in the pipeline's arena (see arena.hpp).
+void expand_word(const std::string& raw, const expansion_context& ctx,
+                 std::pmr::vector<expanded_word>& out, bool split = true);
+
+// Expand the body of a here-document whose delimiter was unquoted:
+// parameters and command substitutions are expanded and the escapes \$,
+// \` and \\ removed; quotes are ordinary characters
+std::string expand_heredoc(const std::string& body, const expansion_context& ctx);
+
+// Remove quotes and backslashes from a word without expanding it
+std::string remove_quotes(const std::string& raw);
+
+// True for an unquoted NAME=... word
+bool is_assignment(const std::string& raw);
+
+#endif
@@ -0,0 +1,262 @@
+#include "placement.hpp"
+#include <algorithm>
+#include <fstream>
+#include <sstream>
+#include <cerrno>
+#include <cstring>
+#include <cstdlib>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/statfs.h>
+#include <sys/syscall.h>
+#include <sys/resource.h>
+
+using namespace std;
+
+const string CGROUP_ROOT = "/sys/fs/cgroup";
+
+// From linux/ioprio.h, linux/mempolicy.h and linux/magic.h, which glibc
+// does not wrap
+const int IOPRIO_WHO_PROCESS = 1;
+const int IOPRIO_CLASS_SHIFT = 13;
+const int MPOL_BIND_MODE = 2;
+const long CGROUP2_MAGIC = 0x63677270;     // CGROUP2_SUPER_MAGIC
+
+bool placement::empty() const
+{
+    return !has_cpus && numa_node < 0 && !has_nice && ioprio_class < 0 && cgroup.empty();
+}
+
+bool parse_cpu_list(const string& list, cpu_set_t& cpus)
+{
+    CPU_ZERO(&cpus);
+    stringstream ss(list);
+    string range;
+    bool any = false;
+    while (getline(ss, range, ',')) {
+        if (range.empty()) continue;
+        char* end;
+        long first = strtol(range.c_str(), &end, 10);
+        long last = first;
+        if (*end == '-') {
+            last = strtol(end + 1, &end, 10);
+        }
+        if (*end != '\0' || first < 0 || last < first || last >= CPU_SETSIZE) {
+            return false;
+        }
+        for (long cpu = first; cpu <= last; cpu++) {
+            CPU_SET(cpu, &cpus);
+        }
+        any = true;
+    }
+    return any;
+}
+
+static bool parse_int(const string& text, int& value)
+{
+    char* end;
+    errno = 0;
+    long parsed = strtol(text.c_str(), &end, 10);
+    if (text.empty() || *end != '\0' || errno != 0) {
+        return false;
+    }
+    value = static_cast<int>(parsed);
+    return true;
+}
+
+bool parse_placement(const vector<string>& arguments, placement& place,
+                     size_t& consumed, string& error)
+{
+    size_t i = 1;
+    for (; i < arguments.size(); i++) {
+        const string& arg = arguments[i];
+        if (arg == "--") {
+            i++;
+            break;
+        }
+        if (arg.empty() || arg[0] != '-') {
+            break;
+        }
+
+        // Options taking a value accept it as the next word
+        bool takes_value = (arg == "-c" || arg == "-N" || arg == "-n" || arg == "-i" || arg == "-g");
+        string value;
+        if (takes_value) {
+            if (i + 1 >= arguments.size()) {
+                error = "option " + arg + " needs a value";
+                return false;
+            }
+            value = arguments[++i];
+        }
+
+        if (arg == "-c") {
+            if (!parse_cpu_list(value, place.cpus)) {
+                error = "invalid CPU list: " + value;
+                return false;
+            }
+            place.has_cpus = true;
+        } else if (arg == "-N") {
+            if (!parse_int(value, place.numa_node) || place.numa_node < 0) {
+                error = "invalid NUMA node: " + value;
+                return false;
+            }
+        } else if (arg == "-n") {
+            if (!parse_int(value, place.nice_increment)) {
+                error = "invalid nice value: " + value;
+                return false;
+            }
+            place.has_nice = true;
+        } else if (arg == "-i") {
+            string cls = value.substr(0, value.find(':'));
+            if (cls == "realtime" || cls == "rt" || cls == "1") {
+                place.ioprio_class = 1;
+            } else if (cls == "best-effort" || cls == "be" || cls == "2") {
+                place.ioprio_class = 2;
+            } else if (cls == "idle" || cls == "3") {
+                place.ioprio_class = 3;
+            } else {
+                error = "invalid I/O class: " + cls;
+                return false;
+            }
+            size_t colon = value.find(':');
+            if (colon != string::npos &&
+                (!parse_int(value.substr(colon + 1), place.ioprio_level) ||
+                 place.ioprio_level < 0 || place.ioprio_level > 7)) {
+                error = "I/O priority level must be 0-7";
+                return false;
+            }
+        } else if (arg == "-g") {
+            place.cgroup = value;
+        } else if (arg.compare(0, 10, "--cpu-max=") == 0) {
+            // QUOTA[/PERIOD] in microseconds, or "max"
+            place.cpu_max = arg.substr(10);
+            replace(place.cpu_max.begin(), place.cpu_max.end(), '/', ' ');
+        } else if (arg.compare(0, 13, "--memory-max=") == 0) {
+            place.memory_max = arg.substr(13);
+        } else {
+            error = "unknown option " + arg;
+            return false;
+        }
+    }
+
+    if ((!place.cpu_max.empty() || !place.memory_max.empty()) && place.cgroup.empty()) {
+        error = "--cpu-max and --memory-max need -g CGROUP";
+        return false;
+    }
+    if (i >= arguments.size()) {
+        error = "missing command";
+        return false;
+    }
+    consumed = i;
+    return true;
+}
+
+static bool write_file(const string& path, const string& value, string& error)
+{
+    ofstream file(path);
+    file << value << flush;
+    if (!file) {
+        error = path + ": " + strerror(errno);
+        return false;
+    }
+    return true;
+}
+
+// CPUs of a NUMA node from sysfs, without depending on libnuma
+static bool node_cpus(int node, cpu_set_t& cpus, string& error)
+{
+    string path = "/sys/devices/system/node/node" + to_string(node) + "/cpulist";
+    ifstream file(path);
+    string list;
+    if (!getline(file, list) || !parse_cpu_list(list, cpus)) {
+        error = "no CPUs for NUMA node " + to_string(node);
+        return false;
+    }
+    return true;
+}
+
+bool apply_placement(const placement& place, string& error)
+{
+    // The cgroup comes first so its limits cover everything after
+    if (!place.cgroup.empty()) {
+        string dir = place.cgroup[0] == '/' ? place.cgroup : CGROUP_ROOT + "/" + place.cgroup;
+        string parent = dir.substr(0, dir.find_last_of('/'));
+        struct statfs fs;
+        if (statfs(parent.empty() ? "/" : parent.c_str(), &fs) == -1 || fs.f_type != CGROUP2_MAGIC) {
+            error = parent + " is not on a cgroup v2 hierarchy";
+            return false;
+        }
+        if (mkdir(dir.c_str(), 0755) == -1 && errno != EEXIST) {
+            error = dir + ": " + strerror(errno);
+            return false;
+        }
+        if (!place.cpu_max.empty() && !write_file(dir + "/cpu.max", place.cpu_max, error)) {
+            return false;
+        }
+        if (!place.memory_max.empty() && !write_file(dir + "/memory.max", place.memory_max, error)) {
+            return false;
+        }
+        if (!write_file(dir + "/cgroup.procs", "0", error)) {
+            return false;
+        }
+    }
+
+    cpu_set_t cpus;
+    CPU_ZERO(&cpus);
+    bool set_cpus = place.has_cpus;
+    if (place.has_cpus) {
+        cpus = place.cpus;
+    }
+    if (place.numa_node >= 0) {
+        cpu_set_t node_set;
+        if (!node_cpus(place.numa_node, node_set, error)) {
+            return false;
+        }
+        if (set_cpus) {
+            CPU_AND(&cpus, &cpus, &node_set);
+        } else {
+            cpus = node_set;
+            set_cpus = true;
+        }
+
+        // Memory policy survives exec, so allocations stay on the node
+        unsigned long nodemask[16] = {0};
+        if (place.numa_node >= static_cast<int>(sizeof(nodemask) * 8)) {
+            error = "NUMA node out of range";
+            return false;
+        }
+        nodemask[place.numa_node / (sizeof(unsigned long) * 8)] |= 1UL << (place.numa_node % (sizeof(unsigned long) * 8));
+        if (syscall(SYS_set_mempolicy, MPOL_BIND_MODE, nodemask, sizeof(nodemask) * 8) == -1) {
+            error = string("set_mempolicy: ") + strerror(errno);
+            return false;
+        }
+    }
+    if (set_cpus) {
+        if (CPU_COUNT(&cpus) == 0) {
+            error = "no CPUs left to run on";
+            return false;
+        }
+        if (sched_setaffinity(0, sizeof(cpus), &cpus) == -1) {
+            error = string("sched_setaffinity: ") + strerror(errno);
+            return false;
+        }
+    }
+
+    if (place.has_nice) {
+        errno = 0;
+        if (nice(place.nice_increment) == -1 && errno != 0) {
+            error = string("nice: ") + strerror(errno);
+            return false;
+        }
+    }
+
+    if (place.ioprio_class >= 0) {
+        int level = (place.ioprio_class == 3) ? 0 : place.ioprio_level;
+        int ioprio = (place.ioprio_class << IOPRIO_CLASS_SHIFT) | level;
+        if (syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, 0, ioprio) == -1) {
+            error = string("ioprio_set: ") + strerror(errno);
+            return false;
+        }
+    }
+    return true;
+}
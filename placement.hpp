@@ -0,0 +1,42 @@
+#ifndef __PLACEMENT_HPP
+#define __PLACEMENT_HPP
+
+#include <sched.h>
+#include <string>
+#include <vector>
+
+// Where and how a command runs: CPU affinity, NUMA node, nice value, I/O
+// priority and cgroup v2 placement. Set with the "sched" command prefix
+//
+//   sched [-c CPUS] [-N NODE] [-n NICE] [-i CLASS[:LEVEL]]
+//         [-g CGROUP [--cpu-max=QUOTA[/PERIOD]] [--memory-max=BYTES]] cmd...
+//
+// and applied by the child between fork and exec, so the shell itself is
+// never moved or reprioritised.
+struct placement {
+    bool has_cpus = false;
+    cpu_set_t cpus;
+    int numa_node = -1;             // binds CPUs and memory to the node
+    bool has_nice = false;
+    int nice_increment = 0;
+    int ioprio_class = -1;          // 1 realtime, 2 best-effort, 3 idle
+    int ioprio_level = 4;
+    std::string cgroup;             // relative to /sys/fs/cgroup unless absolute
+    std::string cpu_max;            // written to cpu.max, e.g. "50000 100000"
+    std::string memory_max;         // written to memory.max
+
+    bool empty() const;
+};
+
+// Parse "0-3,8,10-11" into a CPU set
+bool parse_cpu_list(const std::string& list, cpu_set_t& cpus);
+
+// Parse the options after "sched" in arguments[0]. On success consumed is
+// the number of words (including "sched") that belong to the prefix.
+bool parse_placement(const std::vector<std::string>& arguments, placement& place,
+                     size_t& consumed, std::string& error);
+
+// Apply to the calling process; meant for a freshly forked child
+bool apply_placement(const placement& place, std::string& error);
+
+#endif
@@ -0,0 +1,559 @@
+#include "procfs.hpp"
+#include <algorithm>
+#include <atomic>
+#include <cstdlib>
+#include <cstring>
+#include <thread>
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#if __has_include(<linux/io_uring.h>) && !defined(NO_IO_URING)
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#define HAVE_IO_URING 1
+#endif
+
+using namespace std;
+
+const size_t SAMPLE_MAX_THREADS = 8;
+const size_t SAMPLE_BATCH = 64;         // pids a worker claims at a time
+const unsigned URING_BATCH = 1024;      // files per submission
+const size_t URING_READ_SIZE = 4096;    // a status file is about 1.5K
+const size_t URING_MIN_FILES = 512;     // fewer do not pay for the ring setup
+
+bool read_proc_file(const string& path, string& contents)
+{
+    int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd == -1) {
+        return false;
+    }
+    char buffer[4096];
+    contents.clear();
+    ssize_t n;
+    while ((n = read(fd, buffer, sizeof(buffer))) > 0) {
+        contents.append(buffer, n);
+    }
+    close(fd);
+    return n == 0;
+}
+
+#ifdef HAVE_IO_URING
+// Just enough of io_uring for chained openat+read+close of small files,
+// through the raw system calls rather than a liburing dependency. Every
+// file of a batch gets a slot in a table of direct descriptors, so the
+// read and the close can name the file the openat has yet to open.
+// Direct descriptors came with Linux 5.15; earlier kernels ignore
+// file_index, and the close would act on descriptor 0 of this process.
+class proc_uring
+{
+public:
+    proc_uring();
+    ~proc_uring();
+
+    bool ready() const { return ring_fd != -1; }
+
+    // Read paths[begin, end), at most URING_BATCH files. Files too big
+    // for one read are left for the caller, with read_ok false.
+    bool read_batch(const vector<string>& paths, size_t begin, size_t end,
+                    vector<string>& contents, vector<bool>& read_ok);
+
+private:
+    bool supports_direct_descriptors();
+    bool drain(unsigned in_flight);
+    void teardown();
+
+    int ring_fd = -1;
+    void* sq_ring = MAP_FAILED;
+    void* cq_ring = MAP_FAILED;
+    size_t sq_ring_size = 0, cq_ring_size = 0;
+    io_uring_sqe* sqes = static_cast<io_uring_sqe*>(MAP_FAILED);
+    size_t sqes_size = 0;
+    unsigned *sq_tail = nullptr, *sq_mask = nullptr, *sq_array = nullptr;
+    unsigned *cq_head = nullptr, *cq_tail = nullptr, *cq_mask = nullptr;
+    io_uring_cqe* cqes = nullptr;
+    char* buffers = nullptr;    // URING_BATCH reads of URING_READ_SIZE
+};
+
+proc_uring::proc_uring()
+{
+    io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    params.flags = IORING_SETUP_CLAMP;
+    ring_fd = static_cast<int>(syscall(__NR_io_uring_setup, URING_BATCH * 3, &params));
+    if (ring_fd == -1) {
+        return;
+    }
+    if (params.sq_entries < URING_BATCH * 3 || params.cq_entries < URING_BATCH * 3) {
+        teardown();
+        return;
+    }
+
+    sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+    bool single_mmap = params.features & IORING_FEAT_SINGLE_MMAP;
+    if (single_mmap) {
+        sq_ring_size = cq_ring_size = max(sq_ring_size, cq_ring_size);
+    }
+    sq_ring = mmap(nullptr, sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                   ring_fd, IORING_OFF_SQ_RING);
+    if (sq_ring == MAP_FAILED) {
+        teardown();
+        return;
+    }
+    if (!single_mmap) {
+        cq_ring = mmap(nullptr, cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                       ring_fd, IORING_OFF_CQ_RING);
+        if (cq_ring == MAP_FAILED) {
+            teardown();
+            return;
+        }
+    }
+    char* sq = static_cast<char*>(sq_ring);
+    char* cq = static_cast<char*>(single_mmap ? sq_ring : cq_ring);
+    sqes_size = params.sq_entries * sizeof(io_uring_sqe);
+    sqes = static_cast<io_uring_sqe*>(mmap(nullptr, sqes_size, PROT_READ | PROT_WRITE,
+                                           MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQES));
+    if (sqes == MAP_FAILED) {
+        teardown();
+        return;
+    }
+    sq_tail = reinterpret_cast<unsigned*>(sq + params.sq_off.tail);
+    sq_mask = reinterpret_cast<unsigned*>(sq + params.sq_off.ring_mask);
+    sq_array = reinterpret_cast<unsigned*>(sq + params.sq_off.array);
+    cq_head = reinterpret_cast<unsigned*>(cq + params.cq_off.head);
+    cq_tail = reinterpret_cast<unsigned*>(cq + params.cq_off.tail);
+    cq_mask = reinterpret_cast<unsigned*>(cq + params.cq_off.ring_mask);
+    cqes = reinterpret_cast<io_uring_cqe*>(cq + params.cq_off.cqes);
+
+    if (!supports_direct_descriptors()) {
+        teardown();
+        return;
+    }
+
+    // An empty table of direct descriptors, one slot per file of a batch
+    vector<int> slots(URING_BATCH, -1);
+    if (syscall(__NR_io_uring_register, ring_fd, IORING_REGISTER_FILES, slots.data(), URING_BATCH) == -1) {
+        teardown();
+        return;
+    }
+    buffers = new char[URING_BATCH * URING_READ_SIZE];
+}
+
+// There is no probe for direct descriptors themselves; linkat arrived in
+// the same release, 5.15, and the kernel lists the opcodes it knows
+bool proc_uring::supports_direct_descriptors()
+{
+    const unsigned ops = IORING_OP_LINKAT + 1;
+    vector<char> probe_buffer(sizeof(io_uring_probe) + ops * sizeof(io_uring_probe_op), 0);
+    io_uring_probe* probe = reinterpret_cast<io_uring_probe*>(probe_buffer.data());
+    if (syscall(__NR_io_uring_register, ring_fd, IORING_REGISTER_PROBE, probe, ops) == -1) {
+        return false;
+    }
+    return probe->ops_len > IORING_OP_LINKAT &&
+           (probe->ops[IORING_OP_LINKAT].flags & IO_URING_OP_SUPPORTED);
+}
+
+proc_uring::~proc_uring()
+{
+    teardown();
+}
+
+void proc_uring::teardown()
+{
+    if (sqes != MAP_FAILED) {
+        munmap(sqes, sqes_size);
+        sqes = static_cast<io_uring_sqe*>(MAP_FAILED);
+    }
+    if (cq_ring != MAP_FAILED) {
+        munmap(cq_ring, cq_ring_size);
+        cq_ring = MAP_FAILED;
+    }
+    if (sq_ring != MAP_FAILED) {
+        munmap(sq_ring, sq_ring_size);
+        sq_ring = MAP_FAILED;
+    }
+    if (ring_fd != -1) {
+        close(ring_fd);
+        ring_fd = -1;
+    }
+    delete[] buffers;
+    buffers = nullptr;
+}
+
+// Wait for the completions of requests already submitted, so their
+// buffers outlive them. False when the ring will not say.
+bool proc_uring::drain(unsigned in_flight)
+{
+    while (in_flight > 0) {
+        if (syscall(__NR_io_uring_enter, ring_fd, 0, in_flight, IORING_ENTER_GETEVENTS, nullptr, 0) == -1 &&
+            errno != EINTR && errno != EAGAIN && errno != EBUSY) {
+            return false;
+        }
+        unsigned head = *cq_head;
+        unsigned ready_tail = __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE);
+        in_flight -= min(in_flight, ready_tail - head);
+        __atomic_store_n(cq_head, ready_tail, __ATOMIC_RELEASE);
+    }
+    return true;
+}
+
+bool proc_uring::read_batch(const vector<string>& paths, size_t begin, size_t end,
+                            vector<string>& contents, vector<bool>& read_ok)
+{
+    // Only this thread writes the tail, so a plain read of it is current
+    unsigned tail = *sq_tail;
+    auto next_sqe = [&](uint8_t opcode, uint64_t user_data) {
+        unsigned index = tail & *sq_mask;
+        io_uring_sqe* sqe = &sqes[index];
+        memset(sqe, 0, sizeof(*sqe));
+        sqe->opcode = opcode;
+        sqe->user_data = user_data;
+        sq_array[index] = index;
+        tail++;
+        return sqe;
+    };
+
+    // openat -> read -> close per file. A failed openat cancels the rest
+    // of its chain; the read is hard-linked, since a read shorter than the
+    // buffer (every one of them) would count as a failure and cancel the
+    // close otherwise.
+    unsigned files = end - begin;
+    for (unsigned slot = 0; slot < files; slot++) {
+        io_uring_sqe* sqe = next_sqe(IORING_OP_OPENAT, slot * 3);
+        sqe->fd = AT_FDCWD;
+        sqe->addr = reinterpret_cast<uint64_t>(paths[begin + slot].c_str());
+        sqe->open_flags = O_RDONLY;
+        sqe->file_index = slot + 1;
+        sqe->flags = IOSQE_IO_LINK;
+
+        sqe = next_sqe(IORING_OP_READ, slot * 3 + 1);
+        sqe->fd = slot;
+        sqe->addr = reinterpret_cast<uint64_t>(&buffers[slot * URING_READ_SIZE]);
+        sqe->len = URING_READ_SIZE;
+        sqe->flags = IOSQE_FIXED_FILE | IOSQE_IO_HARDLINK;
+
+        sqe = next_sqe(IORING_OP_CLOSE, slot * 3 + 2);
+        sqe->file_index = slot + 1;
+    }
+    __atomic_store_n(sq_tail, tail, __ATOMIC_RELEASE);
+
+    unsigned to_submit = files * 3;
+    unsigned pending = files * 3;
+    while (pending > 0) {
+        int submitted = static_cast<int>(syscall(__NR_io_uring_enter, ring_fd, to_submit, 1,
+                                                 IORING_ENTER_GETEVENTS, nullptr, 0));
+        if (submitted == -1) {
+            if (errno == EINTR || errno == EAGAIN || errno == EBUSY) {
+                continue;
+            }
+            // The kernel may still write into the buffers of what it took
+            if (!drain(pending - to_submit)) {
+                buffers = nullptr;      // left to it rather than reused
+            }
+            return false;
+        }
+        to_submit -= submitted;
+
+        unsigned head = *cq_head;
+        unsigned ready_tail = __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE);
+        for (; head != ready_tail; head++, pending--) {
+            const io_uring_cqe& cqe = cqes[head & *cq_mask];
+            unsigned slot = cqe.user_data / 3;
+            if (cqe.user_data % 3 == 1 && cqe.res >= 0 && static_cast<size_t>(cqe.res) < URING_READ_SIZE) {
+                contents[begin + slot].assign(&buffers[slot * URING_READ_SIZE], cqe.res);
+                read_ok[begin + slot] = true;
+            }
+        }
+        __atomic_store_n(cq_head, head, __ATOMIC_RELEASE);
+    }
+    return true;
+}
+#endif
+
+void read_proc_files(const vector<string>& paths, vector<string>& contents, vector<bool>& read_ok)
+{
+    contents.assign(paths.size(), string());
+    read_ok.assign(paths.size(), false);
+#ifdef HAVE_IO_URING
+    // procfs opens and reads cannot complete without blocking, so the
+    // kernel hands every chain to its io-wq workers. With more than one
+    // CPU those run in parallel; on a single one they only add context
+    // switches to the plain loop below.
+    if (paths.size() >= URING_MIN_FILES && thread::hardware_concurrency() > 1) {
+        proc_uring ring;
+        for (size_t begin = 0; ring.ready() && begin < paths.size(); begin += URING_BATCH) {
+            if (!ring.read_batch(paths, begin, min(paths.size(), begin + URING_BATCH), contents, read_ok)) {
+                break;
+            }
+        }
+    }
+#endif
+    // Whatever the ring did not cover, files too big for its buffers, and
+    // failures, which are cheap to confirm
+    for (size_t i = 0; i < paths.size(); i++) {
+        if (!read_ok[i]) {
+            read_ok[i] = read_proc_file(paths[i], contents[i]);
+        }
+    }
+}
+
+void list_children(pid_t pid, vector<pid_t>& children)
+{
+    string task_dir = "/proc/" + to_string(pid) + "/task";
+    DIR* dirp = opendir(task_dir.c_str());
+    if (!dirp) {
+        return;
+    }
+    string contents;
+    struct dirent* entry;
+    while ((entry = readdir(dirp)) != NULL) {
+        if (entry->d_name[0] == '.') {
+            continue;
+        }
+        if (!read_proc_file(task_dir + "/" + entry->d_name + "/children", contents)) {
+            continue;
+        }
+        const char* p = contents.c_str();
+        char* end;
+        for (long child = strtol(p, &end, 10); end != p; child = strtol(p, &end, 10)) {
+            children.push_back(static_cast<pid_t>(child));
+            p = end;
+        }
+    }
+    closedir(dirp);
+}
+
+static unsigned long namespace_id(const string& proc_dir, const char* kind)
+{
+    struct stat st;
+    return stat((proc_dir + "/ns/" + kind).c_str(), &st) == 0 ? st.st_ino : 0;
+}
+
+// The unified hierarchy's "0::" line when there is one, else the v1
+// systemd hierarchy, which is where container managers put their scopes
+static bool read_cgroup(const string& proc_dir, string& cgroup)
+{
+    string contents;
+    if (!read_proc_file(proc_dir + "/cgroup", contents)) {
+        return false;
+    }
+    string fallback;
+    size_t start = 0;
+    while (start < contents.size()) {
+        size_t end = contents.find('\n', start);
+        if (end == string::npos) end = contents.size();
+        string line = contents.substr(start, end - start);
+        start = end + 1;
+
+        size_t first = line.find(':');
+        size_t second = first == string::npos ? string::npos : line.find(':', first + 1);
+        if (second == string::npos) {
+            continue;
+        }
+        string controllers = line.substr(first + 1, second - first - 1);
+        if (line.compare(0, first, "0") == 0 && controllers.empty()) {
+            cgroup = line.substr(second + 1);
+            return true;
+        }
+        if (controllers == "name=systemd" || fallback.empty()) {
+            fallback = line.substr(second + 1);
+        }
+    }
+    cgroup = fallback;
+    return !cgroup.empty();
+}
+
+bool read_process_context(pid_t pid, process_context& context, bool with_ns_pid)
+{
+    string proc_dir = "/proc/" + to_string(pid);
+    context.pid_ns = namespace_id(proc_dir, "pid");
+    context.mnt_ns = namespace_id(proc_dir, "mnt");
+
+    // The last NSpid entry is the pid in the innermost namespace
+    string status;
+    if (with_ns_pid && read_proc_file(proc_dir + "/status", status)) {
+        size_t pos = status.find("\nNSpid:");
+        if (pos != string::npos) {
+            size_t end = status.find('\n', pos + 1);
+            size_t last = status.find_last_of(" \t", end - 1);
+            context.ns_pid = static_cast<pid_t>(atol(status.c_str() + last + 1));
+        }
+    }
+    return read_cgroup(proc_dir, context.cgroup);
+}
+
+unsigned long pid_namespace(pid_t pid)
+{
+    return namespace_id("/proc/" + to_string(pid), "pid");
+}
+
+unsigned long own_pid_namespace()
+{
+    static unsigned long own = namespace_id("/proc/self", "pid");
+    return own;
+}
+
+bool process_filter::resolve(string& error)
+{
+    pid_ns = 0;
+    if (container.empty() || container.find_first_not_of("0123456789") != string::npos) {
+        return true;
+    }
+    pid_ns = namespace_id("/proc/" + container, "pid");
+    if (pid_ns == 0) {
+        error = "cannot read the pid namespace of process " + container + ": " + strerror(errno);
+        return false;
+    }
+    return true;
+}
+
+// True when path lies at or below prefix
+static bool cgroup_under(const string& path, const string& prefix)
+{
+    if (path.compare(0, prefix.size(), prefix) != 0) {
+        return false;
+    }
+    return path.size() == prefix.size() || prefix.back() == '/' || path[prefix.size()] == '/';
+}
+
+bool process_filter::matches(pid_t pid) const
+{
+    if (empty()) {
+        return true;
+    }
+    string proc_dir = "/proc/" + to_string(pid);
+    if (pid_ns && namespace_id(proc_dir, "pid") != pid_ns) {
+        return false;
+    }
+    bool by_id = !pid_ns && !container.empty();
+    if (by_id || !cgroup.empty()) {
+        string path;
+        if (!read_cgroup(proc_dir, path)) {
+            return false;
+        }
+        if (by_id && path.find(container) == string::npos) {
+            return false;
+        }
+        if (!cgroup.empty() && !cgroup_under(path, cgroup)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+bool parse_filter_option(const string& arg, process_filter& filter)
+{
+    if (arg.compare(0, 12, "--container=") == 0) {
+        filter.container = arg.substr(12);
+        return true;
+    }
+    if (arg.compare(0, 9, "--cgroup=") == 0) {
+        filter.cgroup = arg.substr(9);
+        return true;
+    }
+    return false;
+}
+
+// Fill sample from /proc/<pid>/stat; the name in parentheses may itself
+// contain ") ", so the fields are counted from the last one
+static bool parse_stat(const string& stat, process_sample& sample)
+{
+    size_t open_paren = stat.find('(');
+    size_t close_paren = stat.rfind(')');
+    if (open_paren == string::npos || close_paren == string::npos || close_paren + 2 >= stat.size()) {
+        return false;
+    }
+    sample.name = stat.substr(open_paren + 1, close_paren - open_paren - 1);
+    sample.state = stat[close_paren + 2];
+
+    // Field 3 is the state; count on from field 4
+    const char* p = stat.c_str() + close_paren + 3;
+    char* end;
+    unsigned long long utime = 0;
+    for (int field = 4; field <= 20; field++) {
+        unsigned long long value = strtoull(p, &end, 10);
+        if (end == p) {
+            return false;
+        }
+        p = end;
+        switch (field) {
+        case 4:  sample.ppid = static_cast<pid_t>(value); break;
+        case 14: utime = value; break;
+        case 15: sample.cpu_ticks = utime + value; break;
+        case 20: sample.threads = static_cast<long>(value); break;
+        }
+    }
+    return true;
+}
+
+static long count_fds(pid_t pid)
+{
+    DIR* dirp = opendir(("/proc/" + to_string(pid) + "/fd").c_str());
+    if (!dirp) {
+        return -1;
+    }
+    long count = 0;
+    struct dirent* entry;
+    while ((entry = readdir(dirp)) != NULL) {
+        if (entry->d_name[0] != '.') {
+            count++;
+        }
+    }
+    closedir(dirp);
+    return count;
+}
+
+static void sample_process(pid_t pid, bool with_children, process_sample& sample)
+{
+    sample.pid = pid;
+    string contents;
+    string dir = "/proc/" + to_string(pid);
+    if (!read_proc_file(dir + "/stat", contents) || !parse_stat(contents, sample)) {
+        return;
+    }
+    if (read_proc_file(dir + "/statm", contents)) {
+        // size resident shared ...
+        const char* p = contents.c_str();
+        char* end;
+        strtol(p, &end, 10);
+        sample.rss_pages = strtol(end, nullptr, 10);
+    }
+    sample.fds = count_fds(pid);
+    if (with_children) {
+        list_children(pid, sample.children);
+    }
+    sample.alive = true;
+}
+
+vector<process_sample> sample_processes(const vector<pid_t>& pids, bool with_children)
+{
+    vector<process_sample> samples(pids.size());
+    atomic<size_t> next(0);
+    auto work = [&]() {
+        while (true) {
+            size_t begin = next.fetch_add(SAMPLE_BATCH);
+            if (begin >= pids.size()) {
+                return;
+            }
+            size_t end = min(pids.size(), begin + SAMPLE_BATCH);
+            for (size_t i = begin; i < end; i++) {
+                sample_process(pids[i], with_children, samples[i]);
+            }
+        }
+    };
+
+    size_t cores = max(1u, thread::hardware_concurrency());
+    size_t workers = min({ cores, SAMPLE_MAX_THREADS, pids.size() / SAMPLE_BATCH + 1 });
+    vector<thread> pool;
+    for (size_t w = 1; w < workers; w++) {
+        pool.emplace_back(work);
+    }
+    work();
+    for (auto& t : pool) {
+        t.join();
+    }
+    return samples;
+}
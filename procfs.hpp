@@ -0,0 +1,91 @@
+#ifndef __PROCFS_HPP
+#define __PROCFS_HPP
+
+#include <string>
+#include <vector>
+#include <sys/types.h>
+
+// Small readers for /proc shared by sb's modes
+
+// Read a small /proc file in one go
+bool read_proc_file(const std::string& path, std::string& contents);
+
+// Read many small /proc files at once: contents[i] is the file at
+// paths[i], and read_ok[i] false when it could not be read (the process
+// is gone). With io_uring, each file is an openat, read and close chained
+// in the kernel, and a batch of files costs one system call. Without it
+// (an old kernel, io_uring disabled by sysctl or seccomp, or a build with
+// NO_IO_URING) or on a single CPU, the files are read one by one.
+void read_proc_files(const std::vector<std::string>& paths, std::vector<std::string>& contents,
+                     std::vector<bool>& read_ok);
+
+// Append the children of every thread of pid, from the kernel's own list
+// (/proc/<pid>/task/<tid>/children) instead of a scan of all of /proc
+void list_children(pid_t pid, std::vector<pid_t>& children);
+
+// One reading of a process from /proc/<pid>/stat, statm and fd
+struct process_sample {
+    pid_t pid = 0;
+    bool alive = false;         // false when the process was gone
+    pid_t ppid = 0;
+    char state = 0;
+    std::string name;
+    unsigned long long cpu_ticks = 0;       // utime + stime, in clock ticks
+    long rss_pages = 0;
+    long threads = 0;
+    long fds = -1;              // -1 when /proc/<pid>/fd is not readable
+    std::vector<pid_t> children;            // only when asked for
+};
+
+// Where a process lives: the namespaces it sees and its cgroup. The
+// namespace ids are the inode numbers /proc/<pid>/ns/* link to, the ones
+// "lsns" prints; 0 when they cannot be read.
+struct process_context {
+    unsigned long pid_ns = 0;
+    unsigned long mnt_ns = 0;
+    pid_t ns_pid = 0;           // the pid inside its own pid namespace
+    std::string cgroup;         // the cgroup v2 path, or v1's systemd one
+};
+
+// Fill context; ns_pid costs a read of /proc/<pid>/status, which callers
+// that parse it anyway can skip
+bool read_process_context(pid_t pid, process_context& context, bool with_ns_pid = true);
+
+// The pid namespace of pid alone, a single stat; 0 when unreadable
+unsigned long pid_namespace(pid_t pid);
+
+// The pid namespace of this process, to tell container processes apart
+unsigned long own_pid_namespace();
+
+// Restricts a /proc scan to one container or cgroup. Checked for each pid
+// before anything else is read about it, so scanning one container costs
+// a stat or a small read per host process instead of a full scan.
+struct process_filter {
+    // A container: either a pid (on the host) of any process in it, which
+    // selects its pid namespace, or a container id, which selects the
+    // processes whose cgroup path contains it (docker-<id>.scope, ...)
+    std::string container;
+    std::string cgroup;         // the processes at or below this cgroup
+
+    bool empty() const { return container.empty() && cgroup.empty(); }
+
+    // Look up what container names; false with error set when it is a pid
+    // that cannot be inspected
+    bool resolve(std::string& error);
+
+    bool matches(pid_t pid) const;
+
+private:
+    unsigned long pid_ns = 0;
+};
+
+// Parse a --container=ID or --cgroup=PATH argument into filter; false
+// when arg is neither
+bool parse_filter_option(const std::string& arg, process_filter& filter);
+
+// Read one sample per pid, in the order of pids. The reads are spread
+// over a pool of threads: /proc is served by the kernel one file at a
+// time, and for a large tree the system call round trips dominate.
+std::vector<process_sample> sample_processes(const std::vector<pid_t>& pids, bool with_children);
+
+#endif
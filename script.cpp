@@ -0,0 +1,452 @@
+#include "script.hpp"
+#include <list>
+#include <set>
+#include <unordered_map>
+#include <cstdint>
+
+using namespace std;
+
+// Compiled programs kept for reuse
+const size_t PROGRAM_CACHE_SIZE = 256;
+
+// List elements broken down into reserved words, commands and operators
+struct list_token {
+    enum kind_t { KEYWORD, COMMAND, REDIRECTS, OP } kind;
+    string text;        // keyword, command text, redirections after fi/done or
+                        // operator; a "for" keyword carries its header
+};
+
+static const set<string> opening_keywords = { "if", "then", "elif", "else", "while", "until", "do" };
+static const set<string> closing_keywords = { "fi", "done" };
+
+static vector<list_token> tokenize_list(const string& text)
+{
+    vector<list_token> tokens;
+    for (const list_entry& entry : split_list(text)) {
+        string rest = entry.text;
+
+        // Reserved words are only recognised as the first word of a command
+        while (!rest.empty()) {
+            size_t blank = rest.find_first_of(" \t");
+            string word = rest.substr(0, blank);
+            string after = (blank == string::npos) ? "" : trim_blanks(rest.substr(blank));
+
+            if (opening_keywords.count(word)) {
+                tokens.push_back({ list_token::KEYWORD, word });
+                rest = after;
+            } else if (closing_keywords.count(word)) {
+                // Only redirections may follow, and they apply to the
+                // whole compound command
+                tokens.push_back({ list_token::KEYWORD, word });
+                if (!after.empty()) {
+                    vector<command_token> words = lex_command(after);
+                    for (size_t i = 0; i < words.size(); i += 2) {
+                        if (words[i].kind != command_token::REDIRECT) {
+                            throw runtime_error("syntax error near unexpected token `" + words[i].text + "'");
+                        }
+                    }
+                    tokens.push_back({ list_token::REDIRECTS, after });
+                }
+                rest.clear();
+            } else if (word == "for") {
+                tokens.push_back({ list_token::KEYWORD, "for " + after });
+                rest.clear();
+            } else {
+                break;
+            }
+        }
+
+        if (!rest.empty()) {
+            tokens.push_back({ list_token::COMMAND, rest });
+        }
+        tokens.push_back({ list_token::OP, entry.op });
+    }
+    return tokens;
+}
+
+class compiler
+{
+public:
+    compiler(const string& text) : pos(0), next_heredoc(0), redirect_depth(0)
+    {
+        tokens = tokenize_list(extract_heredocs(text, heredocs));
+    }
+
+    program run()
+    {
+        compile_list({});
+        return prog;
+    }
+
+private:
+    // Jump sites of break and continue inside one loop
+    struct loop_context {
+        size_t continue_target;
+        vector<size_t> breaks;
+        size_t redirect_depth;  // redirected compound commands around the loop
+    };
+
+    vector<list_token> tokens;
+    size_t pos;
+    vector<string> heredocs;    // here-document bodies in operator order
+    size_t next_heredoc;
+    program prog;
+    vector<loop_context> loops;
+    size_t redirect_depth;      // redirected compound commands being compiled
+
+    size_t emit(opcode op, size_t arg = 0)
+    {
+        prog.code.push_back({ op, arg });
+        return prog.code.size() - 1;
+    }
+
+    size_t here() const
+    {
+        return prog.code.size();
+    }
+
+    bool at_keyword(const string& word) const
+    {
+        return pos < tokens.size() && tokens[pos].kind == list_token::KEYWORD &&
+               tokens[pos].text.compare(0, word.size(), word) == 0 &&
+               (tokens[pos].text.size() == word.size() || tokens[pos].text[word.size()] == ' ');
+    }
+
+    void expect_keyword(const string& word)
+    {
+        if (pos >= tokens.size()) {
+            throw incomplete_input("syntax error: unexpected end of input, expected `" + word + "'");
+        }
+        if (!at_keyword(word)) {
+            throw runtime_error("syntax error: expected `" + word + "' near `" + tokens[pos].text + "'");
+        }
+        pos++;
+    }
+
+    // Skip empty commands such as the one between "do" and ';'
+    void skip_separators()
+    {
+        while (pos < tokens.size() && tokens[pos].kind == list_token::OP &&
+               (tokens[pos].text == ";" || tokens[pos].text.empty())) {
+            pos++;
+        }
+    }
+
+    // Compile and-or lists until one of the terminators (or the end of
+    // input, when there are none) is reached
+    void compile_list(const set<string>& terminators)
+    {
+        while (true) {
+            skip_separators();
+            if (pos >= tokens.size()) {
+                if (!terminators.empty()) {
+                    throw incomplete_input("syntax error: unexpected end of input, expected `" +
+                                           *terminators.rbegin() + "'");
+                }
+                return;
+            }
+
+            const list_token& token = tokens[pos];
+            if (token.kind == list_token::KEYWORD) {
+                string word = token.text.substr(0, token.text.find(' '));
+                if (terminators.count(word)) {
+                    return;
+                }
+                if (word != "if" && word != "while" && word != "until" && word != "for") {
+                    throw runtime_error("syntax error near unexpected token `" + word + "'");
+                }
+            } else if (token.kind == list_token::OP) {
+                throw runtime_error("syntax error near unexpected token `" + token.text + "'");
+            }
+            compile_and_or();
+        }
+    }
+
+    // Does the and-or list starting at pos end with '&'?
+    bool ends_in_background() const
+    {
+        int depth = 0;
+        for (size_t i = pos; i < tokens.size(); i++) {
+            const list_token& token = tokens[i];
+            if (token.kind == list_token::KEYWORD) {
+                string word = token.text.substr(0, token.text.find(' '));
+                if (word == "if" || word == "while" || word == "until" || word == "for") {
+                    depth++;
+                } else if (word == "fi" || word == "done") {
+                    if (depth == 0) return false;
+                    depth--;
+                } else if (depth == 0) {
+                    return false;
+                }
+            } else if (token.kind == list_token::OP && depth == 0) {
+                if (token.text == "&") return true;
+                if (token.text != "&&" && token.text != "||") return false;
+            }
+        }
+        return false;
+    }
+
+    void compile_and_or()
+    {
+        bool background = ends_in_background();
+        size_t fork_site = 0;
+        vector<loop_context> outer_loops;
+        if (background) {
+            // The job is a separate process: break and continue cannot
+            // reach loops of the shell that started it
+            fork_site = emit(OP_FORK);
+            outer_loops.swap(loops);
+        }
+
+        compile_unit();
+        while (pos < tokens.size() && tokens[pos].kind == list_token::OP &&
+               (tokens[pos].text == "&&" || tokens[pos].text == "||")) {
+            // Skip the next unit depending on the status so far
+            size_t jump = emit(tokens[pos].text == "&&" ? OP_JUMP_IF_FAIL : OP_JUMP_IF_OK);
+            pos++;
+            if (pos >= tokens.size()) {
+                throw incomplete_input("syntax error: unexpected end of input after `&&' or `||'");
+            }
+            compile_unit();
+            prog.code[jump].arg = here();
+        }
+
+        if (pos < tokens.size() && tokens[pos].kind == list_token::OP) {
+            pos++;
+        }
+
+        if (background) {
+            loops.swap(outer_loops);
+            if (here() == fork_site + 2 && prog.code[fork_site + 1].op == OP_RUN) {
+                // A lone pipeline becomes a job directly
+                size_t pipeline = prog.code[fork_site + 1].arg;
+                prog.code.resize(fork_site);
+                emit(OP_RUN_BACKGROUND, pipeline);
+            } else {
+                emit(OP_EXIT);
+                prog.code[fork_site].arg = here();
+            }
+        }
+    }
+
+    void compile_unit()
+    {
+        const list_token& token = tokens[pos];
+        if (token.kind == list_token::COMMAND) {
+            if (token.text == "break" || token.text == "continue") {
+                if (loops.empty()) {
+                    throw runtime_error(token.text + ": only meaningful in a loop");
+                }
+                // Leaving "fi > file" and the like early must still
+                // restore the shell's descriptors
+                if (redirect_depth > loops.back().redirect_depth) {
+                    emit(OP_UNWIND, redirect_depth - loops.back().redirect_depth);
+                }
+                if (token.text == "break") {
+                    loops.back().breaks.push_back(emit(OP_JUMP));
+                } else {
+                    emit(OP_JUMP, loops.back().continue_target);
+                }
+            } else {
+                prog.pipelines.push_back(compile_pipeline(token.text));
+                emit(OP_RUN, prog.pipelines.size() - 1);
+            }
+            pos++;
+            return;
+        }
+
+        // Redirections after fi/done wrap the whole compound command
+        size_t redirect_site = SIZE_MAX;
+        if (has_redirections()) {
+            redirect_site = emit(OP_REDIRECT);
+            redirect_depth++;
+        }
+
+        if (at_keyword("if")) {
+            compile_if();
+        } else if (at_keyword("while") || at_keyword("until")) {
+            compile_while();
+        } else if (at_keyword("for")) {
+            compile_for();
+        } else {
+            throw runtime_error("syntax error near unexpected token `" + token.text + "'");
+        }
+
+        if (redirect_site != SIZE_MAX) {
+            redirect_depth--;
+            // Compiled last so here-document bodies stay in text order
+            prog.pipelines.push_back(compile_pipeline(tokens[pos].text));
+            prog.code[redirect_site].arg = prog.pipelines.size() - 1;
+            emit(OP_RESTORE);
+            pos++;
+        }
+    }
+
+    // Is the compound command starting at pos followed by redirections?
+    bool has_redirections() const
+    {
+        int depth = 0;
+        for (size_t i = pos; i < tokens.size(); i++) {
+            if (tokens[i].kind != list_token::KEYWORD) continue;
+            string word = tokens[i].text.substr(0, tokens[i].text.find(' '));
+            if (word == "if" || word == "while" || word == "until" || word == "for") {
+                depth++;
+            } else if ((word == "fi" || word == "done") && --depth == 0) {
+                return i + 1 < tokens.size() && tokens[i + 1].kind == list_token::REDIRECTS;
+            }
+        }
+        return false;
+    }
+
+    compiled_pipeline compile_pipeline(const string& text)
+    {
+        compiled_pipeline stages;
+        for (const string& stage_text : split_pipeline(text)) {
+            pipeline_stage stage;
+            stage.text = stage_text;
+            stage.group = is_group(stage_text, stage.inner);
+            if (!stage.group) {
+                stage.tokens = lex_command(stage_text);
+                for (const command_token& token : stage.tokens) {
+                    if (is_heredoc_operator(token) && next_heredoc < heredocs.size()) {
+                        stage.heredocs.push_back(heredocs[next_heredoc++]);
+                    }
+                }
+            }
+            stages.push_back(stage);
+        }
+        return stages;
+    }
+
+    void compile_if()
+    {
+        vector<size_t> end_jumps;
+        pos++;
+        compile_list({ "then" });
+        expect_keyword("then");
+        size_t skip = emit(OP_JUMP_IF_FAIL);
+        compile_list({ "elif", "else", "fi" });
+        end_jumps.push_back(emit(OP_JUMP));
+        prog.code[skip].arg = here();
+
+        while (at_keyword("elif")) {
+            pos++;
+            compile_list({ "then" });
+            expect_keyword("then");
+            skip = emit(OP_JUMP_IF_FAIL);
+            compile_list({ "elif", "else", "fi" });
+            end_jumps.push_back(emit(OP_JUMP));
+            prog.code[skip].arg = here();
+        }
+
+        if (at_keyword("else")) {
+            pos++;
+            compile_list({ "fi" });
+        } else {
+            // No branch taken
+            emit(OP_SET_STATUS, 0);
+        }
+        expect_keyword("fi");
+
+        for (size_t jump : end_jumps) {
+            prog.code[jump].arg = here();
+        }
+    }
+
+    void compile_while()
+    {
+        bool until = at_keyword("until");
+        pos++;
+        emit(OP_PUSH_STATUS);
+        size_t top = here();
+        compile_list({ "do" });
+        expect_keyword("do");
+        size_t exit_jump = emit(until ? OP_JUMP_IF_OK : OP_JUMP_IF_FAIL);
+
+        loops.push_back({ top, {}, redirect_depth });
+        compile_list({ "done" });
+        expect_keyword("done");
+        emit(OP_STORE_STATUS);
+        emit(OP_JUMP, top);
+
+        prog.code[exit_jump].arg = here();
+        for (size_t jump : loops.back().breaks) {
+            prog.code[jump].arg = here();
+        }
+        loops.pop_back();
+        emit(OP_POP_STATUS);
+    }
+
+    void compile_for()
+    {
+        string header = tokens[pos].text.substr(4);
+        vector<command_token> words = lex_command(header);
+        if (words.empty() || words[0].kind != command_token::WORD ||
+            !variable_table::valid_name(words[0].text)) {
+            throw runtime_error("syntax error: `for' needs a variable name");
+        }
+
+        for_loop loop;
+        loop.name = words[0].text;
+        if (words.size() == 1) {
+            loop.words.push_back("\"$@\"");
+        } else if (words[1].text != "in") {
+            throw runtime_error("syntax error near unexpected token `" + words[1].text + "'");
+        }
+        for (size_t i = 2; i < words.size(); i++) {
+            if (words[i].kind != command_token::WORD) {
+                throw runtime_error("syntax error near unexpected token `" + words[i].text + "'");
+            }
+            loop.words.push_back(words[i].text);
+        }
+        prog.loops.push_back(loop);
+        pos++;
+
+        emit(OP_PUSH_STATUS);
+        emit(OP_FOR_BEGIN, prog.loops.size() - 1);
+        size_t top = emit(OP_FOR_NEXT);
+        skip_separators();
+        expect_keyword("do");
+
+        loops.push_back({ top, {}, redirect_depth });
+        compile_list({ "done" });
+        expect_keyword("done");
+        emit(OP_STORE_STATUS);
+        emit(OP_JUMP, top);
+
+        prog.code[top].arg = here();
+        for (size_t jump : loops.back().breaks) {
+            prog.code[jump].arg = here();
+        }
+        loops.pop_back();
+        emit(OP_FOR_END);
+        emit(OP_POP_STATUS);
+    }
+};
+
+program compile_program(const string& text)
+{
+    return compiler(text).run();
+}
+
+// Least recently used programs are evicted first
+static list<pair<string, shared_ptr<const program>>> cache_order;
+static unordered_map<string, list<pair<string, shared_ptr<const program>>>::iterator> cache_index;
+
+shared_ptr<const program> compile_cached(const string& text)
+{
+    auto it = cache_index.find(text);
+    if (it != cache_index.end()) {
+        cache_order.splice(cache_order.begin(), cache_order, it->second);
+        return it->second->second;
+    }
+
+    shared_ptr<const program> compiled = make_shared<const program>(compile_program(text));
+    cache_order.emplace_front(text, compiled);
+    cache_index[text] = cache_order.begin();
+    if (cache_order.size() > PROGRAM_CACHE_SIZE) {
+        cache_index.erase(cache_order.back().first);
+        cache_order.pop_back();
+    }
+    return compiled;
+}
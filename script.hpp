@@ -0,0 +1,70 @@
+#ifndef __SCRIPT_HPP
+#define __SCRIPT_HPP
+
+#include <string>
+#include <vector>
+#include <memory>
+#include <stdexcept>
+
+#include "parser.hpp"
+
+// A command line (or a whole script) is compiled once into a flat program
+// for a small stack machine. Lists, pipeline splitting and lexing happen at
+// compile time; only expansion, globbing and execution are left for run
+// time, so loop bodies and repeated lines do not re-tokenize.
+
+// One stage of a pipeline, lexed once and expanded on every run
+struct pipeline_stage {
+    std::string text;                   // as written
+    bool group = false;                 // "( ... )": inner runs in a subshell
+    std::string inner;
+    std::vector<command_token> tokens;
+    std::vector<std::string> heredocs;  // bodies of its "<<" operators, in order
+};
+
+typedef std::vector<pipeline_stage> compiled_pipeline;
+
+enum opcode {
+    OP_RUN,             // run pipelines[arg] in the foreground, set status
+    OP_RUN_BACKGROUND,  // start pipelines[arg] as a job, status 0
+    OP_JUMP,            // ip = arg
+    OP_JUMP_IF_FAIL,    // ip = arg when status != 0
+    OP_JUMP_IF_OK,      // ip = arg when status == 0
+    OP_SET_STATUS,      // status = arg
+    OP_PUSH_STATUS,     // open a loop's status slot (initially 0)
+    OP_STORE_STATUS,    // save status in the innermost slot
+    OP_POP_STATUS,      // status = innermost slot, close it
+    OP_FOR_BEGIN,       // expand loops[arg].words and open an iteration
+    OP_FOR_NEXT,        // assign the next word, or ip = arg when done
+    OP_FOR_END,         // close the innermost iteration
+    OP_REDIRECT,        // apply the redirections of pipelines[arg] until OP_RESTORE
+    OP_RESTORE,         // undo the innermost OP_REDIRECT
+    OP_UNWIND,          // undo the arg innermost OP_REDIRECTs (break, continue)
+    OP_FORK,            // child continues, parent makes it a job and jumps to arg
+    OP_EXIT             // end of a forked block: exit with status
+};
+
+struct instruction {
+    opcode op;
+    size_t arg;
+};
+
+struct for_loop {
+    std::string name;
+    std::vector<std::string> words;     // raw words after "in"
+};
+
+struct program {
+    std::vector<instruction> code;
+    std::vector<compiled_pipeline> pipelines;
+    std::vector<for_loop> loops;
+};
+
+// Compile text into a program. Throws incomplete_input or runtime_error.
+program compile_program(const std::string& text);
+
+// compile_program() behind a cache keyed by the text, so repeated lines
+// (history recalls, loops re-entered through a subshell) compile once
+std::shared_ptr<const program> compile_cached(const std::string& text);
+
+#endif
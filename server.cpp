@@ -0,0 +1,411 @@
+#include "server.hpp"
+#include "jobs.hpp"
+#include <iostream>
+#include <cerrno>
+#include <csignal>
+#include <cstring>
+#include <climits>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+using namespace std;
+
+extern char** environ;
+
+const size_t STDIO_FDS = 3;
+
+// A connection, and once its request arrived the session serving it
+struct session {
+    int conn;
+    pid_t pid = 0;              // 0 while the request is awaited
+    bool hung_up = false;       // the client went away
+};
+
+static volatile sig_atomic_t stop_serving = 0;
+static volatile sig_atomic_t forward_signal = 0;
+
+static void stop_handler(int)
+{
+    stop_serving = 1;
+}
+
+static void forward_handler(int signum)
+{
+    forward_signal = signum;
+}
+
+static void child_handler(int)
+{
+}
+
+// Install handler without SA_RESTART, so a blocking call returns EINTR
+static void catch_signal(int signum, void (*handler)(int))
+{
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = handler;
+    sigaction(signum, &sa, NULL);
+}
+
+static bool make_address(const string& path, struct sockaddr_un& addr)
+{
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (path.empty() || path.size() >= sizeof(addr.sun_path)) {
+        cerr << "shell: " << path << ": invalid socket path" << endl;
+        return false;
+    }
+    memcpy(addr.sun_path, path.c_str(), path.size());
+    return true;
+}
+
+// Bind with the socket file readable and writable by its owner only:
+// whoever can connect can run commands as this user
+static int bind_private(int fd, const struct sockaddr_un& addr)
+{
+    mode_t old_umask = umask(077);
+    int ret = bind(fd, reinterpret_cast<const struct sockaddr*>(&addr), sizeof(addr));
+    umask(old_umask);
+    return ret;
+}
+
+// Is the process at the other end of conn run by this user?
+static bool same_user(int conn)
+{
+    struct ucred cred;
+    socklen_t len = sizeof(cred);
+    if (getsockopt(conn, SOL_SOCKET, SO_PEERCRED, &cred, &len) == -1) {
+        return false;
+    }
+    return cred.uid == getuid();
+}
+
+static int listen_on(const string& path)
+{
+    struct sockaddr_un addr;
+    if (!make_address(path, addr)) {
+        return -1;
+    }
+    int fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+    if (fd == -1) {
+        cerr << "shell: socket: " << strerror(errno) << endl;
+        return -1;
+    }
+    int ret = bind_private(fd, addr);
+    if (ret == -1 && errno == EADDRINUSE) {
+        // A socket left behind by a server that died is replaced; one a
+        // server still answers on is not
+        int probe = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+        bool live = connect(probe, reinterpret_cast<struct sockaddr*>(&addr), sizeof(addr)) == 0;
+        close(probe);
+        if (live) {
+            cerr << "shell: " << path << ": a server is already listening" << endl;
+            close(fd);
+            return -1;
+        }
+        unlink(path.c_str());
+        ret = bind_private(fd, addr);
+    }
+    if (ret == -1 || listen(fd, SOMAXCONN) == -1) {
+        cerr << "shell: " << path << ": " << strerror(errno) << endl;
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+// Read a request and the descriptors sent with it. Descriptors that came
+// with a malformed request are closed.
+static bool receive_request(int conn, session_request& request, int fds[STDIO_FDS])
+{
+    // Peek to learn the size of the message
+    ssize_t size = recv(conn, nullptr, 0, MSG_PEEK | MSG_TRUNC);
+    if (size <= 0) {
+        return false;
+    }
+    string payload(size, '\0');
+    struct iovec iov = { &payload[0], payload.size() };
+    union {
+        struct cmsghdr align;
+        char buffer[CMSG_SPACE(STDIO_FDS * sizeof(int))];
+    } control;
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buffer;
+    msg.msg_controllen = sizeof(control.buffer);
+    if (recvmsg(conn, &msg, MSG_CMSG_CLOEXEC) != size) {
+        return false;
+    }
+
+    size_t received = 0;
+    struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+    if (cmsg && cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+        received = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+        memcpy(fds, CMSG_DATA(cmsg), received * sizeof(int));
+    }
+
+    // cwd, environment up to an empty string, arguments
+    vector<string> fields;
+    for (size_t start = 0; start < payload.size(); ) {
+        size_t end = payload.find('\0', start);
+        if (end == string::npos) {
+            break;
+        }
+        fields.push_back(payload.substr(start, end - start));
+        start = end + 1;
+    }
+    size_t separator = 1;
+    while (separator < fields.size() && !fields[separator].empty()) {
+        separator++;
+    }
+    if (received != STDIO_FDS || (msg.msg_flags & MSG_CTRUNC) || separator >= fields.size()) {
+        for (size_t i = 0; i < received; i++) {
+            close(fds[i]);
+        }
+        return false;
+    }
+    request.cwd = fields[0];
+    request.environment.assign(fields.begin() + 1, fields.begin() + separator);
+    request.arguments.assign(fields.begin() + separator + 1, fields.end());
+    return true;
+}
+
+// Fork the session for a request. Returns its pid, or -1.
+static pid_t start_session(const vector<session>& sessions, int listener,
+                           int (*run_session)(const session_request&),
+                           const session_request& request, int fds[STDIO_FDS],
+                           const sigset_t& old_mask)
+{
+    pid_t pid = fork();
+    if (pid == 0) {
+        close(listener);
+        for (const auto& other : sessions) {
+            close(other.conn);
+        }
+        setpgid(0, 0);
+        signal(SIGINT, SIG_DFL);
+        signal(SIGTERM, SIG_DFL);
+        signal(SIGCHLD, SIG_DFL);
+        signal(SIGPIPE, SIG_DFL);
+        sigprocmask(SIG_SETMASK, &old_mask, NULL);
+        for (size_t i = 0; i < STDIO_FDS; i++) {
+            dup2(fds[i], static_cast<int>(i));
+            close(fds[i]);
+        }
+        int status = run_session(request);
+        // _exit: the session must not run the server's destructors
+        cout.flush();
+        cerr.flush();
+        _exit(status);
+    }
+    if (pid == -1) {
+        cerr << "shell: fork: " << strerror(errno) << endl;
+    } else {
+        setpgid(pid, pid);
+    }
+    for (size_t i = 0; i < STDIO_FDS; i++) {
+        close(fds[i]);
+    }
+    return pid;
+}
+
+// Tell clients of finished sessions their status and drop them
+static void collect_sessions(vector<session>& sessions)
+{
+    int status;
+    pid_t pid;
+    while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+        for (auto it = sessions.begin(); it != sessions.end(); ++it) {
+            if (it->pid == pid) {
+                int result = decode_wait_status(status);
+                send(it->conn, &result, sizeof(result), MSG_NOSIGNAL);
+                close(it->conn);
+                sessions.erase(it);
+                break;
+            }
+        }
+    }
+}
+
+// A message on a connection: the request of a new session or a signal for
+// a running one. Returns false when the connection is to be dropped.
+static bool handle_message(session& s, const vector<session>& sessions, int listener,
+                           int (*run_session)(const session_request&),
+                           const sigset_t& old_mask)
+{
+    if (s.pid == 0) {
+        session_request request;
+        int fds[STDIO_FDS];
+        if (!receive_request(s.conn, request, fds)) {
+            return false;
+        }
+        s.pid = start_session(sessions, listener, run_session, request, fds, old_mask);
+        return s.pid != -1;
+    }
+
+    int signum;
+    ssize_t n = recv(s.conn, &signum, sizeof(signum), MSG_DONTWAIT);
+    if (n == sizeof(signum) && signum > 0 && signum < NSIG) {
+        kill(-s.pid, signum);
+    } else if (n == 0 || (n == -1 && errno != EAGAIN && errno != EINTR)) {
+        // The session is still reaped, there is just nobody to tell
+        kill(-s.pid, SIGHUP);
+        kill(-s.pid, SIGCONT);
+        s.hung_up = true;
+    }
+    return true;
+}
+
+int serve_sessions(const string& path, int (*run_session)(const session_request&))
+{
+    int listener = listen_on(path);
+    if (listener == -1) {
+        return 1;
+    }
+    catch_signal(SIGINT, stop_handler);
+    catch_signal(SIGTERM, stop_handler);
+    catch_signal(SIGCHLD, child_handler);
+    signal(SIGPIPE, SIG_IGN);
+
+    // SIGCHLD only gets through while ppoll() waits, so no exit is missed
+    sigset_t chld_mask, old_mask;
+    sigemptyset(&chld_mask);
+    sigaddset(&chld_mask, SIGCHLD);
+    sigprocmask(SIG_BLOCK, &chld_mask, &old_mask);
+    sigset_t wait_mask = old_mask;
+    sigdelset(&wait_mask, SIGCHLD);
+
+    vector<session> sessions;
+    vector<struct pollfd> polled;
+    while (!stop_serving) {
+        collect_sessions(sessions);
+
+        polled.clear();
+        polled.push_back({ listener, POLLIN, 0 });
+        for (const auto& s : sessions) {
+            polled.push_back({ s.hung_up ? -1 : s.conn, POLLIN, 0 });
+        }
+        if (ppoll(polled.data(), polled.size(), nullptr, &wait_mask) == -1) {
+            if (errno == EINTR) continue;
+            cerr << "shell: poll: " << strerror(errno) << endl;
+            break;
+        }
+
+        // Walk backwards so dropping a session keeps the indices valid
+        for (size_t i = sessions.size(); i > 0; i--) {
+            if (polled[i].revents == 0) {
+                continue;
+            }
+            session& s = sessions[i - 1];
+            if (!handle_message(s, sessions, listener, run_session, old_mask)) {
+                close(s.conn);
+                sessions.erase(sessions.begin() + (i - 1));
+            }
+        }
+
+        if (polled[0].revents & POLLIN) {
+            int conn = accept4(listener, nullptr, nullptr, SOCK_CLOEXEC);
+            if (conn != -1 && !same_user(conn)) {
+                // Sessions run as the server's user; nobody else gets one
+                close(conn);
+            } else if (conn != -1) {
+                sessions.push_back({ conn });
+            }
+        }
+    }
+
+    // Sessions do not outlive the server
+    for (const auto& s : sessions) {
+        if (s.pid > 0) {
+            kill(-s.pid, SIGHUP);
+            kill(-s.pid, SIGCONT);
+        }
+        close(s.conn);
+    }
+    close(listener);
+    unlink(path.c_str());
+    return 0;
+}
+
+int connect_session(const string& path, const vector<string>& arguments)
+{
+    struct sockaddr_un addr;
+    if (!make_address(path, addr)) {
+        return 2;
+    }
+    int fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+    if (fd == -1 || connect(fd, reinterpret_cast<struct sockaddr*>(&addr), sizeof(addr)) == -1) {
+        cerr << "shell: " << path << ": " << strerror(errno) << endl;
+        return 2;
+    }
+
+    char cwd[PATH_MAX];
+    if (!getcwd(cwd, sizeof(cwd))) {
+        cerr << "shell: getcwd: " << strerror(errno) << endl;
+        return 2;
+    }
+    string payload(cwd);
+    payload += '\0';
+    for (char** env = environ; *env; env++) {
+        payload += *env;
+        payload += '\0';
+    }
+    payload += '\0';
+    for (const auto& arg : arguments) {
+        payload += arg;
+        payload += '\0';
+    }
+
+    int fds[STDIO_FDS] = { STDIN_FILENO, STDOUT_FILENO, STDERR_FILENO };
+    struct iovec iov = { &payload[0], payload.size() };
+    union {
+        struct cmsghdr align;
+        char buffer[CMSG_SPACE(sizeof(fds))];
+    } control;
+    memset(&control, 0, sizeof(control));
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buffer;
+    msg.msg_controllen = sizeof(control.buffer);
+    struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(fds));
+    memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+    if (sendmsg(fd, &msg, MSG_NOSIGNAL) == -1) {
+        cerr << "shell: " << path << ": " << strerror(errno) << endl;
+        close(fd);
+        return 2;
+    }
+
+    for (int signum : { SIGINT, SIGTERM, SIGHUP, SIGQUIT }) {
+        catch_signal(signum, forward_handler);
+    }
+    while (true) {
+        int status;
+        ssize_t n = recv(fd, &status, sizeof(status), 0);
+        if (n == sizeof(status)) {
+            close(fd);
+            return status;
+        }
+        if (n == -1 && errno == EINTR) {
+            int signum = forward_signal;
+            forward_signal = 0;
+            if (signum) {
+                send(fd, &signum, sizeof(signum), MSG_NOSIGNAL);
+            }
+            continue;
+        }
+        cerr << "shell: " << path << ": the server dropped the session" << endl;
+        close(fd);
+        return 2;
+    }
+}
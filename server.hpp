@@ -0,0 +1,39 @@
+#ifndef __SERVER_HPP
+#define __SERVER_HPP
+
+#include <string>
+#include <vector>
+
+// Server mode: "shellkil --server PATH" listens on a UNIX socket and runs
+// every connection as a session of its own, so a task costs a fork of an
+// already initialized shell instead of a fresh start with readline and
+// history. "shellkil --connect PATH ..." is the matching client.
+//
+// The protocol uses SOCK_SEQPACKET, one message per request:
+//   client -> server  request: the client's stdin, stdout and stderr as
+//                     SCM_RIGHTS, and as payload NUL-terminated strings:
+//                     cwd, NAME=VALUE environment entries, an empty
+//                     string, then the arguments
+//   client -> server  an int signal number, sent to the whole session
+//   server -> client  the session's exit status as an int, once it ended
+// The session is a forked child of the server in a process group of its
+// own; it has no controlling terminal, so the client forwards signals.
+// Closing the connection hangs the session up.
+
+struct session_request {
+    std::string cwd;
+    std::vector<std::string> environment;   // NAME=VALUE
+    std::vector<std::string> arguments;     // as for "shellkil -c ..." or a script
+};
+
+// Serve sessions on path until SIGINT or SIGTERM. Each session runs
+// run_session in a forked child with the client's descriptors as its
+// stdio and exits with the result.
+int serve_sessions(const std::string& path, int (*run_session)(const session_request&));
+
+// Hand our stdio, working directory, environment and arguments to the
+// server at path, pass on SIGINT, SIGTERM, SIGHUP and SIGQUIT, and return
+// the session's exit status
+int connect_session(const std::string& path, const std::vector<std::string>& arguments);
+
+#endif
@@ -1,6 +1,7 @@
 #include <iostream>
 #include <algorithm>
 #include <string>
+#include <string_view>
 #include <cstring>
 #include <sstream>
 #include <vector>
@@ -8,45 +9,121 @@
 #include <sys/types.h>
 #include <sys/wait.h>
 #include <fcntl.h>
+#include <sys/mman.h>
 #include <glob.h>
+#include <poll.h>
 #include <readline/readline.h>
 #include <ext/stdio_filebuf.h>
 #include <memory>
 #include <limits.h>
+#include <iomanip>
+#include <chrono>
+#include <fstream>
 
 #include "delep.hpp"
 #include "history.hpp"
 #include "squashbug.hpp"
+#include "completion.hpp"
+#include "parser.hpp"
+#include "variables.hpp"
+#include "script.hpp"
+#include "placement.hpp"
+#include "jobs.hpp"
+#include "limits.hpp"
+#include "capture.hpp"
+#include "arena.hpp"
+#include "server.hpp"
 
 using namespace std;
 
 // Constants
-const size_t MAX_BUFFER_SIZE = 4096;
 const size_t DEFAULT_CAPACITY = 256;
 
-static sigjmp_buf env;
-size_t job_number = 1;
-volatile bool is_background;
-pid_t foreground_pid;
-set<pid_t> background_pids;
+int last_status = 0;
 history h;
-char *curr_line = nullptr;
+string saved_line;
+vector<string> positional_params;   // $0 and the script arguments
+bool interactive_shell = false;
+int substitution_status = -1;       // of the latest $(...), -1 before any
+
+string command_substitution(const string& command);
+
+// Parameters every expansion sees
+expansion_context shell_context()
+{
+    return { &shell_variables, last_status, getpid(), &positional_params, command_substitution };
+}
+
+// Glob a field with unquoted pattern characters; a pattern that matches
+// nothing is kept as written
+void glob_field(const expanded_word& word, vector<string>& out)
+{
+    if (word.pattern.empty()) {
+        out.push_back(word.text);
+        return;
+    }
+    
+    glob_t glob_result;
+    memset(&glob_result, 0, sizeof(glob_result));
+    
+    int ret = glob(word.pattern.c_str(), 0, NULL, &glob_result);
+    if (ret == GLOB_NOMATCH) {
+        out.push_back(word.text);
+    } else if (ret != 0) {
+        globfree(&glob_result);
+        throw runtime_error("Glob error for pattern: " + word.text);
+    } else {
+        out.reserve(out.size() + glob_result.gl_pathc);
+        for (size_t i = 0; i < glob_result.gl_pathc; ++i) {
+            out.push_back(string(glob_result.gl_pathv[i]));
+        }
+    }
+    globfree(&glob_result);
+}
+
+// "<(cmd)" or ">(cmd)": cmd runs concurrently with the command, joined to
+// it by a pipe the command reaches through /dev/fd/N
+struct process_substitution {
+    string command;
+    bool output;            // <(cmd): the command reads what cmd writes
+    int command_fd;         // pipe end passed to the command
+    int process_fd;         // pipe end for cmd, -1 once it is started
+};
+
+// One redirection of a command. Actions are only recorded when the
+// command is parsed and carried out in order in the process that runs it.
+struct file_action {
+    enum kind_t { OPEN, DUP, CLOSE, DATA } kind;
+    int fd;
+    string path;        // OPEN: file and open flags
+    int flags;
+    int source;         // DUP: descriptor copied onto fd
+    string data;        // DATA: here-string or here-document contents
+};
 
 class Command
 {
 public:
     string command;
     vector<string> arguments;
+    vector<pair<string, string>> assignments;   // NAME=value words before the command
+    vector<file_action> file_actions;
+    vector<process_substitution> substitutions;
+    placement place;                            // from a "sched ..." prefix
+    timeout_spec timeout;                       // from a "timeout ..." prefix
+    int substitution_status = -1;               // of the last $(...) in its words
     int input_fd, output_fd;
-    string input_file, output_file;
     pid_t pid;
     bool pipe_mode = false;
 
-    Command(const string &cmd) : command(cmd), input_fd(STDIN_FILENO), output_fd(STDOUT_FILENO), input_file(""), output_file(""), pid(-1)
+    // The stage was lexed once when the line was compiled
+    Command(const pipeline_stage& stage) : command(stage.text), input_fd(STDIN_FILENO), output_fd(STDOUT_FILENO), pid(-1)
     {
-        if (!parse_command()) {
-            throw runtime_error("Failed to parse command: " + cmd);
+        ::substitution_status = -1;
+        if (!parse_command(stage)) {
+            throw runtime_error("Failed to parse command: " + stage.text);
         }
+        substitution_status = ::substitution_status;
     }
 
     ~Command()
@@ -55,15 +132,86 @@ public:
             close(input_fd);
         if (output_fd != STDOUT_FILENO && output_fd != -1)
             close(output_fd);
+        for (const auto& sub : substitutions) {
+            close(sub.command_fd);
+            if (sub.process_fd != -1) close(sub.process_fd);
+        }
+    }
+
+    // Connect the pipe ends, then apply the redirections left to right as
+    // sh does, so "2>&1 |" and "| cmd > file" both work
+    bool apply_redirections() const
+    {
+        if (input_fd != STDIN_FILENO && dup2(input_fd, STDIN_FILENO) == -1) {
+            perror("dup2 input");
+            return false;
+        }
+        if (output_fd != STDOUT_FILENO && dup2(output_fd, STDOUT_FILENO) == -1) {
+            perror("dup2 output");
+            return false;
+        }
+
+        for (const auto& action : file_actions) {
+            int fd = -1;
+            switch (action.kind) {
+            case file_action::OPEN:
+                fd = open(action.path.c_str(), action.flags, 0644);
+                if (fd == -1) {
+                    cerr << "shell: " << action.path << ": " << strerror(errno) << endl;
+                    return false;
+                }
+                break;
+            case file_action::DUP:
+                if (dup2(action.source, action.fd) == -1) {
+                    cerr << "shell: " << action.source << ": " << strerror(errno) << endl;
+                    return false;
+                }
+                continue;
+            case file_action::CLOSE:
+                close(action.fd);
+                continue;
+            case file_action::DATA:
+                // Anonymous memory file: no temp file and no pipe size limit
+                fd = memfd_create("here-document", 0);
+                if (fd == -1 || !write_all(fd, action.data) || lseek(fd, 0, SEEK_SET) == -1) {
+                    perror("here-document");
+                    if (fd != -1) close(fd);
+                    return false;
+                }
+                break;
+            }
+            if (fd != action.fd) {
+                dup2(fd, action.fd);
+                close(fd);
+            }
+        }
+        return true;
     }
 
 private:
-    bool parse_command()
+    pmr::vector<expanded_word> words{line_arena()};    // expanded fields awaiting globbing
+
+    static bool write_all(int fd, const string& data)
+    {
+        size_t done = 0;
+        while (done < data.size()) {
+            ssize_t n = write(fd, data.data() + done, data.size() - done);
+            if (n == -1) {
+                if (errno == EINTR) continue;
+                return false;
+            }
+            done += n;
+        }
+        return true;
+    }
+
+    bool parse_command(const pipeline_stage& stage)
     {
         try {
-            parse_arguments();
+            parse_arguments(stage);
             handle_wildcards();
-            setup_io_redirection();
+            while (handle_placement() || handle_timeout()) {
+            }
             return true;
         } catch (const exception& e) {
             cerr << "Error parsing command: " << e.what() << endl;
@@ -71,115 +219,216 @@ private:
         }
     }
 
-    void parse_arguments()
+    string expand_single(const string& raw) const
     {
-        stringstream ss(command);
-        string arg;
-        string temp = "";
-        bool backslash = false;
-        
-        while (ss >> arg)
+        pmr::vector<expanded_word> fields(line_arena());
+        expand_word(raw, shell_context(), fields, false);
+        return fields.empty() ? string() : fields[0].text;
+    }
+
+    // Create the pipe for "<(cmd)" or ">(cmd)" and return the /dev/fd path
+    // the command sees; the process itself is started by execute_pipeline
+    string add_substitution(const command_token& token)
+    {
+        int fds[2];
+        if (pipe2(fds, O_CLOEXEC) == -1) {
+            throw runtime_error("Failed to create pipe: " + string(strerror(errno)));
+        }
+        process_substitution sub;
+        sub.command = token.text.substr(1);
+        sub.output = (token.text[0] == '<');
+        sub.command_fd = sub.output ? fds[0] : fds[1];
+        sub.process_fd = sub.output ? fds[1] : fds[0];
+        substitutions.push_back(sub);
+        return "/dev/fd/" + to_string(sub.command_fd);
+    }
+
+    // Record one redirection; op is the operator token without fd digits
+    void add_redirection(int fd, const string& op, const command_token& target, const string* heredoc)
+    {
+        const string& raw_target = target.text;
+        file_action action;
+        action.fd = fd;
+        action.flags = 0;
+        action.source = -1;
+
+        if (op == "<<" || op == "<<-") {
+            // A quoted delimiter keeps the body literal
+            action.kind = file_action::DATA;
+            bool quoted = raw_target.find_first_of("'\"\\") != string::npos;
+            action.data = quoted ? *heredoc : expand_heredoc(*heredoc, shell_context());
+        } else if (op == "<<<") {
+            action.kind = file_action::DATA;
+            action.data = expand_single(raw_target) + "\n";
+        } else if (op == ">&" || op == "<&") {
+            string target = expand_single(raw_target);
+            if (target == "-") {
+                action.kind = file_action::CLOSE;
+            } else if (!target.empty() && all_of(target.begin(), target.end(), ::isdigit)) {
+                action.kind = file_action::DUP;
+                action.source = stoi(target);
+            } else {
+                throw runtime_error(raw_target + ": ambiguous redirect");
+            }
+        } else {
+            action.kind = file_action::OPEN;
+            action.path = (target.kind == command_token::PROCSUB) ? add_substitution(target) : expand_single(raw_target);
+            if (op == "<") {
+                action.flags = O_RDONLY;
+            } else if (op == ">") {
+                action.flags = O_WRONLY | O_CREAT | O_TRUNC;
+            } else if (op == ">>") {
+                action.flags = O_WRONLY | O_CREAT | O_APPEND;
+            } else {
+                action.flags = O_RDWR | O_CREAT;    // <>
+            }
+        }
+        file_actions.push_back(action);
+    }
+
+    void parse_arguments(const pipeline_stage& stage)
+    {
+        const vector<command_token>& tokens = stage.tokens;
+        size_t heredoc_index = 0;
+
+        for (size_t i = 0; i < tokens.size(); i++)
         {
-            if (arg == "<")
+            if (tokens[i].kind == command_token::REDIRECT)
             {
-                if (!(ss >> input_file)) {
-                    throw runtime_error("Expected input file after '<'");
+                const string& token = tokens[i].text;
+                size_t op_start = token.find_first_of("<>");
+                string op = token.substr(op_start);
+                if (i + 1 >= tokens.size() || tokens[i + 1].kind == command_token::REDIRECT) {
+                    throw runtime_error("syntax error: expected a word after '" + op + "'");
+                }
+
+                int fd = (op[0] == '<') ? STDIN_FILENO : STDOUT_FILENO;
+                if (op_start > 0) {
+                    fd = stoi(token.substr(0, op_start));
                 }
-                backslash = false;
+
+                const string* heredoc = nullptr;
+                if (is_heredoc_operator(tokens[i])) {
+                    if (heredoc_index >= stage.heredocs.size()) {
+                        throw runtime_error("here-document without a body");
+                    }
+                    heredoc = &stage.heredocs[heredoc_index++];
+                }
+                add_redirection(fd, op, tokens[++i], heredoc);
             }
-            else if (arg == ">")
+            else if (tokens[i].kind == command_token::PROCSUB)
             {
-                if (!(ss >> output_file)) {
-                    throw runtime_error("Expected output file after '>'");
-                }
-                backslash = false;
+                words.push_back({ add_substitution(tokens[i]), "" });
             }
-            else if (arg.length() > 0 && arg[arg.size() - 1] == '\\')
+            else if (words.empty() && is_assignment(tokens[i].text))
             {
-                temp = temp + arg;
-                temp[temp.size() - 1] = ' ';
-                backslash = true;
+                // Leading NAME=value words are assignments, not arguments
+                size_t eq = tokens[i].text.find('=');
+                assignments.emplace_back(tokens[i].text.substr(0, eq), expand_single(tokens[i].text.substr(eq + 1)));
             }
             else
             {
-                if (backslash)
-                {
-                    temp = temp + arg;
-                    arguments.push_back(temp);
-                    temp = "";
-                    backslash = false;
-                }
-                else
-                    arguments.push_back(arg);
+                // export's NAME=value operands are not field-split
+                bool split = !(is_assignment(tokens[i].text) && !words.empty() && words[0].text == "export");
+                expand_word(tokens[i].text, shell_context(), words, split);
             }
         }
 
-        if (arguments.empty()) {
+        if (words.empty() && assignments.empty() && file_actions.empty()) {
             throw runtime_error("No command specified");
         }
         
-        command = arguments[0];
+        command = words.empty() ? "" : words[0].text;
     }
 
     void handle_wildcards()
     {
-        vector<string> temp_args;
-        for (auto &arg : arguments)
-        {
-            if (arg.find('*') != string::npos || arg.find('?') != string::npos)
-            {
-                glob_t glob_result;
-                memset(&glob_result, 0, sizeof(glob_result));
-                
-                int ret = glob(arg.c_str(), GLOB_TILDE, NULL, &glob_result);
-                if (ret != 0)
-                {
-                    if (ret == GLOB_NOMATCH) {
-                        // No matches found, keep original argument
-                        temp_args.push_back(arg);
-                    } else {
-                        globfree(&glob_result);
-                        throw runtime_error("Glob error for pattern: " + arg);
-                    }
-                }
-                else
-                {
-                    for (size_t i = 0; i < glob_result.gl_pathc; ++i)
-                    {
-                        temp_args.push_back(string(glob_result.gl_pathv[i]));
-                    }
-                    globfree(&glob_result);
-                }
-            }
-            else
-                temp_args.push_back(arg);
+        for (const auto &word : words) {
+            glob_field(word, arguments);
         }
+        words.clear();
+    }
 
-        arguments = temp_args;
+    // "sched [options] cmd ..." runs cmd with the given placement
+    bool handle_placement()
+    {
+        if (arguments.empty() || arguments[0] != "sched") {
+            return false;
+        }
+        size_t consumed = 0;
+        string error;
+        if (!parse_placement(arguments, place, consumed, error)) {
+            throw runtime_error("sched: " + error + "\n"
+                                "usage: sched [-c CPUS] [-N NODE] [-n NICE] [-i CLASS[:LEVEL]] "
+                                "[-g CGROUP [--cpu-max=QUOTA[/PERIOD]] [--memory-max=BYTES]] command...");
+        }
+        arguments.erase(arguments.begin(), arguments.begin() + consumed);
+        command = arguments[0];
+        return true;
     }
 
-    void setup_io_redirection()
+    // "timeout [options] DURATION cmd ..." bounds the pipeline's run time
+    bool handle_timeout()
     {
-        if (!input_file.empty())
-        {
-            input_fd = open(input_file.c_str(), O_RDONLY);
-            if (input_fd == -1)
-            {
-                throw runtime_error("Error opening input file: " + input_file + " - " + strerror(errno));
+        if (arguments.empty() || arguments[0] != "timeout") {
+            return false;
+        }
+        size_t consumed = 0;
+        string error;
+        if (!parse_timeout(arguments, timeout, consumed, error)) {
+            throw runtime_error("timeout: " + error + "\n"
+                                "usage: timeout [-s SIGNAL] [-k DURATION] DURATION command...");
+        }
+        arguments.erase(arguments.begin(), arguments.begin() + consumed);
+        command = arguments[0];
+        return true;
+    }
+};
+
+// Saves the descriptors a builtin's redirections replace and puts them
+// back afterwards, since builtins run inside the shell itself
+class redirection_guard
+{
+public:
+    explicit redirection_guard(const Command& command)
+    {
+        for (const auto& action : command.file_actions) {
+            bool seen = false;
+            for (const auto& entry : saved) {
+                seen = seen || entry.first == action.fd;
+            }
+            if (!seen) {
+                saved.push_back(make_pair(action.fd, fcntl(action.fd, F_DUPFD_CLOEXEC, 10)));
             }
         }
+    }
 
-        if (!output_file.empty())
-        {
-            output_fd = open(output_file.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
-            if (output_fd == -1)
-            {
-                throw runtime_error("Error opening output file: " + output_file + " - " + strerror(errno));
+    ~redirection_guard()
+    {
+        restore();
+    }
+
+    // Put the descriptors back now rather than at destruction
+    void restore()
+    {
+        cout.flush();
+        for (auto it = saved.rbegin(); it != saved.rend(); ++it) {
+            if (it->second == -1) {
+                close(it->first);
+            } else {
+                dup2(it->second, it->first);
+                close(it->second);
             }
         }
+        saved.clear();
     }
+
+private:
+    vector<pair<int, int>> saved;   // fd -> copy, or -1 when it was closed
 };
 
+int execute_line(const string& line);
+
 // Utility functions
 string get_safe_string(const char* str) {
     return str ? string(str) : string("");
@@ -217,7 +466,7 @@ string get_hostname() {
 string shell_prompt()
 {
     try {
-        string user = get_safe_string(getenv("USER"));
+        string user = get_safe_string(shell_variables.get("USER"));
         string pcname = get_hostname();
         string current_directory = get_current_directory();
         
@@ -244,86 +493,108 @@ void delim_remove(string &command)
 
 int execute_command(Command &command, bool background)
 {
-    // Validate command
+    // Prefix assignments only reach this command's environment
+    for (const auto& assignment : command.assignments) {
+        shell_variables.set(assignment.first, assignment.second);
+        shell_variables.set_exported(assignment.first, true);
+    }
+
+    // A command of assignments alone (in a pipeline or job) does nothing
     if (command.arguments.empty()) {
-        cerr << "No command to execute" << endl;
-        return -1;
+        return 0;
     }
 
-    // Prepare arguments for execvp
-    vector<char*> args;
+    // Prepare arguments for execvpe
+    pmr::vector<char*> args(line_arena());
+    args.reserve(command.arguments.size() + 1);
     for (const auto& arg : command.arguments) {
         args.push_back(const_cast<char*>(arg.c_str()));
     }
     args.push_back(nullptr);
 
-    // Redirect input and output
-    if (dup2(command.input_fd, STDIN_FILENO) == -1) {
-        perror("dup2 input");
-        return -1;
-    }
-    if (dup2(command.output_fd, STDOUT_FILENO) == -1) {
-        perror("dup2 output");
-        return -1;
+    // execvpe searches the process PATH, which follows the shell variable
+    const char* path = shell_variables.get("PATH");
+    if (path) {
+        setenv("PATH", path, 1);
+    } else {
+        unsetenv("PATH");
     }
 
-    // Execute the command
-    int ret = execvp(command.command.c_str(), args.data());
+    // Execute the command with the exported variables as its environment
+    int ret = execvpe(command.command.c_str(), args.data(), shell_variables.environment());
     if (ret == -1) {
-        cerr << "Error executing command: " << command.command << " - " << strerror(errno) << endl;
-        return -1;
+        int exec_errno = errno;
+        cerr << "Error executing command: " << command.command << " - " << strerror(exec_errno) << endl;
+        return exec_errno == ENOENT ? 127 : 126;
     }
     
     return 0;
 }
 
-// Signal handlers
+// Signal handlers only record the signal; the main loop acts on it
 void ctrl_c_handler(int signum)
 {
-    if (foreground_pid == 0) {
-        siglongjmp(env, 42);
-    }
-    cout << endl;
-    if (kill(foreground_pid, SIGTERM) == -1) {
-        kill(foreground_pid, SIGKILL);
-    }
-    foreground_pid = 0;
+    interrupted = 1;
 }
 
-void ctrl_z_handler(int signum)
+void child_signal_handler(int signum)
 {
-    if (foreground_pid == 0) {
-        siglongjmp(env, 42);
-    }
-    cout << endl << "[" << job_number++ << "] " << foreground_pid << endl;
-    kill(foreground_pid, SIGSTOP);
-    background_pids.insert(foreground_pid);
-    foreground_pid = 0;
+    child_exited = 1;
 }
 
-void child_signal_handler(int signum)
+// readline's input function. A Ctrl+C at the prompt interrupts poll(),
+// after which the line is discarded by accepting it empty. Background jobs
+// with a timeout are enforced while the shell waits for input.
+static int read_key(FILE* stream)
 {
-    int status;
-    pid_t pid;
-    while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
-        background_pids.erase(pid);
+    while (true) {
+        struct pollfd input = { fileno(stream), POLLIN, 0 };
+        int ready = poll(&input, 1, enforce_deadlines());
+        if (ready == -1 && errno != EINTR) {
+            return EOF;
+        }
+        if (interrupted) {
+            rl_replace_line("", 0);
+            return '\n';
+        }
+        if (ready <= 0) {
+            continue;
+        }
+        unsigned char c;
+        ssize_t n = read(fileno(stream), &c, 1);
+        if (n == 1) {
+            return c;
+        }
+        if (n == 0 || errno != EINTR) {
+            return EOF;
+        }
     }
 }
 
 // Readline key bindings
+//
+// The line being edited is saved once when navigation starts; its text up
+// to the cursor becomes the prefix that filters history entries, as in
+// zsh's history-beginning-search.
+static void show_history_line(string_view line)
+{
+    rl_replace_line(line.data(), 0);
+    rl_point = rl_end;
+}
+
 static int key_up_arrow(int count, int key)
 {
     if (count == 0) return 0;
     
-    if (h.curr_ind == h.get_size()) {
-        free(curr_line);
-        curr_line = strdup(rl_line_buffer);
+    int size = h.get_size();
+    if (h.curr_ind == size) {
+        saved_line.assign(rl_line_buffer, rl_end);
+        h.set_search_prefix(string_view(saved_line).substr(0, rl_point));
     }
     
-    h.decrement_history();
-    string line = h.get_curr();
-    rl_replace_line(line.c_str(), 0);
-    rl_point = line.size();
+    if (h.search_backward()) {
+        show_history_line(h.get_curr());
+    }
     return 0;
 }
 
@@ -331,19 +602,16 @@ static int key_down_arrow(int count, int key)
 {
     if (count == 0) return 0;
     
-    if (h.curr_ind == h.get_size()) {
-        free(curr_line);
-        curr_line = strdup(rl_line_buffer);
+    int size = h.get_size();
+    if (h.curr_ind == size) {
+        return 0;
     }
     
-    h.increment_history();
-    if (h.curr_ind < h.get_size()) {
-        string line = h.get_curr();
-        rl_replace_line(line.c_str(), 0);
-        rl_point = line.size();
+    h.search_forward();
+    if (h.curr_ind < size) {
+        show_history_line(h.get_curr());
     } else {
-        rl_replace_line(curr_line ? curr_line : "", 0);
-        rl_point = rl_end;
+        show_history_line(saved_line);
     }
     return 0;
 }
@@ -362,42 +630,240 @@ static int key_ctrl_e(int count, int key)
     return 0;
 }
 
+// Hold SIGCHLD back while the shell forks and waits; children are
+// reaped by whoever waits for them, or by reap_children() afterwards
+static void block_sigchld(sigset_t& old_mask)
+{
+    sigset_t mask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGCHLD);
+    sigprocmask(SIG_BLOCK, &mask, &old_mask);
+}
+
+// export [-n] [NAME[=VALUE]]...; without operands lists exported variables
+int export_builtin(const vector<string>& arguments)
+{
+    size_t first = 1;
+    bool unexport = false;
+    if (arguments.size() > 1 && (arguments[1] == "-n" || arguments[1] == "-p")) {
+        unexport = (arguments[1] == "-n");
+        first = 2;
+    }
+    
+    if (first == arguments.size()) {
+        ostringstream out;
+        for (const auto& var : shell_variables.list(true)) {
+            out << "export " << var.first << "=\"";
+            for (char c : var.second) {
+                if (c == '"' || c == '\\' || c == '$' || c == '`') out << '\\';
+                out << c;
+            }
+            out << "\"\n";
+        }
+        string text = out.str();
+        if (write(STDOUT_FILENO, text.data(), text.size()) == -1) {
+            perror("export");
+            return 1;
+        }
+        return 0;
+    }
+    
+    int status = 0;
+    for (size_t i = first; i < arguments.size(); i++) {
+        const string& arg = arguments[i];
+        size_t eq = arg.find('=');
+        string name = arg.substr(0, eq);
+        if (!variable_table::valid_name(name)) {
+            cerr << "export: `" << arg << "': not a valid identifier" << endl;
+            status = 1;
+            continue;
+        }
+        if (eq != string::npos) {
+            shell_variables.set(name, string_view(arg).substr(eq + 1));
+        }
+        shell_variables.set_exported(name, !unexport);
+    }
+    return status;
+}
+
+int unset_builtin(const vector<string>& arguments)
+{
+    int status = 0;
+    for (size_t i = 1; i < arguments.size(); i++) {
+        if (arguments[i] == "-v") continue;
+        if (!variable_table::valid_name(arguments[i])) {
+            cerr << "unset: `" << arguments[i] << "': not a valid identifier" << endl;
+            status = 1;
+            continue;
+        }
+        shell_variables.unset(arguments[i]);
+    }
+    return status;
+}
+
+// read [-r] [NAME...]: one line of stdin split over the names, the last
+// taking the rest. Bytes are read one at a time so nothing past the line
+// is consumed from a shared descriptor.
+int read_builtin(const vector<string>& arguments)
+{
+    bool raw = false;
+    vector<string> names;
+    for (size_t i = 1; i < arguments.size(); i++) {
+        if (arguments[i] == "-r") {
+            raw = true;
+        } else if (variable_table::valid_name(arguments[i])) {
+            names.push_back(arguments[i]);
+        } else {
+            cerr << "read: `" << arguments[i] << "': not a valid identifier" << endl;
+            return 2;
+        }
+    }
+    if (names.empty()) {
+        names.push_back("REPLY");
+    }
+    
+    string line;
+    bool got_newline = false;
+    char c;
+    ssize_t n;
+    while ((n = read(STDIN_FILENO, &c, 1)) == 1 || (n == -1 && errno == EINTR)) {
+        if (n != 1) {
+            if (interrupted) {
+                if (interactive_shell) cout << endl;
+                return 130;
+            }
+            continue;
+        }
+        if (c == '\\' && !raw) {
+            if (read(STDIN_FILENO, &c, 1) != 1) break;
+            if (c != '\n') line += c;
+            continue;
+        }
+        if (c == '\n') {
+            got_newline = true;
+            break;
+        }
+        line += c;
+    }
+    
+    size_t start = 0;
+    for (size_t i = 0; i < names.size(); i++) {
+        start = line.find_first_not_of(" \t", start);
+        if (start == string::npos) {
+            shell_variables.set(names[i], "");
+            continue;
+        }
+        if (i + 1 == names.size()) {
+            shell_variables.set(names[i], trim_blanks(line.substr(start)));
+            break;
+        }
+        size_t end = line.find_first_of(" \t", start);
+        shell_variables.set(names[i], line.substr(start, end == string::npos ? string::npos : end - start));
+        start = end == string::npos ? line.size() : end;
+    }
+    
+    return (got_newline || !line.empty()) ? 0 : 1;
+}
+
+// Commands handle_builtin_command runs inside the shell
+bool is_builtin_command(const Command& shell_command)
+{
+    static const set<string> builtins = { "export", "unset", "read", "exit", "cd", "pwd", "wait", "jobs", "fg", "bg", "ulimit", "history" };
+    // A placed or timed command always runs in a child, where the
+    // placement applies and which the timeout can kill
+    return shell_command.arguments.empty() ||
+           (shell_command.place.empty() && shell_command.timeout.seconds == 0 &&
+            builtins.count(shell_command.command) > 0);
+}
+
 // Built-in command handlers
-bool handle_builtin_command(Command& shell_command)
+bool handle_builtin_command(Command& shell_command, int& status)
 {
-    if (shell_command.command == "exit") {
-        cout << "exit" << endl;
-        exit(EXIT_SUCCESS);
+    status = 0;
+    if (shell_command.arguments.empty()) {
+        // NAME=value alone sets shell variables; "x=$(cmd)" has cmd's status
+        for (const auto& assignment : shell_command.assignments) {
+            shell_variables.set(assignment.first, assignment.second);
+        }
+        status = max(shell_command.substitution_status, 0);
+        return true;
+    }
+    else if (shell_command.command == "export") {
+        status = export_builtin(shell_command.arguments);
+        return true;
+    }
+    else if (shell_command.command == "unset") {
+        status = unset_builtin(shell_command.arguments);
+        return true;
+    }
+    else if (shell_command.command == "read") {
+        status = read_builtin(shell_command.arguments);
+        return true;
+    }
+    else if (shell_command.command == "exit") {
+        if (interactive_shell) {
+            cout << "exit" << endl;
+        }
+        exit(shell_command.arguments.size() > 1 ? atoi(shell_command.arguments[1].c_str()) : last_status);
     }
     else if (shell_command.command == "cd") {
         if (shell_command.arguments.size() == 1) {
-            const char* home = getenv("HOME");
+            const char* home = shell_variables.get("HOME");
             if (home && chdir(home) != 0) {
                 perror("cd");
+                status = 1;
             }
         }
         else if (shell_command.arguments.size() == 2) {
             if (chdir(shell_command.arguments[1].c_str()) != 0) {
                 perror("cd");
+                status = 1;
             }
         }
         else {
             cerr << "cd: too many arguments" << endl;
+            status = 1;
         }
         return true;
     }
     else if (shell_command.command == "pwd") {
         try {
             string cwd = get_current_directory();
-            if (write(shell_command.output_fd, cwd.c_str(), cwd.length()) == -1 ||
-                write(shell_command.output_fd, "\n", 1) == -1) {
+            if (write(STDOUT_FILENO, cwd.c_str(), cwd.length()) == -1 ||
+                write(STDOUT_FILENO, "\n", 1) == -1) {
                 perror("pwd");
+                status = 1;
             }
         } catch (const exception& e) {
             cerr << "pwd: " << e.what() << endl;
+            status = 1;
         }
         return true;
     }
+    else if (shell_command.command == "wait") {
+        status = wait_builtin(shell_command.arguments);
+        return true;
+    }
+    else if (shell_command.command == "jobs") {
+        status = jobs_builtin(shell_command.arguments);
+        return true;
+    }
+    else if (shell_command.command == "fg") {
+        status = fg_builtin(shell_command.arguments);
+        return true;
+    }
+    else if (shell_command.command == "bg") {
+        status = bg_builtin(shell_command.arguments);
+        return true;
+    }
+    else if (shell_command.command == "ulimit") {
+        status = ulimit_builtin(shell_command.arguments);
+        return true;
+    }
+    else if (shell_command.command == "history") {
+        status = history_builtin(h, shell_command.arguments);
+        return true;
+    }
     
     return false;
 }
@@ -405,36 +871,100 @@ bool handle_builtin_command(Command& shell_command)
 // Command execution wrapper
 int execute_child_process(Command& shell_command, bool is_background, int pipe_write_fd)
 {
-    // Set up signal handlers for child
-    signal(SIGINT, SIG_DFL);
-    signal(SIGTSTP, SIG_DFL);
     signal(SIGCHLD, SIG_DFL);
 
+    // Substitution pipes have to survive exec
+    for (const auto& sub : shell_command.substitutions) {
+        fcntl(sub.command_fd, F_SETFD, 0);
+    }
+    
+    if (!shell_command.apply_redirections()) {
+        return 1;
+    }
+    
+    if (!shell_command.place.empty()) {
+        string error;
+        if (!apply_placement(shell_command.place, error)) {
+            cerr << "sched: " << error << endl;
+            return 1;
+        }
+    }
+
+    string limit_error;
+    if (!apply_limits(limit_error)) {
+        cerr << "ulimit: " << limit_error << endl;
+        return 1;
+    }
+
+    // Variable builtins in a pipeline or job act on the child's copy
+    if (shell_command.command == "export") {
+        return export_builtin(shell_command.arguments);
+    }
+    else if (shell_command.command == "unset") {
+        return unset_builtin(shell_command.arguments);
+    }
+    else if (shell_command.command == "jobs") {
+        return jobs_builtin(shell_command.arguments);
+    }
+    else if (shell_command.command == "ulimit") {
+        return ulimit_builtin(shell_command.arguments);
+    }
+    else if (shell_command.command == "history") {
+        return history_builtin(h, shell_command.arguments);
+    }
+    
     // Handle special commands
     if (shell_command.command == "delep") {
-        if (shell_command.arguments.size() != 2) {
-            cerr << "delep: usage: delep <filepath>" << endl;
+        delep_options opts;
+        string error;
+        if (!parse_delep_options(shell_command.arguments, opts, error)) {
+            cerr << "delep: " << error << endl;
+            cerr << "delep: usage: delep [--json] [--kill=term|kill|none] [--timeout=SECS] [--dry-run] [--any-user] [--under|--mount] [--container=ID] [--cgroup=PATH] <filepath>..." << endl;
             return -1;
         }
-        delep(const_cast<char*>(shell_command.arguments[1].c_str()), pipe_write_fd);
+        if (opts.scope.empty()) {
+            delep(opts.paths, opts.filter, pipe_write_fd);
+        } else {
+            delep_scope(opts.paths, opts.scope == "mount", opts.filter, pipe_write_fd);
+        }
         return 0;
     }
     else if (shell_command.command == "sb") {
-        if (shell_command.arguments.size() < 2 || shell_command.arguments.size() > 3) {
-            cerr << "sb: usage: sb <PID> [-suggest]" << endl;
+        const vector<string>& arguments = shell_command.arguments;
+        sb_mode mode = SB_SHOW;
+        process_filter filter;
+        bool usage_ok = arguments.size() >= 2;
+        for (size_t i = 2; i < arguments.size() && usage_ok; i++) {
+            const string& arg = arguments[i];
+            if (arg == "-suggest") {
+                mode = SB_SUGGEST;
+            } else if (arg == "-contain") {
+                mode = SB_CONTAIN;
+            } else if (arg == "-tree") {
+                mode = SB_TREE;
+            } else if (arg == "-top") {
+                mode = SB_TOP;
+            } else if (!parse_filter_option(arg, filter)) {
+                usage_ok = false;
+            }
+        }
+        if (!usage_ok) {
+            cerr << "sb: usage: sb <PID> [-suggest | -contain | -tree | -top] [--container=ID] [--cgroup=PATH]" << endl;
+            return -1;
+        }
+        string error;
+        if (!filter.resolve(error)) {
+            cerr << "sb: " << error << endl;
             return -1;
         }
-        
-        bool suggest = (shell_command.arguments.size() == 3 && 
-                       shell_command.arguments[2] == "-suggest");
         
         try {
-            pid_t target_pid = stoi(shell_command.arguments[1]);
-            squashbug sb(target_pid, suggest);
+            pid_t target_pid = stoi(arguments[1]);
+            squashbug sb(target_pid, mode, filter);
             sb.run();
             return 0;
         } catch (const exception& e) {
-            cerr << "sb: invalid PID: " << shell_command.arguments[1] << endl;
+            cerr << "sb: invalid PID: " << arguments[1] << endl;
             return -1;
         }
     }
@@ -443,116 +973,518 @@ int execute_child_process(Command& shell_command, bool is_background, int pipe_w
     return execute_command(shell_command, is_background);
 }
 
-// Process delep command output
-void handle_delep_output(int pipe_read_fd, const string& filename)
+string json_escape(const string& str)
 {
-    vector<char> buffer(MAX_BUFFER_SIZE);
-    string pids_data;
-    ssize_t bytes_read;
-    
-    while ((bytes_read = read(pipe_read_fd, buffer.data(), buffer.size() - 1)) > 0) {
-        buffer[bytes_read] = '\0';
-        pids_data += buffer.data();
+    string out;
+    for (char c : str) {
+        switch (c) {
+            case '"': out += "\\\""; break;
+            case '\\': out += "\\\\"; break;
+            case '\n': out += "\\n"; break;
+            case '\t': out += "\\t"; break;
+            default:
+                if (static_cast<unsigned char>(c) < 0x20) {
+                    char buf[8];
+                    snprintf(buf, sizeof(buf), "\\u%04x", c);
+                    out += buf;
+                } else {
+                    out += c;
+                }
+        }
     }
-    
-    if (bytes_read < 0) {
+    return out;
+}
+
+// One process holding files in a --under/--mount scope
+struct delep_scope_holder {
+    int pid;
+    map<string, string> fields;     // comm, fds, maps, cwd, root, bytes, deleted_bytes
+    vector<pair<unsigned long long, string>> deleted;
+
+    unsigned long long number(const string& key) const {
+        auto it = fields.find(key);
+        return it == fields.end() ? 0 : strtoull(it->second.c_str(), nullptr, 10);
+    }
+};
+
+string format_bytes(unsigned long long bytes)
+{
+    const char* units[] = { "B", "KB", "MB", "GB", "TB" };
+    double value = static_cast<double>(bytes);
+    int unit = 0;
+    while (value >= 1024 && unit < 4) {
+        value /= 1024;
+        unit++;
+    }
+    ostringstream out;
+    if (unit == 0) {
+        out << bytes << " B";
+    } else {
+        out << fixed << setprecision(1) << value << " " << units[unit];
+    }
+    return out.str();
+}
+
+// Results of a delep scan for one path
+struct delep_file_report {
+    vector<pair<int, vector<string>>> lock_pids;    // pid -> decoded locks
+    vector<int> nolock_pids;
+    vector<delep_scope_holder> scope_holders;
+    string error;
+    bool deleted = false;
+    string delete_error;
+};
+
+// Process delep command output
+void handle_delep_output(int pipe_read_fd, const delep_options& opts)
+{
+    capture_buffer& capture = shared_capture();
+    capture.clear();
+    if (!capture.read_all(pipe_read_fd)) {
         perror("read delep output");
         return;
     }
     
-    set<int> pids_lock, pids_nolock;
-    stringstream ss(pids_data);
-    string entry;
+    map<string, delep_file_report> reports;
+    for (const string& path : opts.paths) {
+        reports[path];
+    }
+    map<int, map<string, string>> contexts;    // pidns, mntns, nspid, cgroup
     
-    while (getline(ss, entry, ',')) {
+    // Records are "<type>\t<pid>\t<details>\t<path>", one per line
+    string_view data = capture.view();
+    string entry;
+    for (size_t start = 0, end; start < data.size(); start = end + 1) {
+        end = data.find('\n', start);
+        if (end == string_view::npos) end = data.size();
+        entry.assign(data.substr(start, end - start));
         if (entry.empty()) continue;
         
-        size_t colon_pos = entry.find(':');
-        if (colon_pos == string::npos) continue;
-        
-        string type = entry.substr(0, colon_pos);
-        string pid_str = entry.substr(colon_pos + 1);
+        vector<string> fields;
+        size_t pos = 0;
+        for (int i = 0; i < 3; i++) {
+            size_t tab = entry.find('\t', pos);
+            if (tab == string::npos) break;
+            fields.push_back(entry.substr(pos, tab - pos));
+            pos = tab + 1;
+        }
+        if (fields.size() != 3) continue;
+        fields.push_back(entry.substr(pos));
+        
+        // Not tied to a path
+        if (fields[0] == "Context") {
+            map<string, string>& context = contexts[atoi(fields[1].c_str())];
+            stringstream field_stream(fields[2]);
+            string field;
+            while (getline(field_stream, field, ';')) {
+                size_t eq = field.find('=');
+                if (eq != string::npos) {
+                    context[field.substr(0, eq)] = field.substr(eq + 1);
+                }
+            }
+            continue;
+        }
+        
+        delep_file_report& report = reports[fields[3]];
+        if (fields[0] == "Error") {
+            report.error = fields[2];
+            continue;
+        }
         
         try {
-            int pid = stoi(pid_str);
-            if (type == "Lock") {
-                pids_lock.insert(pid);
-            } else if (type == "NoLock") {
-                pids_nolock.insert(pid);
+            int pid = stoi(fields[1]);
+            if (fields[0] == "Held") {
+                delep_scope_holder holder;
+                holder.pid = pid;
+                stringstream field_stream(fields[2]);
+                string field;
+                while (getline(field_stream, field, ';')) {
+                    size_t eq = field.find('=');
+                    if (eq != string::npos) {
+                        holder.fields[field.substr(0, eq)] = field.substr(eq + 1);
+                    }
+                }
+                report.scope_holders.push_back(holder);
+            } else if (fields[0] == "Deleted" && !report.scope_holders.empty()) {
+                // Follows the Held record of the same process
+                size_t colon = fields[2].find(':');
+                if (colon != string::npos) {
+                    report.scope_holders.back().deleted.push_back(
+                        make_pair(strtoull(fields[2].c_str(), nullptr, 10), fields[2].substr(colon + 1)));
+                }
+            } else if (fields[0] == "Lock") {
+                // Each lock is KIND/MODE/ADVISORY|MANDATORY/start-end
+                vector<string> locks;
+                stringstream lock_stream(fields[2]);
+                string lock;
+                while (getline(lock_stream, lock, ';')) {
+                    locks.push_back(lock);
+                }
+                report.lock_pids.push_back(make_pair(pid, locks));
+            } else if (fields[0] == "NoLock") {
+                report.nolock_pids.push_back(pid);
             }
         } catch (const exception& e) {
-            cerr << "Warning: Invalid PID in delep output: " << pid_str << endl;
+            cerr << "Warning: Invalid PID in delep output: " << fields[1] << endl;
         }
     }
     
-    // Combine all PIDs
-    set<int> all_pids(pids_lock.begin(), pids_lock.end());
-    all_pids.insert(pids_nolock.begin(), pids_nolock.end());
+    // Combine all PIDs across every path
+    set<int> all_pids;
+    for (const auto& report : reports) {
+        for (const auto& holder : report.second.lock_pids) {
+            all_pids.insert(holder.first);
+        }
+        all_pids.insert(report.second.nolock_pids.begin(), report.second.nolock_pids.end());
+        for (const auto& holder : report.second.scope_holders) {
+            all_pids.insert(holder.pid);
+        }
+    }
     
-    if (all_pids.empty()) {
-        cout << "No process has the file open" << endl;
-        return;
+    // Never init, the shell (e.g. its cwd in a scope) or its ancestors, and
+    // other users' processes only when asked for
+    map<pid_t, string> spared;
+    if (opts.kill_mode != "none") {
+        spared = spared_processes(all_pids, opts.any_user);
+        for (const auto& entry : spared) {
+            all_pids.erase(entry.first);
+        }
     }
     
-    // Display results
-    cout << "Following PIDs have opened the given file in lock mode:" << endl;
-    for (int pid : pids_lock) {
-        cout << pid << endl;
+    // Biggest space savings first
+    for (auto& report : reports) {
+        sort(report.second.scope_holders.begin(), report.second.scope_holders.end(),
+             [](const delep_scope_holder& a, const delep_scope_holder& b) {
+                 if (a.number("deleted_bytes") != b.number("deleted_bytes")) {
+                     return a.number("deleted_bytes") > b.number("deleted_bytes");
+                 }
+                 return a.number("bytes") > b.number("bytes");
+             });
     }
     
-    cout << "Following PIDs have opened the given file in normal mode:" << endl;
-    for (int pid : pids_nolock) {
-        cout << pid << endl;
+    // Container processes show up under their host pid; say where they live
+    string own_ns = to_string(own_pid_namespace());
+    auto container_note = [&](int pid) -> string {
+        auto it = contexts.find(pid);
+        if (it == contexts.end() || it->second["pidns"] == "0" || it->second["pidns"] == own_ns) {
+            return "";
+        }
+        return "pid " + it->second["nspid"] + " in pidns " + it->second["pidns"] + ", cgroup " + it->second["cgroup"];
+    };
+    
+    if (!opts.json) {
+        for (const auto& report : reports) {
+            if (reports.size() > 1) {
+                cout << report.first << ":" << endl;
+            }
+            if (!report.second.error.empty()) {
+                cout << "Error: " << report.second.error << endl;
+                continue;
+            }
+            if (!opts.scope.empty()) {
+                if (report.second.scope_holders.empty()) {
+                    cout << "No process holds files " << (opts.scope == "mount" ? "on " : "under ")
+                         << report.first << endl;
+                    continue;
+                }
+                cout << "Processes holding files " << (opts.scope == "mount" ? "on " : "under ")
+                     << report.first << ":" << endl;
+                cout << left << setw(8) << "PID" << setw(17) << "COMMAND" << right
+                     << setw(6) << "FDS" << setw(6) << "MAPS" << setw(5) << "CWD" << setw(5) << "ROOT"
+                     << setw(12) << "HELD" << setw(12) << "DELETED" << endl;
+                for (const auto& holder : report.second.scope_holders) {
+                    cout << left << setw(8) << holder.pid << setw(17) << holder.fields.at("comm") << right
+                         << setw(6) << holder.number("fds") << setw(6) << holder.number("maps")
+                         << setw(5) << (holder.number("cwd") ? "yes" : "-")
+                         << setw(5) << (holder.number("root") ? "yes" : "-")
+                         << setw(12) << format_bytes(holder.number("bytes"))
+                         << setw(12) << format_bytes(holder.number("deleted_bytes")) << endl;
+                    string note = container_note(holder.pid);
+                    if (!note.empty()) {
+                        cout << "    container: " << note << endl;
+                    }
+                    for (const auto& del : holder.deleted) {
+                        cout << "    deleted: " << del.second << " (" << format_bytes(del.first) << ")" << endl;
+                    }
+                }
+                continue;
+            }
+            if (report.second.lock_pids.empty() && report.second.nolock_pids.empty()) {
+                cout << "No process has the file open" << endl;
+                continue;
+            }
+            
+            // Display results
+            cout << "Following PIDs have opened the given file in lock mode:" << endl;
+            for (const auto& holder : report.second.lock_pids) {
+                cout << holder.first;
+                for (string lock : holder.second) {
+                    replace(lock.begin(), lock.end(), '/', ' ');
+                    cout << "  [" << lock << "]";
+                }
+                string note = container_note(holder.first);
+                if (!note.empty()) {
+                    cout << "  (" << note << ")";
+                }
+                cout << endl;
+            }
+            
+            cout << "Following PIDs have opened the given file in normal mode:" << endl;
+            for (int pid : report.second.nolock_pids) {
+                string note = container_note(pid);
+                cout << pid << (note.empty() ? "" : "  (" + note + ")") << endl;
+            }
+        }
     }
     
-    // Ask for confirmation
-    cout << "Do you want to kill all the processes using the file? (yes/no): ";
-    string response;
-    if (!(cin >> response)) {
-        cout << "Error reading response" << endl;
-        return;
+    bool act = !opts.dry_run && opts.kill_mode != "none" && !all_pids.empty();
+    if (act && opts.interactive) {
+        // Ask for confirmation through readline rather than cin so that
+        // buffered input is not shared between the two
+        char* response = readline(opts.scope.empty()
+                                  ? "Do you want to kill all the processes using the file? (yes/no): "
+                                  : "Do you want to kill all the processes holding these files? (yes/no): ");
+        if (!response) {
+            cout << "Error reading response" << endl;
+            return;
+        }
+        act = (strcmp(response, "yes") == 0);
+        free(response);
+        if (!act) {
+            cout << "Exiting..." << endl;
+        }
     }
     
-    if (response == "yes") {
-        for (int pid : all_pids) {
-            if (kill(pid, SIGKILL) == 0) {
-                cout << "Killed process " << pid << endl;
+    vector<kill_result> killed;
+    if (act) {
+        killed = terminate_processes(vector<pid_t>(all_pids.begin(), all_pids.end()),
+                                     opts.kill_mode == "term", opts.timeout);
+        
+        // Scopes are directories or mounts: only the holders are acted on.
+        // A file goes only once every process holding it is seen gone.
+        set<int> gone;
+        for (const auto& result : killed) {
+            if (result.exited) {
+                gone.insert(result.pid);
+            }
+        }
+        for (auto& report : reports) {
+            if (!opts.scope.empty() || !report.second.error.empty() ||
+                (report.second.lock_pids.empty() && report.second.nolock_pids.empty())) {
+                continue;
+            }
+            vector<int> holders = report.second.nolock_pids;
+            for (const auto& holder : report.second.lock_pids) {
+                holders.push_back(holder.first);
+            }
+            auto running = find_if(holders.begin(), holders.end(), [&](int pid) { return !gone.count(pid); });
+            if (running != holders.end()) {
+                report.second.delete_error = "holder still running (pid " + to_string(*running) + ")";
+            } else if (remove(report.first.c_str()) == 0) {
+                report.second.deleted = true;
             } else {
-                cerr << "Failed to kill process " << pid << ": " << strerror(errno) << endl;
+                report.second.delete_error = strerror(errno);
             }
         }
-        
-        if (remove(filename.c_str()) == 0) {
-            cout << "Deleted file " << filename << endl;
+    }
+    
+    if (opts.json) {
+        auto json_context = [&](int pid) -> string {
+            auto it = contexts.find(pid);
+            if (it == contexts.end()) {
+                return "";
+            }
+            return ",\"pid_ns\":" + it->second["pidns"] + ",\"mnt_ns\":" + it->second["mntns"] +
+                   ",\"ns_pid\":" + it->second["nspid"] + ",\"cgroup\":\"" + json_escape(it->second["cgroup"]) + "\"";
+        };
+        ostringstream out;
+        out << "{\"dry_run\":" << (opts.dry_run ? "true" : "false")
+            << ",\"kill\":\"" << opts.kill_mode << "\",\"files\":[";
+        bool first_file = true;
+        for (const auto& report : reports) {
+            out << (first_file ? "" : ",") << "{\"path\":\"" << json_escape(report.first) << "\"";
+            first_file = false;
+            if (!report.second.error.empty()) {
+                out << ",\"error\":\"" << json_escape(report.second.error) << "\"";
+            }
+            out << ",\"holders\":[";
+            bool first_holder = true;
+            for (const auto& holder : report.second.lock_pids) {
+                out << (first_holder ? "" : ",") << "{\"pid\":" << holder.first << json_context(holder.first)
+                    << ",\"locked\":true,\"locks\":[";
+                first_holder = false;
+                for (size_t i = 0; i < holder.second.size(); i++) {
+                    vector<string> parts;
+                    stringstream lock_stream(holder.second[i]);
+                    string part;
+                    while (getline(lock_stream, part, '/')) {
+                        parts.push_back(part);
+                    }
+                    if (parts.size() != 4) continue;
+                    size_t dash = parts[3].find('-');
+                    out << (i ? "," : "") << "{\"kind\":\"" << parts[0] << "\",\"mode\":\"" << parts[1]
+                        << "\",\"mandatory\":" << (parts[2] == "MANDATORY" ? "true" : "false")
+                        << ",\"start\":\"" << parts[3].substr(0, dash)
+                        << "\",\"end\":\"" << (dash == string::npos ? "" : parts[3].substr(dash + 1)) << "\"}";
+                }
+                out << "]}";
+            }
+            for (int pid : report.second.nolock_pids) {
+                out << (first_holder ? "" : ",") << "{\"pid\":" << pid << json_context(pid)
+                    << ",\"locked\":false,\"locks\":[]}";
+                first_holder = false;
+            }
+            for (const auto& holder : report.second.scope_holders) {
+                out << (first_holder ? "" : ",") << "{\"pid\":" << holder.pid << json_context(holder.pid)
+                    << ",\"comm\":\"" << json_escape(holder.fields.at("comm")) << "\""
+                    << ",\"fds\":" << holder.number("fds") << ",\"maps\":" << holder.number("maps")
+                    << ",\"cwd\":" << (holder.number("cwd") ? "true" : "false")
+                    << ",\"root\":" << (holder.number("root") ? "true" : "false")
+                    << ",\"bytes\":" << holder.number("bytes")
+                    << ",\"deleted_bytes\":" << holder.number("deleted_bytes") << ",\"deleted\":[";
+                for (size_t i = 0; i < holder.deleted.size(); i++) {
+                    out << (i ? "," : "") << "{\"path\":\"" << json_escape(holder.deleted[i].second)
+                        << "\",\"bytes\":" << holder.deleted[i].first << "}";
+                }
+                out << "]}";
+                first_holder = false;
+            }
+            out << "],\"deleted\":" << (report.second.deleted ? "true" : "false");
+            if (!report.second.delete_error.empty()) {
+                out << ",\"delete_error\":\"" << json_escape(report.second.delete_error) << "\"";
+            }
+            out << "}";
+        }
+        out << "],\"killed\":[";
+        for (size_t i = 0; i < killed.size(); i++) {
+            out << (i ? "," : "") << "{\"pid\":" << killed[i].pid
+                << ",\"signal\":\"" << (killed[i].signal == SIGKILL ? "KILL" : "TERM")
+                << "\",\"exited\":" << (killed[i].exited ? "true" : "false");
+            if (killed[i].error) {
+                out << ",\"error\":\"" << json_escape(strerror(killed[i].error)) << "\"";
+            }
+            out << "}";
+        }
+        out << "],\"spared\":[";
+        bool first_spared = true;
+        for (const auto& entry : spared) {
+            out << (first_spared ? "" : ",") << "{\"pid\":" << entry.first
+                << ",\"reason\":\"" << json_escape(entry.second) << "\"}";
+            first_spared = false;
+        }
+        out << "]}\n";
+        cout << out.str() << flush;
+        return;
+    }
+    
+    if (opts.dry_run && opts.kill_mode != "none" && !all_pids.empty()) {
+        for (int pid : all_pids) {
+            cout << "Would " << (opts.kill_mode == "term" ? "terminate" : "kill") << " process " << pid << endl;
+        }
+    }
+    
+    for (const auto& entry : spared) {
+        cerr << "Not signalling process " << entry.first << ": " << entry.second << endl;
+    }
+    for (const auto& result : killed) {
+        if (result.error == 0) {
+            cout << (result.signal == SIGKILL ? "Killed" : "Terminated") << " process " << result.pid << endl;
         } else {
-            cerr << "Error deleting file " << filename << ": " << strerror(errno) << endl;
+            cerr << "Failed to kill process " << result.pid << ": " << strerror(result.error) << endl;
+        }
+    }
+    for (const auto& report : reports) {
+        if (report.second.deleted) {
+            cout << "Deleted file " << report.first << endl;
+        } else if (!report.second.delete_error.empty()) {
+            cerr << "Error deleting file " << report.first << ": " << report.second.delete_error << endl;
         }
-    } else {
-        cout << "Exiting..." << endl;
     }
 }
 
-// Parse and execute commands
-vector<string> parse_pipeline(const string& command)
+// The pipeline as written, for the job table
+static string pipeline_text(const compiled_pipeline& commands)
 {
-    vector<string> commands;
-    stringstream ss(command);
-    string cmd;
-    
-    while (getline(ss, cmd, '|')) {
-        delim_remove(cmd);
-        if (!cmd.empty()) {
-            commands.push_back(cmd);
+    string text;
+    for (const auto& stage : commands) {
+        if (!text.empty()) text += " | ";
+        text += stage.text;
+    }
+    return text;
+}
+
+// Start the processes behind a command's <(...) and >(...) words. They
+// run concurrently with the pipeline, in its process group, and are
+// waited for along with it.
+void start_substitutions(Command& shell_command, const pmr::vector<int>& pipe_fds,
+                         const sigset_t& old_mask, pid_t& pgid, bool foreground,
+                         bool grouped, pmr::vector<pid_t>& pids)
+{
+    for (auto& sub : shell_command.substitutions) {
+        pid_t pid = fork();
+        if (pid == -1) {
+            throw runtime_error("Failed to fork: " + string(strerror(errno)));
+        }
+        if (pid == 0) {
+            join_job_group(getpid(), pgid, foreground, grouped);
+            reset_child_signals();
+            sigprocmask(SIG_SETMASK, &old_mask, NULL);
+            dup2(sub.process_fd, sub.output ? STDOUT_FILENO : STDIN_FILENO);
+            // Holding any other pipe end open would keep a reader from
+            // ever seeing end of file. Ends the shell closed already are
+            // -1: their numbers may belong to this command's own pipes now.
+            for (int fd : pipe_fds) {
+                if (fd != -1) close(fd);
+            }
+            for (const auto& other : shell_command.substitutions) {
+                close(other.command_fd);
+                if (other.process_fd != -1) close(other.process_fd);
+            }
+            leave_job_control();
+            restart_line_arena();
+            interactive_shell = false;
+            exit(execute_line(sub.command));
         }
+        join_job_group(pid, pgid, foreground, grouped);
+        pids.push_back(pid);
+        close(sub.process_fd);
+        sub.process_fd = -1;
     }
-    
-    return commands;
 }
 
-void execute_pipeline(const vector<string>& commands)
+// Does the stage start with a "timeout" prefix, possibly after "sched"?
+static bool stage_has_timeout(const pipeline_stage& stage)
 {
-    vector<int> pipe_fds;
-    vector<pid_t> child_pids;
+    bool placed = false;
+    for (const auto& token : stage.tokens) {
+        if (token.kind != command_token::WORD || is_assignment(token.text)) {
+            continue;
+        }
+        if (token.text == "timeout") {
+            return true;
+        }
+        if (!placed && token.text != "sched") {
+            return false;
+        }
+        placed = true;
+    }
+    return false;
+}
+
+int execute_pipeline(const compiled_pipeline& commands, bool background)
+{
+    arena_scope scope;
+    pmr::vector<int> pipe_fds(line_arena());
+    pmr::vector<pid_t> child_pids(line_arena());
+    pmr::vector<pid_t> substitution_pids(line_arena());
+    pid_t pgid = 0;
+    timeout_spec timeout;
+    // A timeout has to reach everything the pipeline starts, so a timed
+    // pipeline gets a process group even without job control
+    bool timed = any_of(commands.begin(), commands.end(), stage_has_timeout);
+    int status = 0;
+    sigset_t old_mask;
+    block_sigchld(old_mask);
     
     try {
         // Create pipes for pipeline
@@ -567,19 +1499,67 @@ void execute_pipeline(const vector<string>& commands)
         
         // Execute each command in the pipeline
         for (size_t i = 0; i < commands.size(); i++) {
-            Command shell_command(commands[i]);
-            
-            // Check for background execution
-                is_background = false;
-            if (!shell_command.arguments.empty() && 
-                shell_command.arguments.back() == "&") {
-                    is_background = true;
-                    shell_command.arguments.pop_back();
+            // A parenthesised stage runs as a subshell and has no Command
+            if (commands[i].group) {
+                pid_t pid = fork();
+                if (pid == -1) {
+                    throw runtime_error("Failed to fork: " + string(strerror(errno)));
                 }
+                if (pid == 0) {
+                    join_job_group(getpid(), pgid, !background, timed);
+                    reset_child_signals();
+                    sigprocmask(SIG_SETMASK, &old_mask, NULL);
+                    if (i > 0) dup2(pipe_fds[(i-1)*2], STDIN_FILENO);
+                    if (i < commands.size() - 1) dup2(pipe_fds[i*2 + 1], STDOUT_FILENO);
+                    for (int fd : pipe_fds) {
+                        if (fd != -1) close(fd);
+                    }
+                    leave_job_control();
+                    restart_line_arena();
+                    interactive_shell = false;
+                    exit(execute_line(commands[i].inner));
+                }
+                join_job_group(pid, pgid, !background, timed);
+                child_pids.push_back(pid);
+                if (i > 0) {
+                    close(pipe_fds[(i-1)*2]);
+                    pipe_fds[(i-1)*2] = -1;
+                }
+                if (i < commands.size() - 1) {
+                    close(pipe_fds[i*2 + 1]);
+                    pipe_fds[i*2 + 1] = -1;
+                }
+                continue;
+            }
+            
+            Command shell_command(commands[i]);
+
+            // Built-in commands run in the shell (only for single commands,
+            // not in pipelines), which keeps the terminal meanwhile
+            bool builtin = commands.size() == 1 && !background && is_builtin_command(shell_command);
+            start_substitutions(shell_command, pipe_fds, old_mask, pgid, !background && !builtin,
+                                timed, substitution_pids);
 
-            // Handle built-in commands (only for single commands, not in pipelines)
-            if (commands.size() == 1 && handle_builtin_command(shell_command)) {
-                return;
+            if (builtin) {
+                {
+                    redirection_guard guard(shell_command);
+                    if (shell_command.apply_redirections()) {
+                        handle_builtin_command(shell_command, status);
+                    } else {
+                        status = 1;
+                    }
+                }
+                for (pid_t pid : substitution_pids) {
+                    waitpid(pid, NULL, 0);
+                }
+                sigprocmask(SIG_SETMASK, &old_mask, NULL);
+                return status;
+            }
+            
+            // The shortest timeout of any stage covers the whole pipeline
+            if (shell_command.timeout.seconds > 0 &&
+                (timeout.seconds == 0 || shell_command.timeout.seconds < timeout.seconds)) {
+                timeout = shell_command.timeout;
             }
             
             // Set up pipes for command
@@ -606,45 +1586,49 @@ void execute_pipeline(const vector<string>& commands)
             
             if (pid == 0) {
                 // Child process
+                join_job_group(getpid(), pgid, !background, timed);
+                reset_child_signals();
+                sigprocmask(SIG_SETMASK, &old_mask, NULL);
                 
                 // Close unused pipe ends
                 for (size_t j = 0; j < pipe_fds.size(); j++) {
-                    if (j != (i-1)*2 && j != i*2 + 1) {
+                    if (j != (i-1)*2 && j != i*2 + 1 && pipe_fds[j] != -1) {
                         close(pipe_fds[j]);
                     }
                 }
                 
                 if (comm_pipe[0] != -1) close(comm_pipe[0]);
                 
-                exit(execute_child_process(shell_command, is_background, 
+                exit(execute_child_process(shell_command, background, 
                                          comm_pipe[1] != -1 ? comm_pipe[1] : -1));
             } else {
                 // Parent process
+                join_job_group(pid, pgid, !background, timed);
                 child_pids.push_back(pid);
                 
-                if (is_background) {
-                    cout << "[" << job_number++ << "] " << pid << endl;
-                    background_pids.insert(pid);
-                } else {
-                    foreground_pid = pid;
-                }
-                
-                // Close used pipe ends
+                // Close used pipe ends; the Command no longer owns them,
+                // and later pipes may reuse their numbers
                 if (i > 0) {
                     close(pipe_fds[(i-1)*2]);
+                    pipe_fds[(i-1)*2] = -1;
+                    shell_command.input_fd = STDIN_FILENO;
                 }
                 if (i < commands.size() - 1) {
                     close(pipe_fds[i*2 + 1]);
+                    pipe_fds[i*2 + 1] = -1;
+                    shell_command.output_fd = STDOUT_FILENO;
                 }
                 
                 // Handle special command output
                 if (shell_command.command == "delep" && comm_pipe[0] != -1) {
                     close(comm_pipe[1]);
-                    if (!is_background) {
-                        int status;
-                        waitpid(pid, &status, 0);
-                        if (shell_command.arguments.size() >= 2) {
-                            handle_delep_output(comm_pipe[0], shell_command.arguments[1]);
+                    if (!background) {
+                        // Drain the pipe before reaping so large reports
+                        // cannot fill it and stall the child
+                        delep_options opts;
+                        string error;
+                        if (parse_delep_options(shell_command.arguments, opts, error)) {
+                            handle_delep_output(comm_pipe[0], opts);
                         }
                     }
                     close(comm_pipe[0]);
@@ -652,78 +1636,651 @@ void execute_pipeline(const vector<string>& commands)
             }
         }
         
-        // Wait for foreground processes
-        if (!is_background) {
-            for (pid_t pid : child_pids) {
-                int status;
-                waitpid(pid, &status, 0);
+        job pipeline_job;
+        pipeline_job.pgid = pgid;
+        pipeline_job.pids.assign(child_pids.begin(), child_pids.end());
+        pipeline_job.pids.insert(pipeline_job.pids.end(), substitution_pids.begin(), substitution_pids.end());
+        pipeline_job.last = child_pids.back();
+        pipeline_job.text = pipeline_text(commands);
+        if (timeout.seconds > 0) {
+            set_job_timeout(pipeline_job, timeout.seconds, timeout.signal, timeout.kill_after);
+        }
+        if (background) {
+            add_job(pipeline_job);
+        } else {
+            // The pipeline's status is that of its last stage
+            status = wait_for_job(pipeline_job, true);
+            reclaim_terminal(pipeline_job);
+            if (pipeline_job.stopped) {
+                add_job(pipeline_job);
             }
         }
         
-        foreground_pid = 0;
-        
     } catch (const exception& e) {
         cerr << "Pipeline execution error: " << e.what() << endl;
+        status = 1;
         
         // Clean up pipes
         for (int fd : pipe_fds) {
-            close(fd);
+            if (fd != -1) close(fd);
         }
         
         // Kill any started processes
+        child_pids.insert(child_pids.end(), substitution_pids.begin(), substitution_pids.end());
         for (pid_t pid : child_pids) {
             kill(pid, SIGKILL);
+            waitpid(pid, NULL, 0);
         }
+        // A foreground group may have been handed the terminal already
+        job failed;
+        reclaim_terminal(failed);
     }
+    
+    sigprocmask(SIG_SETMASK, &old_mask, NULL);
+    return status;
 }
 
-void setup_signal_handlers()
+// One for loop being run
+struct for_frame {
+    string name;
+    vector<string> values;
+    size_t next;
+};
+
+// Index just past the OP_RESTORE matching the OP_REDIRECT before ip
+static size_t skip_to_restore(const program& prog, size_t ip)
 {
-    struct sigaction sa_int;
-    memset(&sa_int, 0, sizeof(sa_int));
-    sa_int.sa_handler = &ctrl_c_handler;
-    if (sigaction(SIGINT, &sa_int, NULL) == -1) {
-        perror("sigaction SIGINT");
+    int depth = 1;
+    for (; ip < prog.code.size(); ip++) {
+        if (prog.code[ip].op == OP_REDIRECT) depth++;
+        if (prog.code[ip].op == OP_RESTORE && --depth == 0) return ip + 1;
+    }
+    return ip;
+}
+
+// A "&" block for the job table: the pipelines it runs
+static string block_text(const program& prog, size_t begin, size_t end)
+{
+    string text;
+    for (size_t ip = begin; ip < end; ip++) {
+        if (prog.code[ip].op != OP_RUN && prog.code[ip].op != OP_RUN_BACKGROUND) continue;
+        if (!text.empty()) text += "; ";
+        text += pipeline_text(prog.pipelines[prog.code[ip].arg]);
+    }
+    return "(" + text + ")";
+}
+
+// "done > file" and the like: the shell's own descriptors, saved while the
+// compound command runs, and the processes of any <(...) or >(...) in the
+// redirections, waited for once the descriptors are back (which is what
+// lets a >(...) see end of file)
+class compound_redirection
+{
+public:
+    explicit compound_redirection(Command& redirections) : guard(redirections)
+    {
+        sigset_t old_mask;
+        block_sigchld(old_mask);
+        pmr::vector<int> no_pipes;
+        pid_t pgid = 0;
+        try {
+            start_substitutions(redirections, no_pipes, old_mask, pgid, false, false, substitution_pids);
+        } catch (...) {
+            sigprocmask(SIG_SETMASK, &old_mask, NULL);
+            throw;
+        }
+        sigprocmask(SIG_SETMASK, &old_mask, NULL);
+    }
+
+    ~compound_redirection()
+    {
+        guard.restore();
+        sigset_t old_mask;
+        block_sigchld(old_mask);
+        for (pid_t pid : substitution_pids) {
+            waitpid(pid, NULL, 0);
+        }
+        sigprocmask(SIG_SETMASK, &old_mask, NULL);
+    }
+
+private:
+    redirection_guard guard;
+    pmr::vector<pid_t> substitution_pids;
+};
+
+// Execute a compiled command list. Pipelines run through execute_pipeline;
+// everything else is jumps over the status of the last one.
+int run_program(const program& prog)
+{
+    int status = last_status;
+    vector<int> loop_status;
+    vector<for_frame> for_frames;
+    vector<unique_ptr<compound_redirection>> redirect_guards;
+    size_t ip = 0;
+    
+    while (ip < prog.code.size()) {
+        if (child_exited) {
+            reap_children();
+        }
+        enforce_deadlines();
+        const instruction& ins = prog.code[ip++];
+        switch (ins.op) {
+        case OP_RUN:
+            status = execute_pipeline(prog.pipelines[ins.arg], false);
+            last_status = status;
+            // Ctrl+C stops the whole list, not just the running command
+            if (interrupted) {
+                interrupted = 0;
+                return status;
+            }
+            break;
+        case OP_RUN_BACKGROUND:
+            execute_pipeline(prog.pipelines[ins.arg], true);
+            status = last_status = 0;
+            break;
+        case OP_JUMP:
+            ip = ins.arg;
+            break;
+        case OP_JUMP_IF_FAIL:
+            if (status != 0) ip = ins.arg;
+            break;
+        case OP_JUMP_IF_OK:
+            if (status == 0) ip = ins.arg;
+            break;
+        case OP_SET_STATUS:
+            status = last_status = static_cast<int>(ins.arg);
+            break;
+        case OP_PUSH_STATUS:
+            loop_status.push_back(0);
+            break;
+        case OP_STORE_STATUS:
+            loop_status.back() = status;
+            break;
+        case OP_POP_STATUS:
+            status = last_status = loop_status.back();
+            loop_status.pop_back();
+            break;
+        case OP_FOR_BEGIN: {
+            const for_loop& loop = prog.loops[ins.arg];
+            for_frame frame = { loop.name, {}, 0 };
+            try {
+                for (const string& raw : loop.words) {
+                    pmr::vector<expanded_word> fields;
+                    expand_word(raw, shell_context(), fields);
+                    for (const auto& field : fields) {
+                        glob_field(field, frame.values);
+                    }
+                }
+            } catch (const exception& e) {
+                cerr << "shell: " << e.what() << endl;
+            }
+            for_frames.push_back(frame);
+            break;
+        }
+        case OP_FOR_NEXT: {
+            for_frame& frame = for_frames.back();
+            if (frame.next == frame.values.size()) {
+                ip = ins.arg;
+            } else {
+                shell_variables.set(frame.name, frame.values[frame.next++]);
+            }
+            break;
+        }
+        case OP_FOR_END:
+            for_frames.pop_back();
+            break;
+        case OP_REDIRECT: {
+            // "done > file": the shell's own descriptors are redirected
+            // for the duration of the compound command
+            bool applied;
+            {
+                // The Command holds the shell's ends of substitution pipes
+                // until it goes; only then may its processes be waited for
+                Command redirections(prog.pipelines[ins.arg][0]);
+                redirect_guards.emplace_back(new compound_redirection(redirections));
+                applied = redirections.apply_redirections();
+            }
+            if (!applied) {
+                redirect_guards.pop_back();
+                status = last_status = 1;
+                ip = skip_to_restore(prog, ip);
+            }
+            break;
+        }
+        case OP_RESTORE:
+            if (!redirect_guards.empty()) {
+                redirect_guards.pop_back();
+            }
+            break;
+        case OP_UNWIND:
+            for (size_t i = 0; i < ins.arg && !redirect_guards.empty(); i++) {
+                redirect_guards.pop_back();
+            }
+            break;
+        case OP_FORK: {
+            // The block up to its OP_EXIT runs as a background job
+            sigset_t old_mask;
+            block_sigchld(old_mask);
+            pid_t pgid = 0;
+            pid_t pid = fork();
+            if (pid == 0) {
+                join_job_group(getpid(), pgid, false);
+                reset_child_signals();
+                sigprocmask(SIG_SETMASK, &old_mask, NULL);
+                leave_job_control();
+                restart_line_arena();
+                break;
+            }
+            if (pid > 0) {
+                join_job_group(pid, pgid, false);
+                job block;
+                block.pgid = pgid;
+                block.pids.push_back(pid);
+                block.last = pid;
+                block.text = block_text(prog, ip, ins.arg);
+                add_job(block);
+            } else {
+                perror("fork");
+            }
+            sigprocmask(SIG_SETMASK, &old_mask, NULL);
+            status = last_status = 0;
+            ip = ins.arg;
+            break;
+        }
+        case OP_EXIT:
+            exit(status);
+        }
     }
+    
+    return status;
+}
 
-    struct sigaction sa_tstp;
-    memset(&sa_tstp, 0, sizeof(sa_tstp));
-    sa_tstp.sa_handler = &ctrl_z_handler;
-    if (sigaction(SIGTSTP, &sa_tstp, NULL) == -1) {
-        perror("sigaction SIGTSTP");
+// Compile (or fetch from the cache) and run a command list
+int execute_line(const string& line)
+{
+    shared_ptr<const program> prog;
+    try {
+        prog = compile_cached(line);
+    } catch (const exception& e) {
+        cerr << "shell: " << e.what() << endl;
+        last_status = 2;
+        return last_status;
     }
+    return run_program(*prog);
+}
 
+// $(pwd) and $(jobs) only print, so they run inside the shell with their
+// output sent to a memfd instead of costing a fork
+static bool capture_builtin(const string& command, capture_buffer& capture)
+{
+    static const set<string> in_process = { "pwd", "jobs" };
+    shared_ptr<const program> prog;
+    try {
+        prog = compile_cached(command);
+    } catch (const exception& e) {
+        return false;
+    }
+    if (prog->code.size() != 1 || prog->code[0].op != OP_RUN) {
+        return false;
+    }
+    const compiled_pipeline& pipeline = prog->pipelines[prog->code[0].arg];
+    if (pipeline.size() != 1 || pipeline[0].group || pipeline[0].tokens.empty() ||
+        in_process.count(pipeline[0].tokens[0].text) == 0) {
+        return false;
+    }
+
+    try {
+        Command shell_command(pipeline[0]);
+        if (!shell_command.file_actions.empty() || !shell_command.substitutions.empty() ||
+            !is_builtin_command(shell_command)) {
+            return false;
+        }
+        int fd = memfd_create("substitution", MFD_CLOEXEC);
+        if (fd == -1) {
+            return false;
+        }
+        cout.flush();
+        int saved = fcntl(STDOUT_FILENO, F_DUPFD_CLOEXEC, 10);
+        dup2(fd, STDOUT_FILENO);
+        int status;
+        handle_builtin_command(shell_command, status);
+        cout.flush();
+        dup2(saved, STDOUT_FILENO);
+        close(saved);
+
+        lseek(fd, 0, SEEK_SET);
+        capture.read_all(fd);
+        close(fd);
+        substitution_status = last_status = status;
+        return true;
+    } catch (const exception& e) {
+        return false;
+    }
+}
+
+// Run the command of a $(...) or `...` and return everything it wrote to
+// standard output
+string command_substitution(const string& command)
+{
+    capture_buffer& capture = shared_capture();
+    capture.clear();
+    if (capture_builtin(command, capture)) {
+        return string(capture.view());
+    }
+
+    int pipefd[2];
+    if (pipe2(pipefd, O_CLOEXEC) == -1) {
+        throw runtime_error("Failed to create pipe: " + string(strerror(errno)));
+    }
+    sigset_t old_mask;
+    block_sigchld(old_mask);
+    pid_t pid = fork();
+    if (pid == -1) {
+        close(pipefd[0]);
+        close(pipefd[1]);
+        sigprocmask(SIG_SETMASK, &old_mask, NULL);
+        throw runtime_error("Failed to fork: " + string(strerror(errno)));
+    }
+    if (pid == 0) {
+        reset_child_signals();
+        sigprocmask(SIG_SETMASK, &old_mask, NULL);
+        dup2(pipefd[1], STDOUT_FILENO);
+        leave_job_control();
+        restart_line_arena();
+        interactive_shell = false;
+        int status = execute_line(command);
+        // _exit: a substitution in a loop must not rewrite the history
+        // file each time through the shell's destructors
+        cout.flush();
+        fflush(NULL);
+        _exit(status);
+    }
+
+    close(pipefd[1]);
+    if (!capture.read_all(pipefd[0])) {
+        perror("read command substitution");
+    }
+    close(pipefd[0]);
+
+    int status;
+    while (waitpid(pid, &status, 0) == -1 && errno == EINTR) {
+    }
+    substitution_status = last_status = decode_wait_status(status);
+    sigprocmask(SIG_SETMASK, &old_mask, NULL);
+    return string(capture.view());
+}
+
+// Run a script file; arguments become $0, $1, ...
+int run_script(const vector<string>& arguments)
+{
+    ifstream file(arguments[0]);
+    if (!file) {
+        cerr << "shell: " << arguments[0] << ": " << strerror(errno) << endl;
+        return 127;
+    }
+    stringstream contents;
+    contents << file.rdbuf();
+    
+    positional_params = arguments;
+    return execute_line(contents.str());
+}
+
+// Scripts keep the default SIGTSTP so they stop like any program; only an
+// interactive shell takes job control
+void setup_signal_handlers(bool interactive)
+{
     struct sigaction sa_child;
     memset(&sa_child, 0, sizeof(sa_child));
     sa_child.sa_handler = &child_signal_handler;
+    sa_child.sa_flags = SA_RESTART;
     if (sigaction(SIGCHLD, &sa_child, NULL) == -1) {
         perror("sigaction SIGCHLD");
     }
+    
+    // No SA_RESTART: a blocking read or wait has to notice Ctrl+C, and
+    // pass it on to a timed job, which is outside the terminal's group
+    struct sigaction sa_int;
+    memset(&sa_int, 0, sizeof(sa_int));
+    sa_int.sa_handler = &ctrl_c_handler;
+    if (sigaction(SIGINT, &sa_int, NULL) == -1) {
+        perror("sigaction SIGINT");
+    }
+
+    if (interactive) {
+        init_job_control();
+    }
 }
 
 void setup_readline()
 {
     rl_initialize();
+    // The shell's own handlers and read_key() deal with signals
+    rl_catch_signals = 0;
+    rl_getc_function = read_key;
     rl_bind_keyseq("\\e[A", key_up_arrow);
     rl_bind_keyseq("\\e[B", key_down_arrow);
     rl_bind_keyseq("\\C-a", key_ctrl_a);
     rl_bind_keyseq("\\C-e", key_ctrl_e);
-    rl_bind_key('\t', rl_insert);
+    rl_attempted_completion_function = shell_completion;
+    rl_bind_key('\t', rl_complete);
+}
+
+// Read a line of stdin when it is not a terminal. Nothing past the newline
+// is consumed, so the commands run see the rest of the input: a file is
+// read in blocks and the offset moved back, a pipe a byte at a time.
+static bool read_input_line(string& line)
+{
+    line.clear();
+    char block[4096];
+    bool seekable = lseek(STDIN_FILENO, 0, SEEK_CUR) != -1;
+    while (true) {
+        ssize_t n = read(STDIN_FILENO, block, seekable ? sizeof(block) : 1);
+        if (n == -1 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return !line.empty();
+        }
+        char* newline = static_cast<char*>(memchr(block, '\n', n));
+        if (!newline) {
+            line.append(block, n);
+            continue;
+        }
+        line.append(block, newline - block);
+        if (seekable) {
+            lseek(STDIN_FILENO, (newline + 1) - (block + n), SEEK_CUR);
+        }
+        return true;
+    }
+}
+
+// The next line of input: from readline in an interactive shell, from
+// stdin otherwise. False at end of input.
+static bool next_line(const string& prompt, string& line)
+{
+    if (!interactive_shell) {
+        return read_input_line(line);
+    }
+    char* input = readline(prompt.c_str());
+    if (!input) {
+        return false;
+    }
+    line = input;
+    free(input);
+    return true;
+}
+
+// Read lines until the text is a complete command list, e.g. until the
+// "done" of a loop typed over several lines. Returns nullptr on a syntax
+// error, Ctrl+C or end of input.
+shared_ptr<const program> read_complete_command(string& command)
+{
+    while (true) {
+        try {
+            return compile_cached(command);
+        } catch (const incomplete_input& e) {
+            string more;
+            if (!next_line("> ", more)) {
+                cerr << "shell: " << e.what() << endl;
+                last_status = 2;
+                return nullptr;
+            }
+            if (interrupted && interactive_shell) {
+                last_status = 130;
+                return nullptr;
+            }
+            command += '\n';
+            command += more;
+        } catch (const exception& e) {
+            cerr << "shell: " << e.what() << endl;
+            last_status = 2;
+            return nullptr;
+        }
+    }
+}
+
+// History entries are single lines
+string history_line(const string& command)
+{
+    string line;
+    for (char c : command) {
+        if (c != '\n') {
+            line += c;
+            continue;
+        }
+        string trimmed = trim_blanks(line);
+        bool joins = trimmed.empty() || trimmed.back() == ';' || trimmed.back() == '|' || trimmed.back() == '&';
+        line += joins ? " " : "; ";
+    }
+    return line;
+}
+
+// Run the commands on stdin one complete command list at a time, as a
+// non-interactive shell does when stdin is not a terminal
+int run_input()
+{
+    string command;
+    while (read_input_line(command)) {
+        delim_remove(command);
+        if (command.empty()) {
+            continue;
+        }
+        shared_ptr<const program> prog = read_complete_command(command);
+        if (prog) {
+            run_program(*prog);
+        }
+    }
+    return last_status;
+}
+
+// Run what the command line asks for: "-c COMMAND [NAME ARGS...]" or a
+// script with its arguments
+int run_arguments(const vector<string>& arguments)
+{
+    if (arguments[0] == "-c") {
+        if (arguments.size() < 2) {
+            cerr << "shell: -c: option requires an argument" << endl;
+            return 2;
+        }
+        positional_params.assign(arguments.begin() + 2, arguments.end());
+        if (positional_params.empty()) {
+            positional_params.push_back("shellkil");
+        }
+        return execute_line(arguments[1]);
+    }
+    return run_script(arguments);
 }
 
-int main()
+// A session of "shellkil --server": the client's working directory and
+// environment replace the server's, then it runs its arguments, or the
+// commands on stdin when there are none
+int run_session(const session_request& request)
+{
+    if (chdir(request.cwd.c_str()) == -1) {
+        cerr << "shell: " << request.cwd << ": " << strerror(errno) << endl;
+        return 1;
+    }
+    vector<char*> envp;
+    for (const auto& entry : request.environment) {
+        envp.push_back(const_cast<char*>(entry.c_str()));
+    }
+    envp.push_back(nullptr);
+    shell_variables = variable_table();
+    shell_variables.import_environment(envp.data());
+    setup_signal_handlers(false);
+
+    if (request.arguments.empty()) {
+        positional_params.assign(1, "shellkil");
+        return run_input();
+    }
+    return run_arguments(request.arguments);
+}
+
+// --startup-profile: report on stderr how long each startup step took
+static bool startup_profile = false;
+
+static void profile_step(const char* step)
+{
+    static auto last = chrono::steady_clock::now();
+    if (!startup_profile) {
+        return;
+    }
+    auto now = chrono::steady_clock::now();
+    cerr << "startup: " << left << setw(14) << step << fixed << setprecision(3)
+         << chrono::duration<double, milli>(now - last).count() << " ms" << endl;
+    cerr.unsetf(ios::floatfield);
+    last = now;
+}
+
+int main(int argc, char* argv[])
 {
     try {
+        profile_step("start");     // starts the clock
+        vector<string> arguments(argv + 1, argv + argc);
+        if (!arguments.empty() && arguments[0] == "--startup-profile") {
+            startup_profile = true;
+            arguments.erase(arguments.begin());
+        }
+        shell_variables.import_environment(environ);
+        profile_step("environment");
+
+        // shellkil --server PATH, shellkil --connect PATH [args...]
+        if (arguments.size() > 1 && arguments[0] == "--server") {
+            return serve_sessions(arguments[1], run_session);
+        }
+        if (arguments.size() > 1 && arguments[0] == "--connect") {
+            return connect_session(arguments[1], vector<string>(arguments.begin() + 2, arguments.end()));
+        }
+        
+        // shellkil -c COMMAND [NAME ARGS...], shellkil script [args...]
+        if (!arguments.empty()) {
+            setup_signal_handlers(false);
+            profile_step("signals");
+            return run_arguments(arguments);
+        }
+        
+        // Without a terminal there is no line to edit: no readline, no
+        // history, just the commands on stdin
+        positional_params.assign(argv, argv + 1);
+        if (!isatty(STDIN_FILENO)) {
+            setup_signal_handlers(false);
+            profile_step("signals");
+            return run_input();
+        }
+
+        interactive_shell = true;
         setup_readline();
-        setup_signal_handlers();
+        profile_step("readline");
+        setup_signal_handlers(true);
+        profile_step("signals");
         
         while (true) {
-            if (sigsetjmp(env, 1) == 42) {
-                cout << endl;
-                continue;
-            }
+            notify_jobs();
+            interrupted = 0;
 
             string prompt = shell_prompt();
+            profile_step("prompt");
+            startup_profile = false;
             char* input = readline(prompt.c_str());
 
             // Handle EOF (Ctrl+D)
@@ -734,18 +2291,38 @@ int main()
 
             string command(input);
             free(input);
+            if (interrupted) {
+                last_status = 130;
+                continue;
+            }
+
+            // HISTCONTROL=ignorespace keeps " cmd" out of the history
+            const char* histcontrol = shell_variables.get("HISTCONTROL");
+            h.set_control(histcontrol ? histcontrol : "");
+            bool keep = !h.ignores(command);
 
             delim_remove(command);
             if (command.empty()) {
                 continue;
             }
 
-            h.add_history(command);
+            shared_ptr<const program> prog = read_complete_command(command);
+            string line = history_line(command);
+            if (keep) {
+                h.add_history(line);
+            }
             
-            // Parse and execute pipeline
-            vector<string> commands = parse_pipeline(command);
-            if (!commands.empty()) {
-                execute_pipeline(commands);
+            // Execute the compiled command list, then record how it went
+            if (prog) {
+                char cwd[PATH_MAX];
+                string start_dir = getcwd(cwd, sizeof(cwd)) ? cwd : "";
+                time_t start = time(nullptr);
+                auto started = chrono::steady_clock::now();
+                run_program(*prog);
+                chrono::duration<double> took = chrono::steady_clock::now() - started;
+                if (keep) {
+                    h.record(line, start_dir, start, took.count(), last_status);
+                }
             }
         }
     } catch (const exception& e) {
@@ -753,7 +2330,5 @@ int main()
         return EXIT_FAILURE;
     }
     
-    // Cleanup
-    free(curr_line);
     return EXIT_SUCCESS;
 }
\ No newline at end of file
@@ -1,6 +1,12 @@
 #include "squashbug.hpp"
+#include <chrono>
+#include <fcntl.h>
+#include <sys/statfs.h>
 
-squashbug::squashbug(pid_t pid, bool suggest) : sbpid(pid), suggest(suggest)
+const long CGROUP2_MAGIC = 0x63677270;     // CGROUP2_SUPER_MAGIC
+
+squashbug::squashbug(pid_t pid, sb_mode mode, const process_filter& filter)
+    : sbpid(pid), mode(mode), filter(filter)
 {   
     if (pid <= 0) {
         throw invalid_argument("Invalid PID: " + to_string(pid));
@@ -21,6 +27,7 @@ void squashbug::build_process_map()
         throw runtime_error("Failed to open /proc directory: " + string(strerror(errno)));
     }
 
+    vector<string> pids;
     struct dirent *entry;
     while ((entry = readdir(dirp)) != NULL) {
         if (!strcmp(entry->d_name, ".") || !strcmp(entry->d_name, "..") || entry->d_type != DT_DIR) {
@@ -32,14 +39,55 @@ void squashbug::build_process_map()
             continue;
         }
 
+        // Other containers are left out before their status is read
+        if (!filter.matches(atoi(entry->d_name))) {
+            continue;
+        }
+        pids.push_back(entry->d_name);
+    }
+    closedir(dirp);
+
+    // All status files in batches rather than an open, reads and a close
+    // per process
+    vector<string> paths;
+    paths.reserve(pids.size());
+    for (const string& pid : pids) {
+        paths.push_back("/proc/" + pid + "/status");
+    }
+    vector<string> contents;
+    vector<bool> read_ok;
+    read_proc_files(paths, contents, read_ok);
+
+    for (size_t i = 0; i < pids.size(); i++) {
+        if (!read_ok[i]) {
+            continue;   // Process might have terminated
+        }
         try {
-            parse_process_status(entry->d_name);
+            parse_process_status(pids[i], contents[i]);
         } catch (const exception& e) {
             // Skip processes we can't read (common for security reasons)
             continue;
         }
     }
-    closedir(dirp);
+    build_children_index();
+}
+
+// One pass over the table; pidMap is ordered, so every child list comes
+// out sorted by pid
+void squashbug::build_children_index()
+{
+    childrenIndex.clear();
+    childrenIndex.reserve(pidMap.size());
+    for (const auto& entry : pidMap) {
+        auto ppid_it = entry.second.find("PPid");
+        if (ppid_it == entry.second.end()) {
+            continue;
+        }
+        pid_t parent = atoi(ppid_it->second.c_str());
+        if (parent != entry.first) {
+            childrenIndex[parent].push_back(entry.first);
+        }
+    }
 }
 
 bool squashbug::is_numeric(const string& str)
@@ -50,35 +98,41 @@ bool squashbug::is_numeric(const string& str)
 
 void squashbug::parse_process_status(const string& pid_str)
 {
-    string status_file = "/proc/" + pid_str + "/status";
-    ifstream file_stream(status_file);
-    
-    if (!file_stream.is_open()) {
+    string status;
+    if (!read_proc_file("/proc/" + pid_str + "/status", status)) {
         return; // Process might have terminated
     }
-    
-    string line;
+    parse_process_status(pid_str, status);
+}
+
+void squashbug::parse_process_status(const string& pid_str, const string& status)
+{
     statusMap status_values;
     
-    while (getline(file_stream, line)) {
-        size_t colon_pos = line.find(':');
-        if (colon_pos == string::npos) {
+    size_t line_start = 0;
+    while (line_start < status.size()) {
+        size_t line_end = status.find('\n', line_start);
+        if (line_end == string::npos) {
+            line_end = status.size();
+        }
+        size_t colon_pos = status.find(':', line_start);
+        if (colon_pos == string::npos || colon_pos > line_end) {
+            line_start = line_end + 1;
             continue;
         }
         
-        string key = line.substr(0, colon_pos);
-        string value = line.substr(colon_pos + 1);
+        string key = status.substr(line_start, colon_pos - line_start);
         
         // Trim whitespace from value
-        size_t start = value.find_first_not_of(" \t");
-        if (start != string::npos) {
-            size_t end = value.find_last_not_of(" \t");
-            value = value.substr(start, end - start + 1);
-        } else {
-            value = "";
+        size_t start = status.find_first_not_of(" \t", colon_pos + 1);
+        string value;
+        if (start != string::npos && start < line_end) {
+            size_t end = status.find_last_not_of(" \t", line_end - 1);
+            value = status.substr(start, end - start + 1);
         }
         
         status_values[key] = value;
+        line_start = line_end + 1;
     }
     
     if (!status_values.empty()) {
@@ -89,18 +143,16 @@ void squashbug::parse_process_status(const string& pid_str)
 
 void squashbug::returnChildren(pid_t pid, set<int> &pids)
 {   
-    for (const auto& entry : pidMap) {
-        auto ppid_it = entry.second.find("PPid");
-        if (ppid_it != entry.second.end()) {
-            try {
-                int parent_pid = stoi(ppid_it->second);
-                if (parent_pid == pid) {
-                    pids.insert(entry.first);
-                    returnChildren(entry.first, pids);
-                }
-            } catch (const exception& e) {
-                // Skip invalid PPid values
-                continue;
+    vector<pid_t> pending = { pid };
+    while (!pending.empty()) {
+        auto it = childrenIndex.find(pending.back());
+        pending.pop_back();
+        if (it == childrenIndex.end()) {
+            continue;
+        }
+        for (pid_t child : it->second) {
+            if (pids.insert(child).second) {
+                pending.push_back(child);
             }
         }
     }
@@ -108,23 +160,9 @@ void squashbug::returnChildren(pid_t pid, set<int> &pids)
 
 int squashbug::countChildren(pid_t pid)
 {
-    int count = 0;
-    for (const auto& entry : pidMap) {
-        auto ppid_it = entry.second.find("PPid");
-        if (ppid_it != entry.second.end()) {
-            try {
-                int parent_pid = stoi(ppid_it->second);
-                if (parent_pid == pid) {
-                    count++;
-                    count += countChildren(entry.first);
-                }
-            } catch (const exception& e) {
-                // Skip invalid PPid values
-                continue;
-            }
-        }
-    }
-    return count;
+    set<int> descendants;
+    returnChildren(pid, descendants);
+    return descendants.size();
 }
 
 string squashbug::get_process_field(pid_t pid, const string& field)
@@ -142,11 +180,50 @@ string squashbug::get_process_field(pid_t pid, const string& field)
     return field_it->second;
     }
 
+// The pid namespace of a process in the table, looked up the first time
+// it is printed and kept next to its status fields; "" for other pids
+string squashbug::namespace_field(pid_t pid)
+{
+    auto pid_it = pidMap.find(pid);
+    if (pid_it == pidMap.end()) {
+        return "";
+    }
+    auto field_it = pid_it->second.find("PidNs");
+    if (field_it == pid_it->second.end()) {
+        field_it = pid_it->second.emplace("PidNs", to_string(pid_namespace(pid))).first;
+    }
+    return field_it->second;
+}
+
+// Where pid lives when that is another pid namespace than its parent's
+// (than sb's own for parent 0 or an unreadable parent); empty otherwise.
+// Container processes show up under their host pid; NSpid has the inner one.
+string squashbug::container_note(pid_t pid, pid_t parent)
+{
+    string ns = namespace_field(pid);
+    string outer = parent ? namespace_field(parent) : "";
+    if (outer.empty() || outer == "0") {
+        outer = to_string(own_pid_namespace());
+    }
+    if (ns.empty() || ns == "0" || ns == outer) {
+        return "";
+    }
+    string ns_pid = get_process_field(pid, "NSpid");
+    ns_pid = ns_pid.substr(ns_pid.find_last_of(" \t") + 1);
+    process_context context;
+    read_process_context(pid, context, false);
+    return "pidns " + ns + ", pid " + ns_pid + ", cgroup " + context.cgroup;
+}
+
 void squashbug::print_process_info(pid_t pid, int process_number)
+{
+    print_process_info(pid, process_number, countChildren(pid));
+}
+
+void squashbug::print_process_info(pid_t pid, int process_number, int children)
 {
     string name = get_process_field(pid, "Name");
     string state = get_process_field(pid, "State");
-    int children = countChildren(pid);
     
     cout << "Process " << process_number << ": ";
     cout << left << setw(20) << setfill(' ') << name;
@@ -155,7 +232,12 @@ void squashbug::print_process_info(pid_t pid, int process_number)
         cout << "State: ";
     cout << left << setw(20) << setfill(' ') << state;
         cout << "Children: ";
-    cout << left << setw(15) << setfill(' ') << children << endl;
+    cout << left << setw(15) << setfill(' ') << children;
+    string note = container_note(pid, 0);
+    if (!note.empty()) {
+        cout << "Container: " << note;
+    }
+    cout << endl;
 }
 
 void squashbug::print_process_tree()
@@ -174,6 +256,10 @@ void squashbug::print_process_tree()
         
         // Walk up the process tree
         while (current_pid > 0 && counter <= 10) { // Limit depth to prevent infinite loops
+            // Ancestors outside a container filter were never read
+            if (pidMap.find(current_pid) == pidMap.end()) {
+                break;
+            }
             print_process_info(current_pid, counter);
             
             string parent_ppid = get_process_field(current_pid, "PPid");
@@ -194,6 +280,83 @@ void squashbug::print_process_tree()
     }
 }
 
+// The subtree of the target, pstree style:
+//
+//   bash(100)
+//   |-make(101)
+//   | `-cc(102)
+//   `-sleep(103)
+//
+// The tree is walked over the children index with an explicit stack,
+// since a chain of forks is as deep as it is long. The lines go into one
+// buffer that is written out at the end; per-line stream output
+// dominates for big trees.
+void squashbug::print_descendant_tree()
+{
+    auto children_of = [&](pid_t pid) -> const vector<pid_t>* {
+        auto it = childrenIndex.find(pid);
+        return it == childrenIndex.end() ? nullptr : &it->second;
+    };
+
+    string out;
+    out.reserve(pidMap.size() * 32);
+    auto append_process = [&](pid_t pid, pid_t parent) {
+        auto pid_it = pidMap.find(pid);
+        if (pid_it != pidMap.end()) {
+            auto name_it = pid_it->second.find("Name");
+            if (name_it != pid_it->second.end()) {
+                out += name_it->second;
+            }
+        }
+        out += '(';
+        out += to_string(pid);
+        out += ')';
+        string note = container_note(pid, parent);
+        if (!note.empty()) {
+            out += " [" + note + "]";
+        }
+        out += '\n';
+    };
+
+    struct frame {
+        pid_t pid;
+        const vector<pid_t>* children;
+        size_t next;
+    };
+    vector<frame> stack = { { sbpid, children_of(sbpid), 0 } };
+    string prefix;          // the "| " and "  " columns of the open levels
+    append_process(sbpid, 0);
+    while (!stack.empty()) {
+        frame& top = stack.back();
+        if (!top.children || top.next == top.children->size()) {
+            stack.pop_back();
+            if (!stack.empty()) {
+                prefix.resize(prefix.size() - 2);
+            }
+            continue;
+        }
+        pid_t pid = (*top.children)[top.next++];
+        bool last = top.next == top.children->size();
+        out += prefix;
+        out += last ? "`-" : "|-";
+        append_process(pid, top.pid);
+        prefix += last ? "  " : "| ";
+        stack.push_back({ pid, children_of(pid), 0 });
+    }
+
+    cout.flush();
+    size_t done = 0;
+    while (done < out.size()) {
+        ssize_t n = write(STDOUT_FILENO, out.data() + done, out.size() - done);
+        if (n == -1) {
+            if (errno == EINTR) continue;
+            cerr << "sb: write failed: " << strerror(errno) << endl;
+            return;
+        }
+        done += n;
+    }
+}
+
 pid_t squashbug::suggest_malicious_process()
 {
     vector<pid_t> candidate_pids;
@@ -299,9 +462,27 @@ void squashbug::run()
         return;
     }
     
+    if (mode == SB_CONTAIN) {
+        contain();
+        cout << "Done." << endl;
+        return;
+    }
+
+    if (mode == SB_TOP) {
+        top();
+        cout << "Done." << endl;
+        return;
+    }
+
+    if (mode == SB_TREE) {
+        print_descendant_tree();
+        cout << "Done." << endl;
+        return;
+    }
+    
     print_process_tree();
     
-    if (suggest) {
+    if (mode == SB_SUGGEST) {
         pid_t suggested_pid = suggest_malicious_process();
         cout << "Suggested Trojan PID is: " << suggested_pid << endl;
         
@@ -313,5 +494,373 @@ void squashbug::run()
     }
     
     cout << "Done." << endl;
+}
+// The one-letter state from /proc/<pid>/stat, or 0 when the process is gone
+static char process_state(pid_t pid)
+{
+    string stat;
+    if (!read_proc_file("/proc/" + to_string(pid) + "/stat", stat)) {
+        return 0;
+    }
+    // The name in parentheses may itself contain ") "
+    size_t close_paren = stat.rfind(')');
+    return close_paren != string::npos && close_paren + 2 < stat.size() ? stat[close_paren + 2] : 0;
+}
+
+// SIGSTOP each pid of pids[begin, end) and collect its children
+static void stop_range(const vector<pid_t>& pids, size_t begin, size_t end, vector<pid_t>& children)
+{
+    for (size_t i = begin; i < end; i++) {
+        if (kill(pids[i], SIGSTOP) == 0) {
+            list_children(pids[i], children);
+        }
+    }
+}
+
+// One level of the sweep, split over threads when there is enough of it:
+// the /proc reads are what takes the time, not the signals
+static vector<pid_t> stop_level(const vector<pid_t>& pids)
+{
+    size_t cores = max(1u, thread::hardware_concurrency());
+    size_t workers = min({ cores, (size_t)SWEEP_MAX_THREADS, pids.size() / SWEEP_PIDS_PER_THREAD + 1 });
+    vector<vector<pid_t>> found(workers);
+    vector<thread> threads;
+    size_t chunk = (pids.size() + workers - 1) / workers;
+    for (size_t w = 1; w < workers; w++) {
+        size_t begin = min(pids.size(), w * chunk);
+        size_t end = min(pids.size(), begin + chunk);
+        threads.emplace_back(stop_range, cref(pids), begin, end, ref(found[w]));
+    }
+    stop_range(pids, 0, min(pids.size(), chunk), found[0]);
+    for (auto& t : threads) {
+        t.join();
+    }
+    for (size_t w = 1; w < workers; w++) {
+        found[0].insert(found[0].end(), found[w].begin(), found[w].end());
+    }
+    return found[0];
+}
+
+// Stop the subtree with repeated sweeps. A stopped process cannot fork
+// again, so a pass that finds every known process stopped and no new
+// children has the whole tree; until then each pass walks down from what
+// the previous one missed. A child whose parent died before it was
+// stopped has been reparented away and is out of reach.
+void squashbug::stop_sweep(set<pid_t>& stopped)
+{
+    vector<pid_t> frontier = { sbpid };
+    stopped.insert(sbpid);
+    for (int pass = 0; pass < SWEEP_MAX_PASSES; pass++) {
+        while (!frontier.empty()) {
+            vector<pid_t> children = stop_level(frontier);
+            frontier.clear();
+            for (pid_t child : children) {
+                if (stopped.insert(child).second) {
+                    frontier.push_back(child);
+                }
+            }
+        }
+
+        // SIGSTOP is asynchronous: wait (briefly) for it to take effect,
+        // then look again for children forked in the meantime
+        auto deadline = chrono::steady_clock::now() + chrono::milliseconds(100);
+        bool all_stopped;
+        do {
+            all_stopped = true;
+            for (auto it = stopped.begin(); it != stopped.end(); ) {
+                char state = process_state(*it);
+                if (state == 0 || state == 'Z' || state == 'X') {
+                    it = stopped.erase(it);
+                    continue;
+                }
+                if (state != 'T' && state != 't') {
+                    all_stopped = false;
+                }
+                ++it;
+            }
+        } while (!all_stopped && chrono::steady_clock::now() < deadline);
+
+        vector<pid_t> known(stopped.begin(), stopped.end());
+        for (pid_t child : stop_level(known)) {
+            if (stopped.insert(child).second) {
+                frontier.push_back(child);
+            }
+        }
+        if (frontier.empty() && all_stopped) {
+            return;
+        }
+    }
+    cerr << "sb: the tree kept changing; some processes may still run" << endl;
+}
+
+// Is pid this process or one of its ancestors? Freezing it would freeze sb
+bool squashbug::is_own_ancestor(pid_t pid)
+{
+    pid_t current = getpid();
+    for (int depth = 0; current > 0 && depth < 4096; depth++) {
+        if (current == pid) {
+            return true;
+        }
+        // A container filter may have left our own ancestors out
+        if (pidMap.find(current) == pidMap.end()) {
+            parse_process_status(to_string(current));
+        }
+        string ppid = get_process_field(current, "PPid");
+        if (ppid.empty()) {
+            break;
+        }
+        current = stoi(ppid);
+    }
+    return false;
+}
+
+// The target's cgroup v2 directory if nothing but the target's subtree
+// lives in it, so freezing the cgroup freezes exactly the subtree
+string squashbug::exclusive_cgroup()
+{
+    string contents;
+    if (!read_proc_file("/proc/" + to_string(sbpid) + "/cgroup", contents)) {
+        return "";
+    }
+    size_t pos = contents.find("0::");
+    if (pos != 0 && (pos == string::npos || contents[pos - 1] != '\n')) {
+        return "";
+    }
+    size_t end = contents.find('\n', pos);
+    string dir = "/sys/fs/cgroup" + contents.substr(pos + 3, end == string::npos ? string::npos : end - pos - 3);
+    if (dir == "/sys/fs/cgroup/") {
+        return "";
+    }
+
+    struct statfs fs;
+    if (statfs(dir.c_str(), &fs) == -1 || fs.f_type != CGROUP2_MAGIC ||
+        access((dir + "/cgroup.freeze").c_str(), W_OK) == -1) {
+        return "";
+    }
+
+    set<int> subtree;
+    returnChildren(sbpid, subtree);
+    subtree.insert(sbpid);
+    if (!read_proc_file(dir + "/cgroup.procs", contents)) {
+        return "";
+    }
+    istringstream procs(contents);
+    pid_t pid;
+    while (procs >> pid) {
+        if (!subtree.count(pid)) {
+            return "";
+        }
+    }
+    return dir;
+}
+
+// Write cgroup.freeze and wait for cgroup.events to confirm it
+bool squashbug::freeze_cgroup(const string& dir, bool freeze)
+{
+    int fd = open((dir + "/cgroup.freeze").c_str(), O_WRONLY | O_CLOEXEC);
+    if (fd == -1) {
+        return false;
+    }
+    bool ok = write(fd, freeze ? "1" : "0", 1) == 1;
+    close(fd);
+    if (!ok || !freeze) {
+        return ok;
+    }
+    auto deadline = chrono::steady_clock::now() + chrono::seconds(1);
+    string events;
+    while (chrono::steady_clock::now() < deadline) {
+        if (read_proc_file(dir + "/cgroup.events", events) && events.find("frozen 1") != string::npos) {
+            return true;
+        }
+        usleep(500);
+    }
+    return false;
+}
+
+void squashbug::contain()
+{
+    if (is_own_ancestor(sbpid)) {
+        cerr << "sb: " << sbpid << " is an ancestor of sb itself; not freezing it" << endl;
+        return;
+    }
+
+    auto started = chrono::steady_clock::now();
+    set<pid_t> frozen;
+    string cgroup = exclusive_cgroup();
+    if (!cgroup.empty() && !freeze_cgroup(cgroup, true)) {
+        freeze_cgroup(cgroup, false);
+        cgroup.clear();
+    }
+    if (cgroup.empty()) {
+        stop_sweep(frozen);
+    }
+    chrono::duration<double, milli> took = chrono::steady_clock::now() - started;
+
+    // The table is stable now: read it again and show what was caught
+    pidMap.clear();
+    build_process_map();
+    if (!cgroup.empty()) {
+        set<int> subtree;
+        returnChildren(sbpid, subtree);
+        frozen.insert(subtree.begin(), subtree.end());
+        frozen.insert(sbpid);
     }
-}
\ No newline at end of file
+    cout << "Froze " << frozen.size() << " processes in " << fixed << setprecision(2) << took.count()
+         << " ms " << (cgroup.empty() ? "(SIGSTOP sweep)" : "(cgroup " + cgroup + ")") << endl;
+    cout.unsetf(ios::floatfield);
+
+    // One countChildren() walk per process is quadratic in a fork bomb:
+    // count descendants bottom-up over a parent index instead
+    map<pid_t, pid_t> parent;
+    for (const auto& entry : pidMap) {
+        auto ppid_it = entry.second.find("PPid");
+        if (ppid_it != entry.second.end() && frozen.count(entry.first)) {
+            parent[entry.first] = atoi(ppid_it->second.c_str());
+        }
+    }
+    map<pid_t, int> descendants;
+    for (const auto& entry : parent) {
+        for (pid_t up = entry.second; frozen.count(up); up = parent[up]) {
+            descendants[up]++;
+            if (up == sbpid) break;
+        }
+    }
+
+    // The biggest subtrees are where the decision is made
+    vector<pid_t> shown(frozen.begin(), frozen.end());
+    sort(shown.begin(), shown.end(), [&](pid_t a, pid_t b) {
+        return descendants[a] != descendants[b] ? descendants[a] > descendants[b] : a < b;
+    });
+    int counter = 1;
+    for (pid_t pid : shown) {
+        if (counter > CONTAIN_SHOW) {
+            cout << "... and " << shown.size() - CONTAIN_SHOW << " more" << endl;
+            break;
+        }
+        print_process_info(pid, counter++, descendants[pid]);
+    }
+
+    cout << "Kill the frozen tree (k), resume it (r) or leave it stopped (l)? ";
+    string response;
+    if (!(cin >> response)) {
+        response = "l";
+    }
+    if (response == "k" || response == "kill") {
+        for (pid_t pid : frozen) {
+            kill(pid, SIGKILL);
+        }
+        if (!cgroup.empty()) {
+            freeze_cgroup(cgroup, false);
+        }
+        cout << "Killed " << frozen.size() << " processes" << endl;
+    } else if (response == "r" || response == "resume") {
+        if (!cgroup.empty()) {
+            freeze_cgroup(cgroup, false);
+        }
+        for (pid_t pid : frozen) {
+            kill(pid, SIGCONT);
+        }
+        cout << "Resumed " << frozen.size() << " processes" << endl;
+    } else {
+        cout << "Left " << frozen.size() << " processes stopped" << endl;
+    }
+}
+
+// Forks since boot, from the "processes" line of /proc/stat
+static long system_forks()
+{
+    string stat;
+    if (!read_proc_file("/proc/stat", stat)) {
+        return -1;
+    }
+    size_t pos = stat.find("\nprocesses ");
+    return pos == string::npos ? -1 : atol(stat.c_str() + pos + 11);
+}
+
+// A top-like view of the subtree: every process is read twice,
+// TOP_INTERVAL_MS apart, and ranked by the CPU it used in between.
+// Children that appear between the two readings and still run are the
+// fork rate of each process; /proc/stat's fork counter gives the rate of
+// the whole system, short-lived children included.
+void squashbug::top()
+{
+    set<int> subtree;
+    returnChildren(sbpid, subtree);
+    subtree.insert(sbpid);
+    vector<pid_t> pids(subtree.begin(), subtree.end());
+
+    auto first_at = chrono::steady_clock::now();
+    long forks_before = system_forks();
+    vector<process_sample> before = sample_processes(pids, false);
+    this_thread::sleep_for(chrono::milliseconds(TOP_INTERVAL_MS));
+    auto second_at = chrono::steady_clock::now();
+    long forks_after = system_forks();
+    vector<process_sample> after = sample_processes(pids, true);
+    double seconds = chrono::duration<double>(second_at - first_at).count();
+
+    struct row {
+        size_t index;
+        double cpu;             // percent of one CPU
+        int forks;
+    };
+    vector<row> rows;
+    double ticks_per_second = sysconf(_SC_CLK_TCK);
+    long page_kib = sysconf(_SC_PAGESIZE) / 1024;
+    double total_cpu = 0;
+    long total_rss = 0;
+    int total_forks = 0;
+    for (size_t i = 0; i < pids.size(); i++) {
+        // A pid reused in between is a different process
+        if (!before[i].alive || !after[i].alive || before[i].name != after[i].name ||
+            after[i].cpu_ticks < before[i].cpu_ticks) {
+            continue;
+        }
+        row r = { i, 0, 0 };
+        r.cpu = (after[i].cpu_ticks - before[i].cpu_ticks) / ticks_per_second / seconds * 100;
+        for (pid_t child : after[i].children) {
+            if (!subtree.count(child)) {
+                r.forks++;
+            }
+        }
+        total_cpu += r.cpu;
+        total_rss += after[i].rss_pages * page_kib;
+        total_forks += r.forks;
+        rows.push_back(r);
+    }
+
+    sort(rows.begin(), rows.end(), [&](const row& a, const row& b) {
+        if (a.cpu != b.cpu) return a.cpu > b.cpu;
+        if (a.forks != b.forks) return a.forks > b.forks;
+        return after[a.index].rss_pages > after[b.index].rss_pages;
+    });
+
+    cout << fixed << setprecision(1);
+    cout << "Sampled " << rows.size() << " processes over " << seconds << " s: "
+         << total_cpu << "% CPU, " << total_rss / 1024.0 << " MiB resident, "
+         << total_forks / seconds << " forks/s";
+    if (forks_before >= 0 && forks_after >= 0) {
+        cout << " (" << (forks_after - forks_before) / seconds << " system-wide)";
+    }
+    cout << endl;
+    cout << right << setw(8) << "PID" << setw(8) << "PPID" << "  S" << setw(8) << "%CPU"
+         << setw(10) << "RSS KiB" << setw(6) << "FDS" << setw(6) << "THR" << setw(9) << "FORKS/s"
+         << "  NAME" << endl;
+    int shown = 0;
+    for (const row& r : rows) {
+        if (shown++ == TOP_SHOW) {
+            cout << "... and " << rows.size() - TOP_SHOW << " more" << endl;
+            break;
+        }
+        const process_sample& p = after[r.index];
+        cout << setw(8) << p.pid << setw(8) << p.ppid << "  " << p.state << setw(8) << r.cpu
+             << setw(10) << p.rss_pages * page_kib << setw(6);
+        if (p.fds >= 0) {
+            cout << p.fds;
+        } else {
+            cout << "-";
+        }
+        cout << setw(6) << p.threads << setw(9) << r.forks / seconds << "  " << p.name << endl;
+    }
+    cout.unsetf(ios::floatfield);
+    cout << left;
+}
@@ -19,6 +19,9 @@
 #include <algorithm>
 #include <stdexcept>
 #include <cerrno>
+#include <thread>
+#include <unordered_map>
+#include "procfs.hpp"
 
 using namespace std;
 
@@ -29,35 +32,72 @@ typedef map<int, statusMap> pid_Map;
 #define NUM_CHILD 5
 #define NUM_CHILD_CHILD 10
 
+// What sb does after printing the ancestors of the target
+enum sb_mode {
+    SB_SHOW,            // nothing more
+    SB_SUGGEST,         // suggest the likely culprit and offer to kill it
+    SB_CONTAIN,         // freeze the target's subtree first, then decide
+    SB_TREE,            // print the target's whole subtree instead
+    SB_TOP,             // sample the subtree's resource use instead
+};
+
+// Upper bounds for the SIGSTOP sweep of -contain
+#define SWEEP_MAX_THREADS 8
+#define SWEEP_PIDS_PER_THREAD 64
+#define SWEEP_MAX_PASSES 50
+#define CONTAIN_SHOW 20             // frozen processes listed
+
+// -top: time between the two readings, and processes listed
+#define TOP_INTERVAL_MS 500
+#define TOP_SHOW 20
+
 class squashbug
 {
     public:
-        squashbug(pid_t pid, bool suggest);
+        // Only the processes filter selects are read from /proc
+        squashbug(pid_t pid, sb_mode mode, const process_filter& filter = process_filter());
         ~squashbug();
         void run();
     private:
         pid_t sbpid;
-        bool suggest;
+        sb_mode mode;
+        process_filter filter;
         pid_Map pidMap;
+        unordered_map<pid_t, vector<pid_t>> childrenIndex;     // by parent, in pid order
         
         // Process map building
         void build_process_map();
+        void build_children_index();
         void parse_process_status(const string& pid_str);
+        void parse_process_status(const string& pid_str, const string& status);
         bool is_numeric(const string& str);
         
         // Process tree operations
         int countChildren(pid_t pid);
         void returnChildren(pid_t pid, set<int>& pids);
         string get_process_field(pid_t pid, const string& field);
+        string namespace_field(pid_t pid);
+        string container_note(pid_t pid, pid_t parent);
         
         // Display functions
         void print_process_tree();
         void print_process_info(pid_t pid, int process_number);
+        void print_process_info(pid_t pid, int process_number, int children);
+        void print_descendant_tree();
+        void top();
         
         // Malware detection and elimination
         pid_t suggest_malicious_process();
         bool confirm_kill();
         void kill_process_tree(pid_t pid);
+        
+        // Containment: stop the whole subtree before anything is printed,
+        // so the tree cannot grow while the user decides
+        void contain();
+        bool is_own_ancestor(pid_t pid);
+        string exclusive_cgroup();
+        bool freeze_cgroup(const string& dir, bool freeze);
+        void stop_sweep(set<pid_t>& stopped);
 };
 
 #endif
\ No newline at end of file
@@ -0,0 +1,375 @@
+#include <iostream>
+#include <sstream>
+#include <vector>
+#include <string>
+#include <cstring>
+#include <cerrno>
+#include <cstdlib>
+#include <climits>
+#include <atomic>
+#include <unistd.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+#include "squashbug.hpp"
+
+using namespace std;
+
+// Synthetic load generator for delep and sb.
+//
+// Spawns N process trees of depth D. Every process opens K descriptors on a
+// pool of M files and takes a lock on each according to the lock mix, then
+// reports a fixed-size record over a shared pipe. Once every process has
+// reported, a single "ready" line is written so a benchmark can start.
+// The shape of the trees, the file each descriptor refers to and the lock
+// kind taken on it depend only on the options, never on timing.
+
+struct loadgen_options {
+    int trees = 1;
+    int depth = 2;
+    int fanout = -1;            // -1 keeps NUM_CHILD / NUM_CHILD_CHILD
+    int fds = 1;
+    int files = 1;
+    string mix = "fpo";         // f = flock, p = POSIX, o = OFD, n = none
+    string dir = ".";
+    int ready_fd = STDOUT_FILENO;
+    int timeout = 0;            // seconds, 0 = until signalled
+    int bomb = 0;               // processes the forker may create, 0 = none
+    bool verbose = false;
+};
+
+// Fixed-size so that every write to the report pipe is atomic (< PIPE_BUF)
+struct ready_record {
+    pid_t pid;
+    pid_t ppid;
+    int tree;
+    int depth;
+    int fds;
+    int locks;
+    int errors;
+};
+
+volatile sig_atomic_t should_exit = 0;
+
+void signal_handler(int signum) {
+    (void)signum;
+    should_exit = 1;
+}
+
+// Sleep until a SIGINT, SIGTERM or SIGALRM arrives. They are blocked
+// around the check of should_exit, so one that lands just before the wait
+// cannot be missed.
+void wait_for_exit_signal() {
+    sigset_t exit_signals, orig_mask;
+    sigemptyset(&exit_signals);
+    sigaddset(&exit_signals, SIGINT);
+    sigaddset(&exit_signals, SIGTERM);
+    sigaddset(&exit_signals, SIGALRM);
+    sigprocmask(SIG_BLOCK, &exit_signals, &orig_mask);
+    while (!should_exit) {
+        sigsuspend(&orig_mask);
+    }
+    sigprocmask(SIG_SETMASK, &orig_mask, NULL);
+}
+
+void usage(const char* prog) {
+    cerr << "Usage: " << prog << " [-n trees] [-d depth] [-f fanout] [-k fds] [-m files]"
+         << " [-l mix] [-p dir] [-r fd] [-t seconds] [-b N] [-v]" << endl;
+    cerr << "  -n N     number of process trees (default 1)" << endl;
+    cerr << "  -d D     depth of each tree below its root (default 2)" << endl;
+    cerr << "  -f F     children per node at every level (default "
+         << NUM_CHILD << " then " << NUM_CHILD_CHILD << ")" << endl;
+    cerr << "  -k K     descriptors held by each process (default 1)" << endl;
+    cerr << "  -m M     number of lock files (default 1)" << endl;
+    cerr << "  -l MIX   lock kinds cycled per descriptor: f=flock p=POSIX o=OFD n=none (default fpo)" << endl;
+    cerr << "  -p DIR   directory for lock files (default .)" << endl;
+    cerr << "  -r FD    write the ready line to FD instead of stdout" << endl;
+    cerr << "  -t SECS  exit after SECS seconds (default: until SIGINT/SIGTERM)" << endl;
+    cerr << "  -b N     once ready, fork as fast as possible up to N more processes" << endl;
+    cerr << "  -v       print one line per process once ready" << endl;
+}
+
+int fanout_at(const loadgen_options& opts, int level) {
+    if (opts.fanout >= 0) return opts.fanout;
+    return level == 0 ? NUM_CHILD : NUM_CHILD_CHILD;
+}
+
+// Number of processes in a subtree whose root sits at the given level
+long subtree_size(const loadgen_options& opts, int level) {
+    if (level >= opts.depth) return 1;
+    return 1 + fanout_at(opts, level) * subtree_size(opts, level + 1);
+}
+
+string lock_file_path(const loadgen_options& opts, int index) {
+    return opts.dir + "/lock" + to_string(index) + ".txt";
+}
+
+// Take the lock selected by the mix. Byte ranges are unique per (process,
+// descriptor) so POSIX and OFD locks never conflict with one another.
+bool take_lock(int fd, char kind, long ordinal, bool write_mode) {
+    struct flock fl;
+    memset(&fl, 0, sizeof(fl));
+    fl.l_type = write_mode ? F_WRLCK : F_RDLCK;
+    fl.l_whence = SEEK_SET;
+    fl.l_start = ordinal;
+    fl.l_len = 1;
+
+    switch (kind) {
+        case 'f':
+            return flock(fd, LOCK_SH | LOCK_NB) == 0;
+        case 'p':
+            return fcntl(fd, F_SETLK, &fl) == 0;
+        case 'o':
+            return fcntl(fd, F_OFD_SETLK, &fl) == 0;
+        default:
+            return true;
+    }
+}
+
+void run_node(const loadgen_options& opts, int report_fd, int tree, int level, long ordinal)
+{
+    ready_record rec;
+    memset(&rec, 0, sizeof(rec));
+    rec.pid = getpid();
+    rec.ppid = getppid();
+    rec.tree = tree;
+    rec.depth = level;
+
+    // Spawn the next level before reporting so that a complete set of
+    // records means the whole tree exists, and before opening anything so
+    // that no child inherits this node's descriptors and locks
+    if (level < opts.depth) {
+        long child_size = subtree_size(opts, level + 1);
+        for (int c = 0; c < fanout_at(opts, level); c++) {
+            pid_t pid = fork();
+            if (pid == -1) {
+                rec.errors++;
+                continue;
+            }
+            if (pid == 0) {
+                run_node(opts, report_fd, tree, level + 1, ordinal + 1 + c * child_size);
+                _exit(0);
+            }
+        }
+    }
+
+    // Descriptors stay open for the lifetime of the process
+    for (int j = 0; j < opts.fds; j++) {
+        long slot = ordinal * opts.fds + j;
+        string path = lock_file_path(opts, static_cast<int>(slot % opts.files));
+        int fd = open(path.c_str(), O_RDWR);
+        if (fd == -1) {
+            rec.errors++;
+            continue;
+        }
+        rec.fds++;
+
+        char kind = opts.mix[slot % opts.mix.size()];
+        if (kind == 'n') continue;
+        if (take_lock(fd, kind, slot, (j % 2) == 0)) {
+            rec.locks++;
+        } else {
+            rec.errors++;
+        }
+    }
+
+    if (write(report_fd, &rec, sizeof(rec)) != static_cast<ssize_t>(sizeof(rec))) {
+        _exit(1);
+    }
+    close(report_fd);
+
+    wait_for_exit_signal();
+
+    while (waitpid(-1, NULL, WNOHANG) > 0) {
+    }
+}
+
+// A stand-in for a fork bomb, for timing sb -contain: every process it
+// creates forks again at once, until the shared budget runs out, then
+// waits to be signalled
+void run_bomb(atomic<long>* budget)
+{
+    while (!should_exit) {
+        if (budget->fetch_sub(1) <= 0) {
+            budget->fetch_add(1);
+            wait_for_exit_signal();
+            continue;
+        }
+        pid_t pid = fork();
+        if (pid == -1) {
+            budget->fetch_add(1);
+            wait_for_exit_signal();
+        }
+    }
+}
+
+bool parse_int(const char* str, int& value) {
+    char* end = nullptr;
+    errno = 0;
+    long v = strtol(str, &end, 10);
+    if (errno != 0 || end == str || *end != '\0' || v < 0 || v > INT_MAX) {
+        return false;
+    }
+    value = static_cast<int>(v);
+    return true;
+}
+
+int main(int argc, char* argv[])
+{
+    loadgen_options opts;
+    int opt;
+    bool ok = true;
+
+    while ((opt = getopt(argc, argv, "n:d:f:k:m:l:p:r:t:b:vh")) != -1) {
+        switch (opt) {
+            case 'n': ok = parse_int(optarg, opts.trees); break;
+            case 'd': ok = parse_int(optarg, opts.depth); break;
+            case 'f': ok = parse_int(optarg, opts.fanout); break;
+            case 'k': ok = parse_int(optarg, opts.fds); break;
+            case 'm': ok = parse_int(optarg, opts.files) && opts.files > 0; break;
+            case 'l':
+                opts.mix = optarg;
+                ok = !opts.mix.empty() && opts.mix.find_first_not_of("fpon") == string::npos;
+                break;
+            case 'p': opts.dir = optarg; break;
+            case 'r': ok = parse_int(optarg, opts.ready_fd); break;
+            case 't': ok = parse_int(optarg, opts.timeout); break;
+            case 'b': ok = parse_int(optarg, opts.bomb); break;
+            case 'v': opts.verbose = true; break;
+            default:
+                usage(argv[0]);
+                return opt == 'h' ? 0 : 1;
+        }
+        if (!ok) {
+            cerr << "Error: invalid value for -" << static_cast<char>(opt) << ": " << optarg << endl;
+            usage(argv[0]);
+            return 1;
+        }
+    }
+
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = signal_handler;
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+
+    for (int i = 0; i < opts.files; i++) {
+        string path = lock_file_path(opts, i);
+        int fd = open(path.c_str(), O_RDWR | O_CREAT, 0644);
+        if (fd == -1) {
+            cerr << "Error: Cannot create " << path << ": " << strerror(errno) << endl;
+            return 1;
+        }
+        close(fd);
+    }
+
+    int report_pipe[2];
+    if (pipe(report_pipe) == -1) {
+        cerr << "Error: Cannot create report pipe: " << strerror(errno) << endl;
+        return 1;
+    }
+
+    long per_tree = subtree_size(opts, 0);
+    long expected = per_tree * opts.trees;
+    vector<pid_t> roots;
+
+    for (int t = 0; t < opts.trees; t++) {
+        pid_t pid = fork();
+        if (pid == -1) {
+            cerr << "Error: fork failed: " << strerror(errno) << endl;
+            should_exit = 1;
+            break;
+        }
+        if (pid == 0) {
+            close(report_pipe[0]);
+            run_node(opts, report_pipe[1], t, 0, t * per_tree);
+            _exit(0);
+        }
+        roots.push_back(pid);
+    }
+    close(report_pipe[1]);
+
+    // Collect one record per process; EOF means every writer has gone
+    vector<ready_record> records;
+    records.reserve(expected);
+    while (static_cast<long>(records.size()) < expected && !should_exit) {
+        ready_record rec;
+        ssize_t n = read(report_pipe[0], &rec, sizeof(rec));
+        if (n == static_cast<ssize_t>(sizeof(rec))) {
+            records.push_back(rec);
+        } else if (n == 0 || (n == -1 && errno != EINTR)) {
+            break;
+        }
+    }
+    close(report_pipe[0]);
+
+    long total_fds = 0, total_locks = 0, total_errors = 0;
+    for (const auto& rec : records) {
+        total_fds += rec.fds;
+        total_locks += rec.locks;
+        total_errors += rec.errors;
+    }
+
+    ostringstream out;
+    if (opts.verbose) {
+        for (const auto& rec : records) {
+            out << "proc pid=" << rec.pid << " ppid=" << rec.ppid << " tree=" << rec.tree
+                << " depth=" << rec.depth << " fds=" << rec.fds << " locks=" << rec.locks
+                << " errors=" << rec.errors << "\n";
+        }
+    }
+    out << (static_cast<long>(records.size()) == expected ? "ready" : "partial")
+        << " procs=" << records.size() << " expected=" << expected
+        << " fds=" << total_fds << " locks=" << total_locks
+        << " errors=" << total_errors << " root=" << getpid() << "\n";
+    string line = out.str();
+    if (write(opts.ready_fd, line.c_str(), line.length()) == -1) {
+        cerr << "Error: Cannot write ready line: " << strerror(errno) << endl;
+    }
+
+    // The forker gets a process group of its own, so its processes (which
+    // never report) can be torn down together
+    pid_t bomb = 0;
+    if (opts.bomb > 0) {
+        void* shared = mmap(nullptr, sizeof(atomic<long>), PROT_READ | PROT_WRITE,
+                            MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+        if (shared == MAP_FAILED) {
+            cerr << "Error: Cannot map the fork budget: " << strerror(errno) << endl;
+        } else {
+            atomic<long>* budget = new (shared) atomic<long>(opts.bomb - 1);
+            bomb = fork();
+            if (bomb == 0) {
+                setpgid(0, 0);
+                run_bomb(budget);
+                _exit(0);
+            }
+            if (bomb > 0) {
+                setpgid(bomb, bomb);
+            }
+        }
+    }
+
+    if (opts.timeout > 0) {
+        alarm(opts.timeout);
+        sigaction(SIGALRM, &sa, NULL);
+    }
+    wait_for_exit_signal();
+
+    // Every process reported its pid, so no process group is needed to
+    // tear the trees down
+    for (const auto& rec : records) {
+        kill(rec.pid, SIGTERM);
+    }
+    if (bomb > 0) {
+        kill(-bomb, SIGKILL);
+        waitpid(bomb, NULL, 0);
+    }
+    for (pid_t pid : roots) {
+        waitpid(pid, NULL, 0);
+    }
+    return 0;
+}
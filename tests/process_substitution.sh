@@ -0,0 +1,31 @@
+#!/bin/sh
+# <(...) and >(...) as the redirection of a compound command: the shell
+# starts the process, and a >(...) is waited for once the loop is done.
+# Usage: tests/process_substitution.sh [path/to/shellkil]
+
+SHELLKIL=${1:-bin/shellkil}
+script=$(mktemp)
+trap 'rm -f "$script"' EXIT
+
+cat > "$script" <<'SCRIPT'
+while read l; do echo got $l; done < <(printf "a\nb\n")
+for i in 1 2; do echo line $i; done > >(sed 's/^/sub: /')
+while read l; do echo first $l; break; done < <(seq 1 100000)
+echo after
+SCRIPT
+
+expected='got a
+got b
+sub: line 1
+sub: line 2
+first 1
+after'
+
+actual=$(timeout 10 "$SHELLKIL" "$script" 2>&1)
+if [ "$actual" != "$expected" ]; then
+    echo "FAIL: process substitution in compound redirections"
+    echo "expected:"; echo "$expected"
+    echo "got:"; echo "$actual"
+    exit 1
+fi
+echo "PASS: process substitution in compound redirections"
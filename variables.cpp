@@ -0,0 +1,264 @@
+#include "variables.hpp"
+#include <algorithm>
+#include <cstring>
+#include <cctype>
+
+using namespace std;
+
+const size_t INITIAL_SLOTS = 64;
+const size_t ARENA_BLOCK_SIZE = 16384;
+// Compact once this much of the arena is dead and it is most of it
+const size_t COMPACT_MIN_GARBAGE = 65536;
+
+variable_table shell_variables;
+
+variable_table::variable_table()
+    : slots(INITIAL_SLOTS), live(0), used(0),
+      block_used(0), block_size(0), arena_bytes(0), garbage_bytes(0)
+{
+    for (auto& s : slots) {
+        s.state = EMPTY;
+    }
+    envp.push_back(nullptr);
+}
+
+bool variable_table::valid_name(string_view name)
+{
+    if (name.empty() || (!isalpha(static_cast<unsigned char>(name[0])) && name[0] != '_')) {
+        return false;
+    }
+    for (char c : name) {
+        if (!isalnum(static_cast<unsigned char>(c)) && c != '_') {
+            return false;
+        }
+    }
+    return true;
+}
+
+// FNV-1a
+uint32_t variable_table::hash_name(string_view name)
+{
+    uint32_t hash = 2166136261u;
+    for (char c : name) {
+        hash ^= static_cast<unsigned char>(c);
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+size_t variable_table::find_slot(string_view name, uint32_t hash) const
+{
+    size_t mask = slots.size() - 1;
+    for (size_t i = hash & mask; ; i = (i + 1) & mask) {
+        const slot& s = slots[i];
+        if (s.state == EMPTY) {
+            return SIZE_MAX;
+        }
+        if (s.state == LIVE && s.hash == hash && s.name_len == name.size() &&
+            memcmp(s.record, name.data(), name.size()) == 0) {
+            return i;
+        }
+    }
+}
+
+char* variable_table::store_record(string_view name, string_view value)
+{
+    size_t len = name.size() + 1 + value.size() + 1;
+    if (blocks.empty() || block_used + len > block_size) {
+        block_size = max(ARENA_BLOCK_SIZE, len);
+        blocks.emplace_back(new char[block_size]);
+        block_used = 0;
+    }
+
+    char* record = blocks.back().get() + block_used;
+    memcpy(record, name.data(), name.size());
+    record[name.size()] = '=';
+    memcpy(record + name.size() + 1, value.data(), value.size());
+    record[len - 1] = '\0';
+
+    block_used += len;
+    arena_bytes += len;
+    return record;
+}
+
+void variable_table::grow()
+{
+    vector<slot> old;
+    old.swap(slots);
+    slots.resize(old.size() * 2);
+    for (auto& s : slots) {
+        s.state = EMPTY;
+    }
+
+    // Rehashing drops tombstones
+    size_t mask = slots.size() - 1;
+    for (const auto& s : old) {
+        if (s.state != LIVE) continue;
+        size_t i = s.hash & mask;
+        while (slots[i].state != EMPTY) {
+            i = (i + 1) & mask;
+        }
+        slots[i] = s;
+    }
+    used = live;
+}
+
+void variable_table::compact()
+{
+    vector<unique_ptr<char[]>> old_blocks;
+    old_blocks.swap(blocks);
+    block_used = block_size = 0;
+    arena_bytes = garbage_bytes = 0;
+
+    for (auto& s : slots) {
+        if (s.state != LIVE) continue;
+        string_view name(s.record, s.name_len);
+        string_view value(s.record + s.name_len + 1);
+        s.record = store_record(name, value);
+        if (s.exported) {
+            envp[s.env_index] = s.record;
+        }
+    }
+}
+
+void variable_table::env_add(slot& s)
+{
+    s.env_index = static_cast<uint32_t>(envp.size() - 1);
+    envp.back() = s.record;
+    envp.push_back(nullptr);
+}
+
+void variable_table::env_remove(slot& s)
+{
+    // Move the last record into the hole so removal stays O(1)
+    size_t last = envp.size() - 2;
+    char* moved = envp[last];
+    envp[s.env_index] = moved;
+    envp[last] = nullptr;
+    envp.pop_back();
+
+    if (moved != s.record) {
+        string_view moved_name(moved, strchr(moved, '=') - moved);
+        size_t index = find_slot(moved_name, hash_name(moved_name));
+        if (index != SIZE_MAX) {
+            slots[index].env_index = s.env_index;
+        }
+    }
+}
+
+void variable_table::import_environment(char** environment)
+{
+    for (char** entry = environment; entry && *entry; entry++) {
+        const char* eq = strchr(*entry, '=');
+        if (!eq) continue;
+        string_view name(*entry, eq - *entry);
+        if (!valid_name(name)) continue;
+        set(name, eq + 1);
+        set_exported(name, true);
+    }
+}
+
+const char* variable_table::get(string_view name) const
+{
+    size_t index = find_slot(name, hash_name(name));
+    if (index == SIZE_MAX) {
+        return nullptr;
+    }
+    return slots[index].record + slots[index].name_len + 1;
+}
+
+void variable_table::set(string_view name, string_view value)
+{
+    uint32_t hash = hash_name(name);
+    size_t index = find_slot(name, hash);
+
+    if (index != SIZE_MAX) {
+        slot& s = slots[index];
+        garbage_bytes += strlen(s.record) + 1;
+        s.record = store_record(name, value);
+        if (s.exported) {
+            envp[s.env_index] = s.record;
+        }
+        if (garbage_bytes > COMPACT_MIN_GARBAGE && garbage_bytes * 2 > arena_bytes) {
+            compact();
+        }
+        return;
+    }
+
+    if ((used + 1) * 10 > slots.size() * 7) {
+        grow();
+    }
+
+    size_t mask = slots.size() - 1;
+    size_t i = hash & mask;
+    while (slots[i].state == LIVE) {
+        i = (i + 1) & mask;
+    }
+    if (slots[i].state == EMPTY) {
+        used++;
+    }
+    live++;
+
+    slot& s = slots[i];
+    s.hash = hash;
+    s.name_len = static_cast<uint32_t>(name.size());
+    s.record = store_record(name, value);
+    s.state = LIVE;
+    s.exported = false;
+    s.env_index = 0;
+}
+
+void variable_table::set_exported(string_view name, bool exported)
+{
+    size_t index = find_slot(name, hash_name(name));
+    if (index == SIZE_MAX) {
+        if (!exported) return;
+        set(name, "");
+        index = find_slot(name, hash_name(name));
+    }
+
+    slot& s = slots[index];
+    if (s.exported == exported) return;
+    s.exported = exported;
+    if (exported) {
+        env_add(s);
+    } else {
+        env_remove(s);
+    }
+}
+
+bool variable_table::is_exported(string_view name) const
+{
+    size_t index = find_slot(name, hash_name(name));
+    return index != SIZE_MAX && slots[index].exported;
+}
+
+void variable_table::unset(string_view name)
+{
+    size_t index = find_slot(name, hash_name(name));
+    if (index == SIZE_MAX) return;
+
+    slot& s = slots[index];
+    if (s.exported) {
+        env_remove(s);
+    }
+    garbage_bytes += strlen(s.record) + 1;
+    s.state = DELETED;
+    live--;
+}
+
+char** variable_table::environment()
+{
+    return envp.data();
+}
+
+vector<pair<string, string>> variable_table::list(bool exported_only) const
+{
+    vector<pair<string, string>> result;
+    for (const auto& s : slots) {
+        if (s.state != LIVE || (exported_only && !s.exported)) continue;
+        result.emplace_back(string(s.record, s.name_len), string(s.record + s.name_len + 1));
+    }
+    sort(result.begin(), result.end());
+    return result;
+}
@@ -0,0 +1,72 @@
+#ifndef __VARIABLES_HPP
+#define __VARIABLES_HPP
+
+#include <string>
+#include <string_view>
+#include <vector>
+#include <memory>
+#include <utility>
+#include <cstdint>
+
+// Shell variables in an open-addressing hash table. Every variable is
+// stored once as a "NAME=VALUE\0" record in a chunked arena, so exported
+// variables can be handed to execve() without copying: the envp array
+// points straight at the records and is patched in place as exports
+// change instead of being rebuilt for every spawn.
+class variable_table
+{
+public:
+    variable_table();
+
+    // Load NAME=VALUE strings (e.g. environ) as exported variables
+    void import_environment(char** envp);
+
+    // nullptr when the variable is unset
+    const char* get(std::string_view name) const;
+    void set(std::string_view name, std::string_view value);
+    void set_exported(std::string_view name, bool exported);
+    bool is_exported(std::string_view name) const;
+    void unset(std::string_view name);
+
+    // NULL-terminated envp of the exported variables, valid until the
+    // next modification of the table
+    char** environment();
+
+    // All (or only exported) variables sorted by name
+    std::vector<std::pair<std::string, std::string>> list(bool exported_only) const;
+
+    static bool valid_name(std::string_view name);
+
+private:
+    enum slot_state : uint8_t { EMPTY, LIVE, DELETED };
+
+    struct slot {
+        uint32_t hash;
+        uint32_t name_len;
+        char* record;           // "NAME=VALUE\0" inside the arena
+        uint32_t env_index;     // position in envp when exported
+        slot_state state;
+        bool exported;
+    };
+
+    std::vector<slot> slots;                    // capacity is a power of two
+    size_t live, used;                          // used counts tombstones too
+
+    std::vector<std::unique_ptr<char[]>> blocks;
+    size_t block_used, block_size;
+    size_t arena_bytes, garbage_bytes;
+
+    std::vector<char*> envp;                    // exported records + NULL
+
+    static uint32_t hash_name(std::string_view name);
+    size_t find_slot(std::string_view name, uint32_t hash) const;
+    char* store_record(std::string_view name, std::string_view value);
+    void grow();
+    void compact();
+    void env_add(slot& s);
+    void env_remove(slot& s);
+};
+
+extern variable_table shell_variables;
+
+#endif